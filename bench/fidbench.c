@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "npfs.h"
+
+/*
+ * Compares the fid table of a connection with the hash chains it
+ * replaced: 64 chains, each found fid moved to the front, all under
+ * the connection lock. For 10, 1000 and 100000 fids it times
+ *
+ *	lookup	looking up a random fid and taking a reference to it,
+ *		from -t threads at once
+ *	churn	creating and destroying a fid while the others stay,
+ *		as a walk followed by a clunk does
+ *
+ * and prints the ns per operation of both.
+ */
+
+typedef struct Oldpool Oldpool;
+typedef struct Looker Looker;
+
+enum {
+	Oldsize		= 64,
+	Maxthreads	= 64,
+};
+
+struct Oldpool {
+	pthread_mutex_t	lock;
+	Npfid*		htable[Oldsize];
+};
+
+struct Looker {
+	pthread_t	thread;
+	int		old;
+	u32		nfids;
+	u32		rand;
+};
+
+static int nthreads = 1;
+static int nlookups = 200000;
+static int nchurn = 200000;
+static Oldpool oldpool;
+static Npsrv srv;
+static Npconn conn;
+static pthread_barrier_t barrier;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: fidbench [-t threads] [-n lookups] [-c churn]\n");
+	exit(1);
+}
+
+static void
+fatal(char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static u64
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the chains, as they were */
+static Npfid *
+old_find(Oldpool *pool, u32 fid)
+{
+	int hash;
+	Npfid *f, **prevp;
+
+	hash = fid % Oldsize;
+	pthread_mutex_lock(&pool->lock);
+	prevp = &pool->htable[hash];
+	f = *prevp;
+	while (f != NULL) {
+		if (f->fid == fid) {
+			*prevp = f->next;
+			f->next = pool->htable[hash];
+			pool->htable[hash] = f;
+			break;
+		}
+
+		prevp = &f->next;
+		f = *prevp;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return f;
+}
+
+static Npfid *
+old_create(Oldpool *pool, u32 fid)
+{
+	int hash;
+	Npfid *f;
+
+	if (old_find(pool, fid))
+		return NULL;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+
+	f->fid = fid;
+	f->conn = &conn;
+	hash = fid % Oldsize;
+	pthread_mutex_lock(&pool->lock);
+	f->next = pool->htable[hash];
+	pool->htable[hash] = f;
+	pthread_mutex_unlock(&pool->lock);
+	return f;
+}
+
+static void
+old_destroy(Oldpool *pool, Npfid *fid)
+{
+	Npfid *f, **prevp;
+
+	pthread_mutex_lock(&pool->lock);
+	prevp = &pool->htable[fid->fid % Oldsize];
+	for(f = *prevp; f != NULL; prevp = &f->next, f = *prevp) {
+		if (f == fid) {
+			*prevp = f->next;
+			free(f);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static u32
+nextrand(u32 *r)
+{
+	*r = *r * 1103515245 + 12345;
+	return *r >> 8;
+}
+
+static void *
+lookproc(void *a)
+{
+	int i;
+	Looker *l;
+	Npfid *f;
+
+	l = a;
+	pthread_barrier_wait(&barrier);
+	for(i = 0; i < nlookups; i++) {
+		if (l->old) {
+			f = old_find(&oldpool, 1 + nextrand(&l->rand) % l->nfids);
+			if (f) {
+				__atomic_fetch_add(&f->refcount, 1, __ATOMIC_ACQUIRE);
+				__atomic_fetch_sub(&f->refcount, 1, __ATOMIC_RELEASE);
+			}
+		} else {
+			f = np_fid_get(&conn, 1 + nextrand(&l->rand) % l->nfids);
+			np_fid_decref(f);
+		}
+
+		if (!f)
+			fatal("lost a fid");
+	}
+
+	return NULL;
+}
+
+static double
+lookups(int old, u32 nfids)
+{
+	int i;
+	u64 start;
+	Looker lookers[Maxthreads];
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for(i = 0; i < nthreads; i++) {
+		lookers[i].old = old;
+		lookers[i].nfids = nfids;
+		lookers[i].rand = i;
+		pthread_create(&lookers[i].thread, NULL, lookproc, &lookers[i]);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = nsec();
+	for(i = 0; i < nthreads; i++)
+		pthread_join(lookers[i].thread, NULL);
+
+	pthread_barrier_destroy(&barrier);
+	return (double) (nsec() - start) / ((double) nlookups * nthreads);
+}
+
+static double
+churn(int old, u32 nfids)
+{
+	int i;
+	u64 start;
+	Npfid *f;
+
+	start = nsec();
+	for(i = 0; i < nchurn; i++) {
+		if (old) {
+			f = old_create(&oldpool, nfids + 1);
+			if (f)
+				old_destroy(&oldpool, f);
+		} else {
+			f = np_fid_create(&conn, nfids + 1, NULL);
+			if (f)
+				np_fid_destroy(f);
+		}
+
+		if (!f)
+			fatal("cannot create a fid");
+	}
+
+	return (double) (nsec() - start) / nchurn;
+}
+
+static void
+run(u32 nfids)
+{
+	u32 i;
+	Npfid *f, **fids;
+	double oldlook, newlook, oldchurn, newchurn;
+
+	fids = calloc(nfids, sizeof(*fids));
+	if (!fids)
+		fatal("no memory");
+
+	memset(&oldpool, 0, sizeof(oldpool));
+	pthread_mutex_init(&oldpool.lock, NULL);
+	conn.fidpool = np_fidpool_create();
+	if (!conn.fidpool)
+		fatal("no memory");
+
+	for(i = 0; i < nfids; i++) {
+		if (!old_create(&oldpool, i + 1))
+			fatal("cannot create a fid");
+
+		f = np_fid_create(&conn, i + 1, NULL);
+		if (!f)
+			fatal("cannot create a fid");
+
+		np_fid_incref(f);
+		fids[i] = f;
+	}
+
+	oldlook = lookups(1, nfids);
+	newlook = lookups(0, nfids);
+	oldchurn = churn(1, nfids);
+	newchurn = churn(0, nfids);
+	printf("%-8u %12.1f %12.1f %12.1f %12.1f\n", nfids, oldlook, newlook,
+		oldchurn, newchurn);
+
+	for(i = 0; i < nfids; i++)
+		np_fid_decref(fids[i]);
+
+	for(i = 0; i < Oldsize; i++)
+		while ((f = oldpool.htable[i]) != NULL)
+			old_destroy(&oldpool, f);
+
+	/* the library has no way to free a pool, connections keep theirs */
+	free(fids);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	char *s;
+
+	while ((c = getopt(argc, argv, "t:n:c:")) != -1) {
+		switch (c) {
+		case 't':
+			nthreads = strtol(optarg, &s, 10);
+			if (*s != '\0' || nthreads < 1 || nthreads > Maxthreads)
+				usage();
+			break;
+
+		case 'n':
+			nlookups = strtol(optarg, &s, 10);
+			if (*s != '\0' || nlookups < 1)
+				usage();
+			break;
+
+		case 'c':
+			nchurn = strtol(optarg, &s, 10);
+			if (*s != '\0' || nchurn < 1)
+				usage();
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	conn.srv = &srv;
+	printf("%d threads, ns per operation\n", nthreads);
+	printf("%-8s %12s %12s %12s %12s\n", "fids", "old lookup",
+		"new lookup", "old churn", "new churn");
+	run(10);
+	run(1000);
+	run(100000);
+	return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <errno.h>
+
+/*
+ * Counts the allocations of a process, for npbench -a:
+ *
+ *	LD_PRELOAD=./malloccount.so ./npbench -a
+ *
+ * The threads that call malloccount_ignore, the clients of npbench,
+ * are not counted.
+ */
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+
+static unsigned long long nallocs;
+static __thread int ignored;
+
+static void
+count(void)
+{
+	if (!ignored)
+		__atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long long
+malloccount(void)
+{
+	return __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+}
+
+void
+malloccount_ignore(void)
+{
+	ignored = 1;
+}
+
+void *
+malloc(size_t size)
+{
+	count();
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	count();
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	count();
+	return __libc_realloc(p, size);
+}
+
+int
+posix_memalign(void **p, size_t align, size_t size)
+{
+	count();
+	*p = __libc_memalign(align, size);
+	return *p ? 0 : ENOMEM;
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	count();
+	return __libc_memalign(align, size);
+}
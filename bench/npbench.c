@@ -0,0 +1,1444 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/socket.h>
+#include "npfs.h"
+#include "casafs.h"
+#include "dirtab.h"
+
+/*
+ * Load generator. Serves an npfile or a dirtab tree over socketpairs
+ * and drives it with a built-in 9P client. Each connection has its
+ * own thread that keeps depth operations in flight. An operation is
+ * one of:
+ *
+ *	walk	walk to a small file, open it, read it and clunk it
+ *	stat	stat a small file
+ *	read	read iosize bytes of the big file, sequentially, and
+ *		check them
+ *	write	write iosize bytes to the big file, sequentially
+ *	fid	walk to, walk in place, stat or clunk one of a few fids
+ *		shared by the lanes of a connection
+ *	list	open the directory and read all of it, Listsize bytes
+ *		at a time, checking that every file is listed once
+ *	path	walk d0/d1/.../leaf in one Twalk and clunk, or walk
+ *		one that fails part of the way, through a missing name
+ *		or past the file, and check the qids of the names that
+ *		were found. In the npfile tree some of the paths go
+ *		back up with ".."
+ *
+ * The mix sets how often each one runs, -m walk=4,stat=4,read=1 does
+ * four walks and four stats for every read. At the end it prints the
+ * operations per second, the MB/s read and written, and the latency
+ * of the operations.
+ *
+ * -f sets the number of small files, the big one and d0 are listed
+ * after them.
+ * In the npfile tree the big file is served with readfd from a
+ * temporary file, the reads of Sendfilemin bytes or more go out with
+ * sendfile, the smaller ones are copied with pread.
+ * -L speaks 9P2000.L: the files are opened with Tlopen, stat is
+ * Tgetattr and list reads the directory with Treaddir.
+ * -x indexes the npfile directory by name, see npfile_index.
+ * -a counts the allocations of the server in the second half of the
+ * run, it needs LD_PRELOAD=./malloccount.so. With the message caches
+ * warm there should be none per operation.
+ * -m walk=1,stat=1 with -c and -w set to the number of CPUs shows how
+ * lookups in one directory scale with the workers.
+ * -m fid with a big -d makes walks and clunks of the same fids race in
+ * the server, build it with -fsanitize=thread or address to check the
+ * fid table. Errors are expected then, after the run each shared fid
+ * has to be clunked and walked again without one.
+ * -l makes the first connection flood the server with that many
+ * operations in flight, and -r sets how many requests a connection
+ * may have before the server stops reading from it. The latencies of
+ * each connection are printed, the others should not starve. Use it
+ * with small operations, a client that is not reading while it sends
+ * a window of reads can fill both socket buffers.
+ */
+
+typedef struct Lane Lane;
+typedef struct Conn Conn;
+typedef struct Lat Lat;
+typedef struct Path Path;
+
+enum {
+	Opwalk,
+	Opstat,
+	Opread,
+	Opwrite,
+	Opfid,
+	Oplist,
+	Oppath,
+	Nops,
+
+	Smallsize	= 4096,
+	Bigsize		= 256*1024*1024,
+	Patsize		= 65536 + 4096,	/* data pattern, > any iosize */
+	Maxdepth	= 256,
+	Maxseq		= 1024,
+	Nshared		= 8,		/* fids shared by the lanes */
+	Listsize	= 256,		/* a few entries per directory read */
+	Ndeep		= 4,		/* directories d0/d1/... above leaf */
+
+	/* dirtab qid paths */
+	Dtroot		= 0,
+	Dtbig,
+	Dtdeep,
+	Dtleaf		= Dtdeep + Ndeep,
+	Dtsmall,
+	Dtnobody	= 0xff,
+	Maxdtsmall	= Dtnobody - Dtsmall,
+};
+
+/* an operation in flight */
+struct Lane {
+	int		op;
+	int		step;		/* messages of it done */
+	int		n;		/* operations done */
+	u64		start;
+	u64		roff;
+	u64		woff;
+	u64		doff;		/* of the next directory read */
+	int		nents;		/* entries listed */
+	u32		rand;
+};
+
+/* a walk of the path op and the qids it finds, indices of deeppath */
+struct Path {
+	char*		names[Ndeep + 2];
+	int		nqid;
+	int		qids[Ndeep + 2];
+};
+
+/* latencies in ns */
+struct Lat {
+	u32*		v;
+	int		n;
+	int		size;
+};
+
+struct Conn {
+	int		fd;
+	int		depth;
+	pthread_t	thread;
+	int		inflight;
+	u8*		rbuf;
+	u8*		wbuf;
+	Lane		lanes[Maxdepth];
+	u64		nops[Nops];
+	u64		bytes;
+	Lat		lat[Nops];
+};
+
+static char *opnames[Nops] = {
+	[Opwalk] = "walk",
+	[Opstat] = "stat",
+	[Opread] = "read",
+	[Opwrite] = "write",
+	[Opfid] = "fid",
+	[Oplist] = "list",
+	[Oppath] = "path",
+};
+
+static int depth = 1;
+static int flood;
+static int maxreqs = -1;
+static int nsmall = 16;
+static int indexed;
+static int dotl;
+static int nconns = 1;
+static int nworkers = 4;
+static int seconds = 5;
+static int iosize = 65536;
+static u32 msize;
+static int seq[Maxseq];
+static int nseq;
+static int stop;
+static pthread_barrier_t barrier;
+static u8 pattern[Patsize];
+static int bigfd = -1;
+static int dotdot;			/* the backend can walk ".." */
+static u64 deeppath[Ndeep + 1];		/* qid paths of d0/d1/.../leaf */
+
+static Path paths[] = {
+	{ {"d0", "d1", "d2", "d3", "leaf"}, 5, {0, 1, 2, 3, 4} },
+	{ {"d0", "d1", "nope", "d3"}, 2, {0, 1} },
+	{ {"d0", "d1", "d2", "d3", "leaf", "x"}, 5, {0, 1, 2, 3, 4} },
+	/* needs dotdot, keep it last */
+	{ {"d0", "d1", "..", "d1", "d2"}, 5, {0, 1, 0, 1, 2} },
+};
+static unsigned long long (*nallocs)(void);
+static void (*ignoreallocs)(void);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: npbench [-b file|dirtab] [-m op=weight,...] [-f files] [-x] [-a] [-L] [-d depth] [-l flood] [-r maxreqs] [-c conns] [-w workers] [-t seconds] [-s iosize]\n");
+	fprintf(stderr, " ops: walk (walk/open/read/clunk), stat, read and write (sequential, iosize bytes), fid, list, path\n");
+	exit(1);
+}
+
+static void
+fatal(char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static u64
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* fills data with the content of a file at offset, returns the count */
+static int
+filldata(u8 *data, u64 offset, u32 count, u64 size)
+{
+	if (offset >= size)
+		return 0;
+
+	if (offset + count > size)
+		count = size - offset;
+
+	memmove(data, pattern + offset % 4096, count);
+	return count;
+}
+
+/* the npfile tree */
+static Npfile *
+file_first(Npfile *dir)
+{
+	if (dir->dirfirst)
+		npfile_incref(dir->dirfirst);
+
+	return dir->dirfirst;
+}
+
+static Npfile *
+file_next(Npfile *dir, Npfile *prevchild)
+{
+	if (prevchild->next)
+		npfile_incref(prevchild->next);
+
+	return prevchild->next;
+}
+
+static int
+file_read(Npfilefid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
+{
+	return filldata(data, offset, count, fid->file->length);
+}
+
+static int
+file_write(Npfilefid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
+{
+	return count;
+}
+
+/* the big file is read from bigfd, which holds the pattern, as filldata */
+static int
+big_readfd(Npfilefid *fid, u64 offset, u32 count, int *fd, u64 *fdoff,
+	Npreq *req)
+{
+	if (offset >= fid->file->length)
+		return 0;
+
+	if (offset + count > fid->file->length)
+		count = fid->file->length - offset;
+
+	*fd = bigfd;
+	*fdoff = offset % 4096;
+	return count;
+}
+
+static Npdirops file_dirops = {
+	.first = file_first,
+	.next = file_next,
+};
+
+static Npfileops file_fileops = {
+	.read = file_read,
+	.write = file_write,
+};
+
+static Npfileops big_fileops = {
+	.write = file_write,
+	.readfd = big_readfd,
+};
+
+static void
+mkbigfd(void)
+{
+	char path[] = "/tmp/npbenchXXXXXX";
+
+	bigfd = mkstemp(path);
+	if (bigfd < 0)
+		fatal("mkstemp: %d", errno);
+
+	unlink(path);
+	if (write(bigfd, pattern, Patsize) != Patsize)
+		fatal("write: %d", errno);
+}
+
+/* adds a file at the end of dir */
+static Npfile *
+mkfile(Npfile *dir, char *name, u32 mode, u64 qpath, void *ops)
+{
+	Npfile *f;
+
+	f = npfile_alloc(dir, name, mode, qpath, ops, NULL);
+	f->uid = f->muid = dir->uid;
+	f->gid = dir->gid;
+	npfile_incref(f);
+	if (dir->dirlast) {
+		dir->dirlast->next = f;
+		f->prev = dir->dirlast;
+	} else
+		dir->dirfirst = f;
+	dir->dirlast = f;
+
+	return f;
+}
+
+static Npfile *
+mkfiletree(void)
+{
+	int i;
+	char name[16];
+	Npfile *root, *f, *dir;
+
+	mkbigfd();
+	root = npfile_alloc(NULL, "", Dmdir|0777, 0, &file_dirops, NULL);
+	root->parent = root;
+	root->uid = root->muid = np_uid2user(getuid());
+	root->gid = np_gid2group(getgid());
+	npfile_incref(root);
+	for(i = 0; i < nsmall + 1; i++) {
+		if (i < nsmall)
+			snprintf(name, sizeof(name), "f%d", i);
+		else
+			strcpy(name, "big");
+
+		f = mkfile(root, name, 0666, i + 1,
+			i < nsmall ? &file_fileops : &big_fileops);
+		f->length = i < nsmall ? Smallsize : Bigsize;
+	}
+
+	dir = root;
+	for(i = 0; i < Ndeep + 1; i++) {
+		deeppath[i] = nsmall + 2 + i;
+		if (i < Ndeep) {
+			snprintf(name, sizeof(name), "d%d", i);
+			dir = mkfile(dir, name, Dmdir|0777, deeppath[i],
+				&file_dirops);
+		} else {
+			f = mkfile(dir, "leaf", 0666, deeppath[i],
+				&file_fileops);
+			f->length = Smallsize;
+		}
+	}
+
+	dotdot = 1;
+	if (indexed && !npfile_index(root))
+		fatal("cannot index the tree");
+
+	return root;
+}
+
+/* the dirtab tree, and the functions dirtab wants from its users */
+void
+dt2qid(Dirtab *dtentry, Npqid *qid, void *ignore)
+{
+	qid->type = dtentry->qidtype;
+	qid->version = 0;
+	qid->path = dtentry->qidpath;
+}
+
+void
+dt2fid(Dirtab *dtentry, Fid *fid, char *filename, void *ignore)
+{
+	dt2qid(dtentry, &fid->qid, ignore);
+	fid->filename = filename;
+}
+
+Npfcall *
+return_read(Npfcall *ret, int n)
+{
+	if (np_haserror()) {
+		np_fcall_free(ret);
+		ret = NULL;
+	} else
+		np_set_rread_count(ret, n);
+
+	return ret;
+}
+
+Npfcall *
+return_write(int n)
+{
+	if (np_haserror())
+		return NULL;
+
+	return np_create_rwrite(n);
+}
+
+static Npfcall *
+dt_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req)
+{
+	u64 size;
+
+	size = f->qid.path == Dtbig ? Bigsize : Smallsize;
+	return return_read(ret, filldata(ret->data, offset, count, size));
+}
+
+static Npfcall *
+dt_write(Fid *f, u64 offset, u32 count, u8 *data, Npreq *req)
+{
+	return return_write(count);
+}
+
+static NpDtfileops dt_dirops;
+
+static NpDtfileops dt_fileops = {
+	.read = dt_read,
+	.write = dt_write,
+};
+
+static Dirtab *
+mkdirtab(int *n)
+{
+	int i;
+	Dirtab *dt;
+
+	*n = nsmall + 2 + Ndeep + 1;
+	dt = calloc(*n, sizeof(*dt));
+	if (!dt)
+		fatal("no memory");
+
+	strcpy(dt[0].name, "bench");
+	dt[0].qidpath = Dtroot;
+	dt[0].qidtype = Qtdir;
+	dt[0].parentpath = Dtnobody;
+	dt[0].fops = &dt_dirops;
+
+	strcpy(dt[1].name, "big");
+	dt[1].qidpath = Dtbig;
+	dt[1].qidtype = Qtfile;
+	dt[1].parentpath = Dtroot;
+	dt[1].fops = &dt_fileops;
+
+	for(i = 0; i < nsmall; i++) {
+		snprintf(dt[2 + i].name, KNAMELEN, "f%d", i);
+		dt[2 + i].qidpath = Dtsmall + i;
+		dt[2 + i].qidtype = Qtfile;
+		dt[2 + i].parentpath = Dtroot;
+		dt[2 + i].fops = &dt_fileops;
+	}
+
+	dt += 2 + nsmall;
+	for(i = 0; i < Ndeep + 1; i++) {
+		deeppath[i] = Dtdeep + i;
+		if (i < Ndeep) {
+			snprintf(dt[i].name, KNAMELEN, "d%d", i);
+			dt[i].qidtype = Qtdir;
+			dt[i].fops = &dt_dirops;
+		} else {
+			strcpy(dt[i].name, "leaf");
+			dt[i].qidtype = Qtfile;
+			dt[i].fops = &dt_fileops;
+		}
+
+		dt[i].qidpath = Dtdeep + i;
+		dt[i].parentpath = i ? Dtdeep + i - 1 : Dtroot;
+	}
+
+	return dt - 2 - nsmall;
+}
+
+/* the client */
+static u8 *
+p16(u8 *p, u16 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static u8 *
+p32(u8 *p, u32 v)
+{
+	p = p16(p, v);
+	return p16(p, v >> 16);
+}
+
+static u8 *
+p64(u8 *p, u64 v)
+{
+	p = p32(p, v);
+	return p32(p, v >> 32);
+}
+
+static u8 *
+pstr(u8 *p, char *s)
+{
+	int n;
+
+	n = strlen(s);
+	p = p16(p, n);
+	memmove(p, s, n);
+	return p + n;
+}
+
+static u32
+g16(u8 *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static u32
+g32(u8 *p)
+{
+	return g16(p) | (g16(p + 2) << 16);
+}
+
+static u64
+g64(u8 *p)
+{
+	return g32(p) | ((u64) g32(p + 4) << 32);
+}
+
+static u8 *
+hdr(u8 *b, int type, int tag)
+{
+	b[4] = type;
+	p16(b + 5, tag);
+	return b + 7;
+}
+
+static void
+msend(Conn *c, u8 *p)
+{
+	int n, len;
+	u8 *b;
+
+	b = c->wbuf;
+	len = p - b;
+	p32(b, len);
+	while (len > 0) {
+		n = write(c->fd, b, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fatal("write: %d", errno);
+		}
+
+		b += n;
+		len -= n;
+	}
+}
+
+/* reads a message, returns its type */
+static int
+mrecv(Conn *c)
+{
+	int n, got, need;
+
+	got = 0;
+	need = 4;
+	while (got < need) {
+		n = read(c->fd, c->rbuf + got, need - got);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			fatal("read: %d", n < 0 ? errno : 0);
+		}
+
+		got += n;
+		if (got >= 4) {
+			need = g32(c->rbuf);
+			if (need < 7 || need > msize)
+				fatal("bad message size %d", need);
+		}
+	}
+
+	return c->rbuf[4];
+}
+
+static int
+iserror(Conn *c)
+{
+	return c->rbuf[4] == Rerror || c->rbuf[4] == Rlerror;
+}
+
+static void
+rerror(Conn *c)
+{
+	if (c->rbuf[4] == Rlerror)
+		fatal("error: %s", strerror(g32(c->rbuf + 7)));
+
+	fatal("error: %.*s", g16(c->rbuf + 7), c->rbuf + 9);
+}
+
+static void
+rpc(Conn *c, u8 *p, int rtype)
+{
+	int type;
+
+	msend(c, p);
+	type = mrecv(c);
+	if (iserror(c))
+		rerror(c);
+
+	if (type != rtype)
+		fatal("expected %d, got %d", rtype, type);
+}
+
+/* Topen, or Tlopen with the same mode as flags */
+static u8 *
+openmsg(Conn *c, int tag, u32 fid, int mode)
+{
+	u8 *p;
+
+	if (dotl) {
+		p = hdr(c->wbuf, Tlopen, tag);
+		p = p32(p, fid);
+		p = p32(p, mode);
+	} else {
+		p = hdr(c->wbuf, Topen, tag);
+		p = p32(p, fid);
+		*p++ = mode;
+	}
+
+	return p;
+}
+
+/* Tstat, or Tgetattr */
+static u8 *
+statmsg(Conn *c, int tag, u32 fid)
+{
+	u8 *p;
+
+	if (dotl) {
+		p = hdr(c->wbuf, Tgetattr, tag);
+		p = p32(p, fid);
+		p = p64(p, Gabasic);
+	} else {
+		p = hdr(c->wbuf, Tstat, tag);
+		p = p32(p, fid);
+	}
+
+	return p;
+}
+
+/* the fids of a lane, and the ones shared by all */
+#define LANEFID(l, n)	(1 + (l)*4 + (n))
+#define SHAREDFID(n)	(0x10000 + (n))
+
+static void
+setup(Conn *c)
+{
+	int l;
+	char name[16], *ver;
+	u8 *b, *p;
+
+	b = c->wbuf;
+	ver = dotl ? "9P2000.L" : "9P2000";
+	p = hdr(b, Tversion, NOTAG);
+	p = p32(p, msize);
+	p = pstr(p, ver);
+	rpc(c, p, Rversion);
+	if (g16(c->rbuf + 11) != strlen(ver) ||
+	    memcmp(c->rbuf + 13, ver, strlen(ver)) != 0)
+		fatal("the server doesn't speak %s", ver);
+
+	p = hdr(b, Tattach, 0);
+	p = p32(p, 0);
+	p = p32(p, NOFID);
+	p = pstr(p, "root");
+	p = pstr(p, "");
+	if (dotl)
+		p = p32(p, getuid());
+	rpc(c, p, Rattach);
+
+	for(l = 0; l < c->depth; l++) {
+		snprintf(name, sizeof(name), "f%d", l % nsmall);
+		p = hdr(b, Twalk, l);
+		p = p32(p, 0);
+		p = p32(p, LANEFID(l, 1));
+		p = p16(p, 1);
+		p = pstr(p, name);
+		rpc(c, p, Rwalk);
+
+		p = hdr(b, Twalk, l);
+		p = p32(p, 0);
+		p = p32(p, LANEFID(l, 2));
+		p = p16(p, 1);
+		p = pstr(p, "big");
+		rpc(c, p, Rwalk);
+
+		p = openmsg(c, l, LANEFID(l, 2), Oread);
+		rpc(c, p, dotl ? Rlopen : Ropen);
+
+		p = hdr(b, Twalk, l);
+		p = p32(p, 0);
+		p = p32(p, LANEFID(l, 3));
+		p = p16(p, 1);
+		p = pstr(p, "big");
+		rpc(c, p, Rwalk);
+
+		p = openmsg(c, l, LANEFID(l, 3), Owrite);
+		rpc(c, p, dotl ? Rlopen : Ropen);
+	}
+}
+
+static Path *
+lanepath(int l, Lane *ln)
+{
+	int n;
+
+	n = sizeof(paths) / sizeof(paths[0]);
+	if (!dotdot)
+		n--;
+
+	return &paths[(l + ln->n) % n];
+}
+
+static u8 *
+pathmsg(Conn *c, int l, Path *pt)
+{
+	int i, n;
+	u8 *p;
+
+	for(n = 0; n < Ndeep + 2 && pt->names[n]; n++)
+		;
+
+	p = hdr(c->wbuf, Twalk, l);
+	p = p32(p, 0);
+	p = p32(p, LANEFID(l, 0));
+	p = p16(p, n);
+	for(i = 0; i < n; i++)
+		p = pstr(p, pt->names[i]);
+
+	return p;
+}
+
+/*
+ * Checks the qids of a path op's Rwalk. Returns 0 if the walk failed
+ * part of the way and there is no fid to clunk.
+ */
+static int
+walked(Conn *c, Path *pt)
+{
+	int i, n, type;
+	u8 *p;
+
+	n = g16(c->rbuf + 7);
+	if (n != pt->nqid)
+		fatal("walked %d names of %d", n, pt->nqid);
+
+	p = c->rbuf + 9;
+	for(i = 0; i < n; i++, p += 13) {
+		type = pt->qids[i] < Ndeep ? Qtdir : Qtfile;
+		if (p[0] != type || g64(p + 5) != deeppath[pt->qids[i]])
+			fatal("bad qid %d of %s...", i, pt->names[0]);
+	}
+
+	return n == Ndeep + 2 || pt->names[n] == NULL;
+}
+
+static void
+lanesend(Conn *c, int l)
+{
+	char name[16];
+	u32 fid;
+	u8 *p;
+	Lane *ln;
+
+	ln = &c->lanes[l];
+	switch (ln->op) {
+	case Opwalk:
+		switch (ln->step) {
+		case 0:
+			snprintf(name, sizeof(name), "f%d", (l + ln->n) % nsmall);
+			p = hdr(c->wbuf, Twalk, l);
+			p = p32(p, 0);
+			p = p32(p, LANEFID(l, 0));
+			p = p16(p, 1);
+			p = pstr(p, name);
+			break;
+
+		case 1:
+			p = openmsg(c, l, LANEFID(l, 0), Oread);
+			break;
+
+		case 2:
+			p = hdr(c->wbuf, Tread, l);
+			p = p32(p, LANEFID(l, 0));
+			p = p64(p, 0);
+			p = p32(p, Smallsize);
+			break;
+
+		default:
+			p = hdr(c->wbuf, Tclunk, l);
+			p = p32(p, LANEFID(l, 0));
+			break;
+		}
+		break;
+
+	case Opstat:
+		p = statmsg(c, l, LANEFID(l, 1));
+		break;
+
+	case Oplist:
+		switch (ln->step) {
+		case 0:
+			p = hdr(c->wbuf, Twalk, l);
+			p = p32(p, 0);
+			p = p32(p, LANEFID(l, 0));
+			p = p16(p, 0);
+			break;
+
+		case 1:
+			p = openmsg(c, l, LANEFID(l, 0), Oread);
+			break;
+
+		case 2:
+			p = hdr(c->wbuf, dotl ? Treaddir : Tread, l);
+			p = p32(p, LANEFID(l, 0));
+			p = p64(p, ln->doff);
+			p = p32(p, Listsize);
+			break;
+
+		default:
+			p = hdr(c->wbuf, Tclunk, l);
+			p = p32(p, LANEFID(l, 0));
+			break;
+		}
+		break;
+
+	case Opread:
+		p = hdr(c->wbuf, Tread, l);
+		p = p32(p, LANEFID(l, 2));
+		p = p64(p, ln->roff);
+		p = p32(p, iosize);
+		break;
+
+	case Opwrite:
+		p = hdr(c->wbuf, Twrite, l);
+		p = p32(p, LANEFID(l, 3));
+		p = p64(p, ln->woff);
+		p = p32(p, iosize);
+		memmove(p, pattern, iosize);
+		p += iosize;
+		break;
+
+	case Oppath:
+		if (ln->step == 0)
+			p = pathmsg(c, l, lanepath(l, ln));
+		else {
+			p = hdr(c->wbuf, Tclunk, l);
+			p = p32(p, LANEFID(l, 0));
+		}
+		break;
+
+	default:
+		ln->rand = ln->rand * 1103515245 + 12345;
+		fid = SHAREDFID((ln->rand >> 8) % Nshared);
+		switch ((ln->rand >> 16) % 4) {
+		case 0:
+			p = hdr(c->wbuf, Twalk, l);
+			p = p32(p, 0);
+			p = p32(p, fid);
+			p = p16(p, 1);
+			p = pstr(p, "f0");
+			break;
+
+		case 1:
+			p = hdr(c->wbuf, Twalk, l);
+			p = p32(p, fid);
+			p = p32(p, fid);
+			p = p16(p, 0);
+			break;
+
+		case 2:
+			p = statmsg(c, l, fid);
+			break;
+
+		default:
+			p = hdr(c->wbuf, Tclunk, l);
+			p = p32(p, fid);
+			break;
+		}
+		break;
+	}
+
+	msend(c, p);
+}
+
+static void
+lanestart(Conn *c, int l)
+{
+	Lane *ln;
+
+	ln = &c->lanes[l];
+	ln->op = seq[(l + ln->n) % nseq];
+	ln->step = 0;
+	ln->doff = 0;
+	ln->nents = 0;
+	ln->start = nsec();
+	lanesend(c, l);
+}
+
+static void
+addlat(Lat *lat, u64 ns)
+{
+	if (lat->n == lat->size) {
+		lat->size = lat->size ? lat->size * 2 : 65536;
+		lat->v = realloc(lat->v, lat->size * sizeof(u32));
+		if (!lat->v)
+			fatal("no memory");
+	}
+
+	lat->v[lat->n++] = ns > ~0U ? ~0U : ns;
+}
+
+/*
+ * Counts the entries of a directory read and moves the lane past
+ * them. Returns 0 at the end of the directory.
+ */
+static int
+listed(Conn *c, Lane *ln)
+{
+	u32 n;
+	u8 *p, *e;
+
+	n = g32(c->rbuf + 7);
+	p = c->rbuf + 11;
+	e = p + n;
+	if (!dotl)
+		ln->doff += n;
+
+	while (p < e) {
+		if (dotl) {
+			/* qid[13] offset[8] type[1] name[s] */
+			ln->doff = g64(p + 13);
+			p += 24 + g16(p + 22);
+		} else
+			p += 2 + g16(p);
+		ln->nents++;
+	}
+
+	if (p != e)
+		fatal("bad directory entry");
+
+	return n != 0;
+}
+
+static void
+lanereply(Conn *c, int l)
+{
+	u32 n;
+	Lane *ln;
+
+	ln = &c->lanes[l];
+	if (iserror(c) && ln->op != Opfid)
+		rerror(c);
+
+	switch (ln->op) {
+	case Opwalk:
+		if (++ln->step < 4) {
+			lanesend(c, l);
+			return;
+		}
+		break;
+
+	case Oplist:
+		if (ln->step == 2 && listed(c, ln)) {
+			lanesend(c, l);
+			return;
+		}
+
+		if (++ln->step < 4) {
+			lanesend(c, l);
+			return;
+		}
+
+		if (ln->nents != nsmall + 2)
+			fatal("listed %d files of %d", ln->nents, nsmall + 2);
+		break;
+
+	case Oppath:
+		if (ln->step++ == 0 && walked(c, lanepath(l, ln))) {
+			lanesend(c, l);
+			return;
+		}
+		break;
+
+	case Opread:
+		n = g32(c->rbuf + 7);
+		if (n != iosize)
+			fatal("short read of %d at %llu", n,
+				(unsigned long long) ln->roff);
+
+		if (memcmp(c->rbuf + 11, pattern + ln->roff % 4096, n) != 0)
+			fatal("bad data at %llu", (unsigned long long) ln->roff);
+
+		c->bytes += n;
+		ln->roff += iosize;
+		if (ln->roff + iosize > Bigsize)
+			ln->roff = 0;
+		break;
+
+	case Opwrite:
+		c->bytes += g32(c->rbuf + 7);
+		ln->woff += iosize;
+		if (ln->woff + iosize > Bigsize)
+			ln->woff = 0;
+		break;
+	}
+
+	ln->n++;
+	if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		c->inflight--;
+		return;
+	}
+
+	c->nops[ln->op]++;
+	addlat(&c->lat[ln->op], nsec() - ln->start);
+	lanestart(c, l);
+}
+
+static void *
+connproc(void *a)
+{
+	int l, tag;
+	u8 *p;
+	Conn *c;
+
+	c = a;
+	if (ignoreallocs)
+		(*ignoreallocs)();
+
+	setup(c);
+	pthread_barrier_wait(&barrier);
+
+	for(l = 0; l < c->depth; l++) {
+		c->lanes[l].rand = l;
+		lanestart(c, l);
+	}
+
+	c->inflight = c->depth;
+	while (c->inflight > 0) {
+		mrecv(c);
+		tag = g16(c->rbuf + 5);
+		if (tag >= c->depth)
+			fatal("bad tag %d", tag);
+
+		lanereply(c, tag);
+	}
+
+	/* the shared fids must be usable again */
+	for(l = 0; l < Nshared; l++) {
+		p = hdr(c->wbuf, Tclunk, 0);
+		p = p32(p, SHAREDFID(l));
+		msend(c, p);
+		mrecv(c);
+
+		p = hdr(c->wbuf, Twalk, 0);
+		p = p32(p, 0);
+		p = p32(p, SHAREDFID(l));
+		p = p16(p, 1);
+		p = pstr(p, "f0");
+		rpc(c, p, Rwalk);
+
+		p = hdr(c->wbuf, Tclunk, 0);
+		p = p32(p, SHAREDFID(l));
+		rpc(c, p, Rclunk);
+	}
+
+	return NULL;
+}
+
+static void
+setmix(char *s)
+{
+	int i, w, op;
+	char *t, *e;
+
+	nseq = 0;
+	for(t = strtok(s, ","); t != NULL; t = strtok(NULL, ",")) {
+		e = strchr(t, '=');
+		w = 1;
+		if (e) {
+			*e++ = '\0';
+			w = strtol(e, &e, 10);
+			if (*e != '\0' || w < 0)
+				usage();
+		}
+
+		for(op = 0; op < Nops; op++)
+			if (strcmp(t, opnames[op]) == 0)
+				break;
+
+		if (op == Nops || nseq + w > Maxseq)
+			usage();
+
+		for(i = 0; i < w; i++)
+			seq[nseq++] = op;
+	}
+
+	if (!nseq)
+		usage();
+
+	/* spread the ops of each kind over the sequence */
+	for(i = 0; i < nseq; i++) {
+		w = (i * 7919) % nseq;
+		op = seq[i];
+		seq[i] = seq[w];
+		seq[w] = op;
+	}
+}
+
+static void
+snooze(u64 ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static u64
+totalops(Conn *conns)
+{
+	int i, op;
+	u64 n;
+
+	n = 0;
+	for(i = 0; i < nconns; i++)
+		for(op = 0; op < Nops; op++)
+			n += __atomic_load_n(&conns[i].nops[op], __ATOMIC_RELAXED);
+
+	return n;
+}
+
+static int
+latcmp(const void *a, const void *b)
+{
+	u32 x, y;
+
+	x = *(u32 *) a;
+	y = *(u32 *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+quantile(Lat *lat, double q)
+{
+	if (!lat->n)
+		return 0;
+
+	return lat->v[(int) ((lat->n - 1) * q)] / 1000.0;
+}
+
+static void
+report(Conn *conns, double secs)
+{
+	int i, op;
+	u64 n, total, bytes;
+	Lat lat, all;
+
+	memset(&all, 0, sizeof(all));
+	total = 0;
+	bytes = 0;
+	printf("%-6s %10s %12s %10s %10s %10s\n", "op", "ops", "ops/s",
+		"p50 us", "p99 us", "p999 us");
+	for(op = 0; op <= Nops; op++) {
+		if (op < Nops) {
+			memset(&lat, 0, sizeof(lat));
+			n = 0;
+			for(i = 0; i < nconns; i++) {
+				n += conns[i].nops[op];
+				while (lat.n + conns[i].lat[op].n > lat.size) {
+					lat.size = lat.size ? lat.size * 2 : 65536;
+					lat.v = realloc(lat.v, lat.size * sizeof(u32));
+					if (!lat.v)
+						fatal("no memory");
+				}
+
+				memmove(lat.v + lat.n, conns[i].lat[op].v,
+					conns[i].lat[op].n * sizeof(u32));
+				lat.n += conns[i].lat[op].n;
+			}
+
+			if (!n) {
+				free(lat.v);
+				continue;
+			}
+
+			for(i = 0; i < lat.n; i++)
+				addlat(&all, lat.v[i]);
+			total += n;
+		} else {
+			lat = all;
+			n = total;
+		}
+
+		qsort(lat.v, lat.n, sizeof(u32), latcmp);
+		printf("%-6s %10llu %12.1f %10.1f %10.1f %10.1f\n",
+			op < Nops ? opnames[op] : "all", (unsigned long long) n,
+			n / secs, quantile(&lat, 0.5), quantile(&lat, 0.99),
+			quantile(&lat, 0.999));
+		free(lat.v);
+	}
+
+	for(i = 0; i < nconns; i++)
+		bytes += conns[i].bytes;
+
+	printf("%.1f MB/s\n", bytes / secs / (1024*1024));
+}
+
+/* the operations and latencies of each connection */
+static void
+reportconns(Conn *conns, double secs)
+{
+	int i, j, op;
+	u64 n;
+	Lat lat;
+
+	printf("%-6s %6s %10s %12s %10s %10s\n", "conn", "depth", "ops",
+		"ops/s", "p50 us", "p99 us");
+	for(i = 0; i < nconns; i++) {
+		memset(&lat, 0, sizeof(lat));
+		n = 0;
+		for(op = 0; op < Nops; op++) {
+			n += conns[i].nops[op];
+			for(j = 0; j < conns[i].lat[op].n; j++)
+				addlat(&lat, conns[i].lat[op].v[j]);
+		}
+
+		qsort(lat.v, lat.n, sizeof(u32), latcmp);
+		printf("%-6d %6d %10llu %12.1f %10.1f %10.1f\n", i,
+			conns[i].depth, (unsigned long long) n, n / secs,
+			quantile(&lat, 0.5), quantile(&lat, 0.99));
+		free(lat.v);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int c, i, n, sv[2];
+	char *s, *backend, mix[] = "walk";
+	u64 start, ops, allocs;
+	double secs;
+	Npsrv *srv;
+	Npconn *conn;
+	Conn *conns;
+	Dirtab *dt;
+
+	backend = "file";
+	setmix(mix);
+	while ((c = getopt(argc, argv, "b:m:d:l:r:c:w:t:s:f:xaL")) != -1) {
+		switch (c) {
+		case 'b':
+			backend = optarg;
+			break;
+
+		case 'm':
+			setmix(optarg);
+			break;
+
+		case 'd':
+			depth = strtol(optarg, &s, 10);
+			if (*s != '\0' || depth < 1 || depth > Maxdepth)
+				usage();
+			break;
+
+		case 'l':
+			flood = strtol(optarg, &s, 10);
+			if (*s != '\0' || flood < 1 || flood > Maxdepth)
+				usage();
+			break;
+
+		case 'r':
+			maxreqs = strtol(optarg, &s, 10);
+			if (*s != '\0' || maxreqs < 0)
+				usage();
+			break;
+
+		case 'c':
+			nconns = strtol(optarg, &s, 10);
+			if (*s != '\0' || nconns < 1)
+				usage();
+			break;
+
+		case 'w':
+			nworkers = strtol(optarg, &s, 10);
+			if (*s != '\0' || nworkers < 1)
+				usage();
+			break;
+
+		case 't':
+			seconds = strtol(optarg, &s, 10);
+			if (*s != '\0' || seconds < 1)
+				usage();
+			break;
+
+		case 's':
+			iosize = strtol(optarg, &s, 10);
+			if (*s != '\0' || iosize < 1 || iosize > Patsize - 4096)
+				usage();
+			break;
+
+		case 'f':
+			nsmall = strtol(optarg, &s, 10);
+			if (*s != '\0' || nsmall < 1)
+				usage();
+			break;
+
+		case 'x':
+			indexed = 1;
+			break;
+
+		case 'L':
+			dotl = 1;
+			break;
+
+		case 'a':
+			nallocs = dlsym(RTLD_DEFAULT, "malloccount");
+			ignoreallocs = dlsym(RTLD_DEFAULT, "malloccount_ignore");
+			if (!nallocs || !ignoreallocs)
+				fatal("-a needs LD_PRELOAD=./malloccount.so");
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	for(i = 0; i < Patsize; i++)
+		pattern[i] = 'a' + i % 26;
+
+	msize = iosize + IOHDRSZ;
+	if (msize < 8192)
+		msize = 8192;
+
+	srv = np_srv_create(nworkers);
+	if (!srv)
+		fatal("cannot create the server");
+
+	srv->msize = msize;
+	if (maxreqs >= 0)
+		srv->maxreqs = maxreqs;
+
+	if (strcmp(backend, "file") == 0)
+		npfile_init_srv(srv, mkfiletree());
+	else if (strcmp(backend, "dirtab") == 0) {
+		if (nsmall > Maxdtsmall)
+			fatal("dirtab has room for %d files", Maxdtsmall);
+
+		dt = mkdirtab(&n);
+		npfile_init_dirtab(srv, dt, n);
+	} else
+		usage();
+
+	conns = calloc(nconns, sizeof(*conns));
+	if (!conns)
+		fatal("no memory");
+
+	pthread_barrier_init(&barrier, NULL, nconns + 1);
+	for(i = 0; i < nconns; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+			fatal("socketpair: %d", errno);
+
+		conn = np_conn_create(srv, np_fdtrans_create(sv[0], sv[0]));
+		if (!conn)
+			fatal("cannot create a connection");
+
+		np_srv_add_conn(srv, conn);
+		conns[i].fd = sv[1];
+		conns[i].depth = i == 0 && flood ? flood : depth;
+		conns[i].rbuf = malloc(msize);
+		conns[i].wbuf = malloc(msize);
+		if (!conns[i].rbuf || !conns[i].wbuf)
+			fatal("no memory");
+
+		pthread_create(&conns[i].thread, NULL, connproc, &conns[i]);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = nsec();
+	ops = 0;
+	allocs = 0;
+	if (nallocs) {
+		snooze(seconds * 500000000ULL);
+		ops = totalops(conns);
+		allocs = (*nallocs)();
+		snooze(seconds * 500000000ULL);
+		ops = totalops(conns) - ops;
+		allocs = (*nallocs)() - allocs;
+	} else
+		snooze(seconds * 1000000000ULL);
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	secs = (nsec() - start) / 1e9;
+	for(i = 0; i < nconns; i++)
+		pthread_join(conns[i].thread, NULL);
+
+	printf("backend %s%s, %d workers, %d connections, depth %d, iosize %d, %.1f s\n",
+		backend, dotl ? " 9P2000.L" : "", nworkers, nconns, depth,
+		iosize, secs);
+	report(conns, secs);
+	if (flood)
+		reportconns(conns, secs);
+
+	if (nallocs)
+		printf("%llu allocations in %llu ops, %.4f per op\n",
+			(unsigned long long) allocs, (unsigned long long) ops,
+			ops ? (double) allocs / ops : 0.0);
+
+	return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef _CASAFS_H
 #define _CASAFS_H
 
+#include <pthread.h>
+
 #define NELEM(x)	(sizeof(x)/sizeof((x)[0]))
 #define KNAMELEN 28
 #define KPATHLEN 100
@@ -11,7 +13,7 @@ typedef struct Dirtab Dirtab;
 typedef struct Fid Fid;
 
 struct NpDtfileops {
-  Npfcall*	(*read)(Fid *fid, u64 offset, u32 count, Npfcall *ret);
+  Npfcall*	(*read)(Fid *fid, u64 offset, u32 count, Npfcall *ret, Npreq *req);
   Npfcall*      (*write)(Fid *fid, u64 offset, u32 count, u8 *data, Npreq *req);
   Npfcall*      (*open)(Fid *fid, u8 mode);
 };
@@ -34,7 +36,8 @@ struct Fid {
   Dirtab *dt;
   Npqid	qid;
   int omode;
-  int offset;
+  pthread_mutex_t lock;  /* dirpos, Treads of a fid can run at once */
+  Npdirpos dirpos;  /* cookies are findNextDirChild offsets */
   Dirtab *parenttab;
   int parenttabsize;
 };
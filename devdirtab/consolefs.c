@@ -13,6 +13,7 @@
 #include "myutils.h"
 #include "myconsole.h"
 #include "consolefs.h"
+#include "dirtab.h"
 
 #define REPORT_ERROR(errcode) \
             {  \
@@ -52,10 +53,12 @@ consoletab[]={
   "dev",    Itopdir,  Qtdir, Nobody, &defaultfileops,
   "cons", Icons, Qtfile, Itopdir, &consfileops,
   "time", Itime, Qtfile, Itopdir, &timefileops,
-  "msec", Imsec, Qtfile, Itopdir, &msecfileops
+  "msec", Imsec, Qtfile, Itopdir, &msecfileops,
+  ".stats", Istats, Qtfile, Itopdir, &statsfileops
 };
 
 Npsrv *srv;
+int debuglevel;
    
 /* sets a qid structure according to a given dirtab entry  */
 void dt2qid(Dirtab *dtentry, Npqid *qid, void *ignore)
@@ -88,7 +91,7 @@ Npfcall*
 return_read(Npfcall *ret, int n)
 {
 	if (np_haserror()) {
-		free(ret);
+		np_fcall_free(ret);
 		ret = NULL;
 	} else
 		np_set_rread_count(ret, n);
@@ -97,7 +100,7 @@ return_read(Npfcall *ret, int n)
 }
   
 Npfcall*
-cons_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
+cons_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req)
 {
         int n;
 
@@ -116,7 +119,7 @@ cons_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
 }
 
 Npfcall*
-time_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
+time_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req)
 {
         int n;
 	char b[KNAMELEN];
@@ -137,7 +140,7 @@ time_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
 }
 
 Npfcall*
-msec_read(Fid *fid, u64 offset, u32 count, Npfcall *ret)
+msec_read(Fid *fid, u64 offset, u32 count, Npfcall *ret, Npreq *req)
 {
         int n;
 	char b[KNAMELEN];
@@ -190,10 +193,12 @@ cons_write(Fid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
 void
 usage()
 {
-  fprintf(stderr, "Usage: consolefs [-p port] [-m path to mount point] [-l logfile]\n");
+  fprintf(stderr, "Usage: consolefs [-p port] [-m path to mount point] [-l logfile] [-t tracefile] [-d]\n");
   fprintf(stderr, "Info:\n -p port = makes this a socket based server and assigns port where it listens\n");
   fprintf(stderr, " -m path = mounts this server locally at given path (default = exported over socket)\n");
   fprintf(stderr, " -l logfile = logs incoming requests to given file (default = printed to console)\n");
+  fprintf(stderr, " -t tracefile = records the requests and replies in binary to given file, see nptrace\n");
+  fprintf(stderr, " -d = prints the requests and replies as they are handled (slow)\n");
 
   exit(-1);
 }
@@ -210,16 +215,19 @@ main(int argc, char **argv)
 	char *opts;
 	int fd;
 	char *mountpath;
+	char *tracefile;
 
 	port = 2001;
 	nwthreads = 1;
 	issocket = 1; /* default server type is socket based  */
 	opts = NULL;
 	logfile = NULL;
+	tracefile = NULL;
 	
-	while ((c = getopt(argc, argv, "dsl:p:w:o:m:")) != -1) {
+	while ((c = getopt(argc, argv, "dsl:p:w:o:m:t:")) != -1) {
 		switch (c) {
 		case 'd':
+			debuglevel++;
 			break;
 
 		case 'p':
@@ -244,6 +252,9 @@ main(int argc, char **argv)
 		case 'l':
 		        logfile = optarg;
   		        break;
+		case 't':
+			tracefile = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -271,6 +282,12 @@ main(int argc, char **argv)
 	if (!srv)
 		return -1;
 
+	srv->debuglevel = debuglevel;
+	if (tracefile != NULL && (c = np_trace_open(tracefile)) != 0) {
+		fprintf(stderr, "cannot open trace file %s: %d\n", tracefile, c);
+		return -1;
+	}
+
 	npfile_init_dirtab(srv, consoletab, NELEM(consoletab));
 
 	if (issocket == 1)
@@ -8,6 +8,7 @@ enum {
   Icons,
   Itime,
   Imsec,
+  Istats,
   Nobody = 0xff
 };
 
@@ -15,13 +16,13 @@ enum {
 
 /* prototypes for the read functions  */
 Npfcall*
-cons_read(Fid *f, u64 offset, u32 count, Npfcall *ret);
+cons_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req);
 
 Npfcall*
-time_read(Fid *f, u64 offset, u32 count, Npfcall *ret);
+time_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req);
 
 Npfcall*
-msec_read(Fid *f, u64 offset, u32 count, Npfcall *ret);
+msec_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req);
 
 Npfcall*
 cons_write(Fid *fid, u64 offset, u32 count, u8 *data, Npreq *req);
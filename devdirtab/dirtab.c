@@ -9,6 +9,7 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include "npfs.h"
 #include "casafs.h"
 #include "myutils.h"
@@ -22,6 +23,13 @@
 	      goto done; \
 	    } 
 
+/* chatter about the requests, only when the server is debugged */
+#define DEBUG(fid, ...) \
+	do { \
+		if ((fid)->conn->srv->debuglevel) \
+			fprintf(stderr, __VA_ARGS__); \
+	} while (0)
+
 
 Npsrv *srv;
 Dirtab *maintab;
@@ -146,7 +154,7 @@ static int dirtab_walk(Npfid *fid, Npstr *wname, Npqid *wqid)
 	offset = 0; /* search for the child from start of the directory table */
 	f = fid->aux;
 	
-	fprintf(stderr, "walk: fid <%d> to %s\n", fid->fid, wname->str);
+	DEBUG(fid, "walk: fid <%d> to %.*s\n", fid->fid, wname->len, wname->str);
 	
 	while (!found) {
 	  dt = findNextDirChild(&offset, f->qid.path, f->parenttab, f->parenttabsize, &tp);
@@ -197,7 +205,7 @@ dirtab_attach(Npfid *nfid, Npfid *nafid, Npstr *uname, Npstr *aname)
 	}
 
 	fid = npfs_fidalloc();
-	fprintf(stderr, "attach: assigning fid <%d> to root\n", nfid->fid);
+	DEBUG(nfid, "attach: assigning fid <%d> to root\n", nfid->fid);
 
 	nfid->aux = fid;
 
@@ -218,7 +226,7 @@ static int
 dirtab_clone(Npfid *fid, Npfid *newfid)
 {
 	Fid *f, *nf;
-	fprintf(stderr, "clone: fid<%d> as fid<%d>\n", newfid->fid, fid->fid);
+	DEBUG(fid, "clone: fid<%d> as fid<%d>\n", newfid->fid, fid->fid);
 
 	f = fid->aux;
 	nf = npfs_fidalloc();
@@ -238,7 +246,7 @@ dirtab_clunk(Npfid *fid)
 	Fid *f;
 	Npfcall *ret;
 
-	fprintf(stderr, "clunk: fid<%d>\n", fid->fid);
+	DEBUG(fid, "clunk: fid<%d>\n", fid->fid);
 	f = fid->aux;
 	ret = np_create_rclunk();
 
@@ -246,6 +254,21 @@ dirtab_clunk(Npfid *fid)
 	return ret;
 }
 
+static void
+dirtab_fiddestroy(Npfid *fid)
+{
+	Fid *f;
+
+	f = fid->aux;
+	if (!f)
+	  return;
+
+	/* the filename belongs to the dirtab */
+	np_dirpos_free(&f->dirpos);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
 static Npfcall*
 dirtab_stat(Npfid *fid)
 {
@@ -257,7 +280,7 @@ dirtab_stat(Npfid *fid)
 	f = fid->aux;
 	memset(&wstat, 0, sizeof(wstat));
 
-	fprintf(stderr, "stat : fid<%d>\n", fid->fid);
+	DEBUG(fid, "stat : fid<%d>\n", fid->fid);
 	/* first fill in the qid */
 	memmove(&(wstat.qid), &(f->qid), sizeof(Npqid));
 	
@@ -288,7 +311,7 @@ dirtab_open(Npfid *fid, u8 mode)
 	Fid *f;
 	Npqid qid;
 
-	fprintf(stderr, "open: fid<%d>\n",fid->fid);
+	DEBUG(fid, "open: fid<%d>\n",fid->fid);
 	f = fid->aux;
 	f->omode = mode;
 	if (f->dt->fops->open)
@@ -305,21 +328,33 @@ dirtab_read_dir(Fid *f, u8* buf, u64 offset, u32 count, int dotu, Dirtab *fstabl
 	int i, n, plen;
 	char *dname, *path;
 	Npwstat wstat;
-	int readoffset;
+	int next, last;
+	u64 cookie;
 	Dirtab *dt;
-	int index;
 	TransferPoint *tp;
 
-	fprintf(stderr, "   readdir ::: dir = %s\n",f->filename); 
-	/*  if offset is zero then rewind the directory */
-	if (offset == 0) 
-	  f->offset = 0;
+	/*  
+	   if offset is zero then rewind the directory, otherwise it has
+	   to be the end of an earlier read 
+	*/
+	pthread_mutex_lock(&f->lock);
+	if (offset == 0) {
+	  np_dirpos_free(&f->dirpos);
+	  next = 0;
+	} else if (np_dirpos_find(&f->dirpos, offset, &cookie))
+	  next = cookie;
+	else {
+	  pthread_mutex_unlock(&f->lock);
+	  np_werror(Ebadoffset, EIO);
+	  return 0;
+	}
 
 	n = 0; /* number of bytes written so far*/
 
 	while (n < count) {
 	  memset(&wstat, 0, sizeof(wstat));
-	  dt = findNextDirChild(&(f->offset), f->qid.path, fstable, nelem, &tp);	  
+	  last = next;
+	  dt = findNextDirChild(&next, f->qid.path, fstable, nelem, &tp);	  
 	  if (dt == NULL)  // no more subdirectories 
 	    break;
 	  /* first fill in the qid */
@@ -345,8 +380,15 @@ dirtab_read_dir(Fid *f, u8* buf, u64 offset, u32 count, int dotu, Dirtab *fstabl
 	  wstat.extension = NULL;
 	  
 	  i = np_serialize_stat(&wstat, buf + n, count - n - 1, dotu);
+	  if (i == 0) {  /* doesn't fit, the next read starts with it */
+	    next = last;
+	    break;
+	  }
 	  n += i;  /* update number of bytes we are going to return */
 	}
+
+	np_dirpos_add(&f->dirpos, offset + n, next);
+	pthread_mutex_unlock(&f->lock);
 	return n;
 }
 
@@ -364,24 +406,24 @@ dirtab_read(Npfid *fid, u64 offset, u32 count, Npreq *req)
 
 	f = fid->aux;
 
+	DEBUG(fid, "read: fid<%d>\n", fid->fid);
 	ret = np_alloc_rread(count);
 	if (ISDIRfid(*f)) {
+	  DEBUG(fid, "   readdir ::: dir = %s\n",f->filename);
 	  n = dirtab_read_dir(f, ret->data, offset, count, fid->conn->dotu, f->parenttab, f->parenttabsize);	  
 	  goto done;
 	}
 
 	if (f->dt->fops->read)
-	  return f->dt->fops->read(f, offset, count, ret);
+	  return f->dt->fops->read(f, offset, count, ret, req);
 	else
 	  REPORT_ERROR(EPERM);
 
-	fprintf(stderr, "read: fid<%d>\n", fid->fid);
-
 	  
 
  done:	
 	if (np_haserror()) {
-		free(ret);
+		np_fcall_free(ret);
 		ret = NULL;
 	} else
 		np_set_rread_count(ret, n);
@@ -391,6 +433,53 @@ dirtab_read(Npfid *fid, u64 offset, u32 count, Npreq *req)
 
 
 
+/*
+   9P2000.L directory listing. The cookie of an entry is where
+   findNextDirChild goes on after it, so the client can continue
+   from any entry it got.
+*/
+static Npfcall*
+dirtab_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req)
+{
+	int i, n;
+	int next;
+	Fid *f;
+	Dirtab *dt;
+	Npqid qid;
+	Npfcall *ret;
+	TransferPoint *tp;
+
+	f = fid->aux;
+
+	DEBUG(fid, "readdir: fid<%d> offset %llu\n", fid->fid, 
+	      (unsigned long long) offset);
+	ret = np_alloc_rreaddir(count);
+	n = 0;
+
+	/* cookies are indexes, anything bigger is past the end */
+	if (offset > INT_MAX) {
+	  np_set_rread_count(ret, 0);
+	  return ret;
+	}
+
+	next = offset;
+	while (n < count) {
+	  dt = findNextDirChild(&next, f->qid.path, f->parenttab, f->parenttabsize, &tp);
+	  if (dt == NULL)  // no more entries
+	    break;
+
+	  dt2qid(dt, &qid, tp? tp->handle : NULL);
+	  i = np_serialize_dirent(&qid, next, tp? tp->destptr : dt->name, 
+				  ret->data + n, count - n);
+	  if (i == 0)
+	    break;
+	  n += i;
+	}
+
+	np_set_rread_count(ret, n);
+	return ret;
+}
+
 static Npfcall*
 dirtab_wstat(Npfid *fid, Npstat *stat)
 {
@@ -427,7 +516,7 @@ dirtab_write(Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
 
 	f = fid->aux;
 
-	fprintf(stderr, "write: fid<%d>\n", fid->fid);
+	DEBUG(fid, "write: fid<%d>\n", fid->fid);
 	if (ISDIRfid(*f))
 		REPORT_ERROR(EPERM);
 
@@ -445,6 +534,48 @@ dirtab_write(Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
 }
 
 
+/*
+   the server's counters and latencies, see np_srv_stats_text.
+   A table entry with statsfileops makes them readable as a file.
+*/
+static Npfcall*
+stats_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req)
+{
+	int n;
+	char *s;
+
+	n = 0;
+	s = np_srv_stats_text(req->conn->srv);
+	if (!s)
+	  REPORT_ERROR(ENOMEM);
+
+	n = strlen(s);
+	if (offset >= n)
+	  n = 0;
+	else {
+	  n -= offset;
+	  if (n > count)
+	    n = count;
+	  memcpy(ret->data, s + offset, n);
+	}
+	free(s);
+
+ done:
+	if (np_haserror()) {
+		np_fcall_free(ret);
+		return NULL;
+	}
+
+	np_set_rread_count(ret, n);
+	return ret;
+}
+
+NpDtfileops statsfileops = {
+	.read = stats_read,
+	.write = NULL,
+	.open = NULL
+};
+
 void
 npfile_init_dirtab(Npsrv *srv, Dirtab *dt, int tabsize)
 {
@@ -459,6 +590,7 @@ npfile_init_dirtab(Npsrv *srv, Dirtab *dt, int tabsize)
 
 
 	srv->dotu = 0;
+	srv->dotl = 1;
 	srv->attach = dirtab_attach;
 	srv->clone = dirtab_clone;
 	srv->walk = dirtab_walk;
@@ -470,8 +602,9 @@ npfile_init_dirtab(Npsrv *srv, Dirtab *dt, int tabsize)
 	//srv->remove = lnfs_remove;
 	srv->stat = dirtab_stat;
 	srv->wstat = dirtab_wstat;
+	srv->readdir = dirtab_readdir;
 	//srv->flush = lnfs_flush;
-	//srv->fiddestroy = lnfs_fiddestroy;
+	srv->fiddestroy = dirtab_fiddestroy;
 	//srv->debuglevel = debuglevel;
 
 	maintab = dt;
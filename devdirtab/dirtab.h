@@ -8,4 +8,7 @@
 void
 npfile_init_dirtab(Npsrv *srv, Dirtab *dt, int tabsize);
 
+/* read-only file with the server's statistics */
+extern NpDtfileops statsfileops;
+
 #endif
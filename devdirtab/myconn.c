@@ -133,6 +133,32 @@ int getDataFromConnection(Conn *connptr, char *buff, int count)
   return retval;
 }
 
+/* like getDataFromConnection, but fails with EAGAIN instead of waiting */
+int tryDataFromConnection(Conn *connptr, char *buff, int count)
+{
+  int retval;
+  int myerrno;
+
+  pthread_mutex_lock(&connptr->lock);
+  retval = recv(connptr->fd, buff, count, MSG_DONTWAIT);
+  myerrno = errno;
+  if (retval < 0 && (myerrno == EAGAIN || myerrno == EWOULDBLOCK)) {
+    pthread_mutex_unlock(&connptr->lock);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (retval <= 0) {
+    connptr->status = STATUS_DISCONNECTED;
+    pthread_mutex_unlock(&connptr->lock);
+    errno = retval ? myerrno : ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_unlock(&connptr->lock);
+  return retval;
+}
+
 int sendDataToConnection(Conn *connptr, char *data, int count)
 {
   int retval;
@@ -22,6 +22,7 @@ Conn *findfreeConn();
 Conn *getConnPtr(int connindex);
 int createConnection(Conn *connptr, char *ipaddress, char *port);
 int getDataFromConnection(Conn *connptr, char *buff, int count);
+int tryDataFromConnection(Conn *connptr, char *buff, int count);
 int closeConnection(Conn *connptr);
 int sendDataToConnection(Conn *connptr, char *data, int count);
 int assignPort(Conn *connptr, char *port);
@@ -37,7 +37,8 @@ npfs_fidalloc() {
 	f = malloc(sizeof(*f));
 	initNpqid(&(f->qid)); // initialization value
 	f->omode = -1;
-	f->offset = 0;
+	pthread_mutex_init(&f->lock, NULL);
+	memset(&f->dirpos, 0, sizeof(f->dirpos));
 	return f;
 }
 
@@ -17,6 +17,7 @@
 #include "netfs.h"
 #include "myutils.h"
 #include "TransferPoint.h"
+#include "dirtab.h"
 
 
 Npsrv *srv;
@@ -74,7 +75,8 @@ NpDtfileops listenfileops = {
 static Dirtab
 statictab[]={
   "root",  Qroot,  Qtdir, Nobody, &defaultfileops,
-  "clone", Qclone, Qtfile, Qroot, &clonefileops
+  "clone", Qclone, Qtfile, Qroot, &clonefileops,
+  ".stats", Qstats, Qtfile, Qroot, &statsfileops
 
 };
 
@@ -232,7 +234,7 @@ Npfcall*
 return_read(Npfcall *ret, int n)
 {
 	if (np_haserror()) {
-		free(ret);
+		np_fcall_free(ret);
 		ret = NULL;
 	} else
 		np_set_rread_count(ret, n);
@@ -241,7 +243,7 @@ return_read(Npfcall *ret, int n)
 }
 
  Npfcall*
-ctl_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
+ctl_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req)
 {
 	int n;
 	Dirtab *tabptr;
@@ -267,29 +269,62 @@ ctl_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
 
 }
 
+static Npfcall*
+data_resume(Npreq *req, void *aux);
+
+/*
+   don't hold up a worker thread while the peer is quiet: if there
+   is nothing to read, park the request until the socket is readable
+*/
  Npfcall*
-data_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
+data_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req)
 {
 	int n;
 	Dirtab *tabptr;
 	int tabsize;
 	Conn *connptr;
 
+	n = 0;
 	if (retrieveFileSpecs(f, &tabptr, &tabsize, &connptr) < 0)
 	  REPORT_ERROR(ENOENT);
 
 	if (connptr->status != STATUS_CONNECTED)
 	  REPORT_ERROR(ENOTCONN);
 
-	if ((n = getDataFromConnection(connptr, ret->data, count)) < 0)
+	n = tryDataFromConnection(connptr, ret->data, count);
+	if (n < 0 && errno == EAGAIN) {
+	  if (np_req_wait_fd(req, connptr->fd, Npwaitread, data_resume, ret) == 0)
+	    return NULL;
+
+	  n = getDataFromConnection(connptr, ret->data, count);
+	}
+
+	if (n < 0)
 	  REPORT_ERROR(errno);	      
 
  done:
-	return_read(ret, n);
+	return return_read(ret, n);
+}
+
+static Npfcall*
+data_resume(Npreq *req, void *aux)
+{
+	Npfcall *ret;
+	Fid *f;
+
+	ret = aux;
+	if (req->cancelled) {
+	  np_fcall_free(ret);
+	  create_rerror(EINTR);
+	  return NULL;
+	}
+
+	f = req->fid->aux;
+	return data_read(f, req->tcall->offset, req->tcall->count, ret, req);
 }
 	
  Npfcall*
-listen_read(Fid *f, u64 offset, u32 count, Npfcall *ret)
+listen_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req)
 {
 	int n;
 	Dirtab *tabptr;
@@ -423,10 +458,12 @@ done:
 void
 usage()
 {
-  fprintf(stderr, "Usage: netfs [-p port] [-m path to mount point] [-l logfile]\n");
+  fprintf(stderr, "Usage: netfs [-p port] [-m path to mount point] [-l logfile] [-t tracefile] [-d]\n");
   fprintf(stderr, "Info:\n -p port = makes this a socket based server and assigns port where it listens\n");
   fprintf(stderr, " -m path = mounts this server locally at given path (default = exported over socket)\n");
   fprintf(stderr, " -l logfile = logs incoming requests to given file (default = printed to console)\n");
+  fprintf(stderr, " -t tracefile = records the requests and replies in binary to given file, see nptrace\n");
+  fprintf(stderr, " -d = prints the requests and replies as they are handled (slow)\n");
 
   exit(-1);
 }
@@ -442,16 +479,19 @@ main(int argc, char **argv)
 	char *opts;
 	int fd;
 	char *mountpath;
+	char *tracefile;
 
 	port = 2001;
 	nwthreads = 1;
 	issocket = 1; /* default server type is socket based  */
 	opts = NULL;
 	logfile = NULL;
+	tracefile = NULL;
 	
-	while ((c = getopt(argc, argv, "dsl:p:w:o:m:")) != -1) {
+	while ((c = getopt(argc, argv, "dsl:p:w:o:m:t:")) != -1) {
 		switch (c) {
 		case 'd':
+			debuglevel++;
 			break;
 
 		case 'p':
@@ -476,6 +516,9 @@ main(int argc, char **argv)
 		case 'l':
 		        logfile = optarg;
   		        break;
+		case 't':
+			tracefile = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -503,6 +546,14 @@ main(int argc, char **argv)
 	if (!srv)
 		return -1;
 
+	srv->debuglevel = debuglevel;
+	if (tracefile != NULL && (c = np_trace_open(tracefile)) != 0) {
+		fprintf(stderr, "cannot open trace file %s: %d\n", tracefile, c);
+		return -1;
+	}
+
+	/* data is a stream, keep each fid's reads and writes in order */
+	srv->ordering = Nporderfid;
 	npfile_init_dirtab(srv, statictab, NELEM(statictab));
 
 	init_netfs();
@@ -5,6 +5,7 @@
 enum {
   Qroot,
   Qclone,
+  Qstats,
   Nobody = 0xff
 };
 
@@ -38,13 +39,13 @@ enum {
  clone_open(Fid *f, u8 mode);
 
  Npfcall*
- ctl_read(Fid *f, u64 offset, u32 count, Npfcall *ret);
+ ctl_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req);
 
  Npfcall*
- data_read(Fid *f, u64 offset, u32 count, Npfcall *ret);
+ data_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req);
 
  Npfcall*
- listen_read(Fid *f, u64 offset, u32 count, Npfcall *ret);
+ listen_read(Fid *f, u64 offset, u32 count, Npfcall *ret, Npreq *req);
 
 Npfcall*
 ctl_write(Fid *fid, u64 offset, u32 count, u8 *data, Npreq *req);
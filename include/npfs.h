@@ -22,6 +22,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
 typedef uint8_t   u8;
@@ -32,24 +33,53 @@ typedef struct Npstr Npstr;
 typedef struct Npqid Npqid;
 typedef struct Npstat Npstat;
 typedef struct Npwstat Npwstat;
+typedef struct Npattr Npattr;
+typedef struct Npstatfs Npstatfs;
 typedef struct Npfcall Npfcall;
 typedef struct Npfid Npfid;
+typedef struct Npfidpool Npfidpool;
+typedef struct Npdirpos Npdirpos;
 typedef struct Npbuf Npbuf;
 typedef struct Nptrans Nptrans;
 typedef struct Npconn Npconn;
 typedef struct Npreq Npreq;
 typedef struct Npwthread Npwthread;
+typedef struct Npreqq Npreqq;
+typedef struct Npreqstat Npreqstat;
+typedef struct Npopstats Npopstats;
+typedef struct Npstats Npstats;
+typedef struct Nptrace Nptrace;
+typedef struct Npfdwait Npfdwait;
+typedef struct Npcoro Npcoro;
+typedef struct Nporder Nporder;
 typedef struct Npauth Npauth;
 typedef struct Npsrv Npsrv;
 typedef struct Npuser Npuser;
 typedef struct Npgroup Npgroup;
 typedef struct Npfile Npfile;
 typedef struct Npfilefid Npfilefid;
+typedef struct Npfileidx Npfileidx;
 typedef struct Npfileops Npfileops;
 typedef struct Npdirops Npdirops;
 
 /* message types */
 enum {
+	/* 9P2000.L */
+	Tlerror		= 6,
+	Rlerror,
+	Tstatfs		= 8,
+	Rstatfs,
+	Tlopen		= 12,
+	Rlopen,
+	Tlcreate	= 14,
+	Rlcreate,
+	Tgetattr	= 24,
+	Rgetattr,
+	Treaddir	= 40,
+	Rreaddir,
+	Tfsync		= 50,
+	Rfsync,
+
 	Tfirst		= 100,
 	Tversion	= 100,
 	Rversion,
@@ -130,6 +160,28 @@ enum {
 		
 };
 
+/* 9P2000.L open flags, as on Linux, the others are ignored */
+enum {
+	Lotrunc		= 01000,
+	Loappend	= 02000,
+};
+
+/* 9P2000.L Tgetattr mask and Rgetattr valid bits */
+enum {
+	Gamode		= 0x0001,
+	Ganlink		= 0x0002,
+	Gauid		= 0x0004,
+	Gagid		= 0x0008,
+	Gardev		= 0x0010,
+	Gaatime		= 0x0020,
+	Gamtime		= 0x0040,
+	Gactime		= 0x0080,
+	Gaino		= 0x0100,
+	Gasize		= 0x0200,
+	Gablocks	= 0x0400,
+	Gabasic		= 0x07ff,
+};
+
 /* qid.types */
 enum {
 	Qtdir		= 0x80,
@@ -143,11 +195,49 @@ enum {
 	Qtfile		= 0x00,
 };
 
+/* events for np_req_wait_fd */
+enum {
+	Npwaitread	= 0x01,
+	Npwaitwrite	= 0x02,
+};
+
+/* request ordering, see Npsrv.ordering */
+enum {
+	Npordernone,	/* requests run in any order */
+	Nporderfid,	/* requests for the same fid run one at a time */
+	Nporderconn,	/* requests of a connection run one at a time */
+};
+
+/* request classes, each with its own queues, see Npsrv.weight */
+enum {
+	Npclassmeta,	/* walks, stats, opens, clunks, flushes, ... */
+	Npclasssmall,	/* reads and writes of up to Npsmallio bytes */
+	Npclassbulk,	/* bigger reads and writes */
+	Npclasses,
+
+	Npsmallio	= 8192,
+};
+
+/* statistics, see np_srv_get_stats */
+enum {
+	Npstatops	= 64,	/* message types, by T-message id / 2 */
+	Nphistsub	= 4,	/* histogram buckets per power of two */
+	Nphistbuckets	= 112,	/* up to 2^35 ns */
+};
+
+/* binary tracing, see np_trace_open */
+enum {
+	Nptracecap	= 208,	/* bytes of each message kept */
+};
+
+#define NPTRACEMAGIC	"nptrace1"
+
 #define NOTAG		(u16)(~0)
 #define NOFID		(u32)(~0)
 #define MAXWELEM	16
+#define MAXWIOV		64
+#define MAXWBATCH	65536
 #define IOHDRSZ		24
-#define FID_HTABLE_SIZE 64
 
 struct Npstr {
 	u16		len;
@@ -204,53 +294,132 @@ struct Npwstat {
 	u32 		n_muid;		/* 9p2000.u extensions */
 };
 
+/* 9P2000.L file attributes, mode is a Linux mode with the file type */
+struct Npattr {
+	u64		valid;		/* Ga* bits of the fields that are set */
+	Npqid		qid;
+	u32		mode;
+	u32		uid;
+	u32		gid;
+	u64		nlink;
+	u64		rdev;
+	u64		size;
+	u64		blksize;
+	u64		blocks;
+	u64		atime_sec;
+	u64		atime_nsec;
+	u64		mtime_sec;
+	u64		mtime_nsec;
+	u64		ctime_sec;
+	u64		ctime_nsec;
+	u64		btime_sec;
+	u64		btime_nsec;
+	u64		gen;
+	u64		data_version;
+};
+
+struct Npstatfs {
+	u32		type;
+	u32		bsize;
+	u64		blocks;
+	u64		bfree;
+	u64		bavail;
+	u64		files;
+	u64		ffree;
+	u64		fsid;
+	u32		namelen;
+};
+
+/*
+ * The fields after fid are only valid for the message types they are
+ * listed for, the ones of different messages share the same memory.
+ */
 struct Npfcall {
 	u32		size;
 	u8		id;
 	u16		tag;
 	u8*		pkt;
-
 	u32		fid;
-	u32		msize;			/* Tversion, Rversion */
-	Npstr		version;		/* Tversion, Rversion */
-	u32		afid;			/* Tauth, Tattach */
-	Npstr		uname;			/* Tauth, Tattach */
-	Npstr		aname;			/* Tauth, Tattach */
-	Npqid		qid;			/* Rauth, Rattach, Ropen, Rcreate */
-	Npstr		ename;			/* Rerror */
-	u16		oldtag;			/* Tflush */
-	u32		newfid;			/* Twalk */
-	u16		nwname;			/* Twalk */
-	Npstr		wnames[MAXWELEM];	/* Twalk */
-	u16		nwqid;			/* Rwalk */
-	Npqid		wqids[MAXWELEM];	/* Rwalk */
-	u8		mode;			/* Topen, Tcreate */
-	u32		iounit;			/* Ropen, Rcreate */
-	Npstr		name;			/* Tcreate */
-	u32		perm;			/* Tcreate */
-	u64		offset;			/* Tread, Twrite */
-	u32		count;			/* Tread, Rread, Twrite, Rwrite */
-	u8*		data;			/* Rread, Twrite */
-	Npstat		stat;			/* Rstat, Twstat */
-
-	/* 9P2000.u extensions */
-	u32		ecode;			/* Rerror */
-	Npstr		extension;		/* Tcreate */
-
+	int		fd;	/* Rread data is in fd at offset, or -1 */
 	Npfcall*	next;
+
+	union {
+		struct {
+			u32	msize;			/* Tversion, Rversion */
+			Npstr	version;		/* Tversion, Rversion */
+		};
+		struct {
+			u32	afid;			/* Tauth, Tattach */
+			Npstr	uname;			/* Tauth, Tattach */
+			Npstr	aname;			/* Tauth, Tattach */
+		};
+		struct {
+			Npqid	qid;			/* Rauth, Rattach, Ropen, Rcreate,
+							   Rlopen, Rlcreate */
+			u32	iounit;			/* Ropen, Rcreate, Rlopen, Rlcreate */
+		};
+		struct {
+			Npstr	ename;			/* Rerror */
+			u32	ecode;			/* Rerror, 9P2000.u, Rlerror */
+		};
+		u16		oldtag;			/* Tflush */
+		struct {
+			u32	newfid;			/* Twalk */
+			u16	nwname;			/* Twalk */
+			Npstr	wnames[MAXWELEM];	/* Twalk */
+		};
+		struct {
+			u16	nwqid;			/* Rwalk */
+			Npqid	wqids[MAXWELEM];	/* Rwalk */
+		};
+		struct {
+			u8	mode;			/* Topen, Tcreate */
+			Npstr	name;			/* Tcreate, Tlcreate */
+			u32	perm;			/* Tcreate, Tlcreate */
+			Npstr	extension;		/* Tcreate, 9P2000.u */
+			u32	flags;			/* Tlopen, Tlcreate */
+			u32	gid;			/* Tlcreate */
+		};
+		struct {
+			u64	offset;			/* Tread, Twrite, Rread from fd,
+							   Treaddir */
+			u32	count;			/* Tread, Rread, Twrite, Rwrite,
+							   Treaddir, Rreaddir */
+			u8*	data;			/* Rread, Twrite, Rreaddir */
+		};
+		Npstat		stat;			/* Rstat, Twstat */
+		u64		mask;			/* Tgetattr */
+		Npattr		attr;			/* Rgetattr */
+		Npstatfs	statfs;			/* Rstatfs */
+		u32		datasync;		/* Tfsync */
+	};
 };
 
 struct Npfid {
 	Npconn*		conn;
 	u32		fid;
 	int		refcount;
+	int		clunked;	/* a Tclunk or Tremove took it */
 	u16		omode;
 	u8		type;
-	u32		diroffset;
 	Npuser*		user;
 	void*		aux;
 
-	Npfid*		next;	/* list of fids within a bucket */
+	u32		slot;	/* index in the pool's table */
+	Npfid*		next;	/* free list of the pool */
+};
+
+/*
+ * Where a directory listing can be resumed. 9P2000 directory offsets
+ * are byte counts, so a backend records the offset at the end of each
+ * read it returned together with a cookie that finds the next entry.
+ * The offsets only grow, a lookup is a binary search.
+ */
+struct Npdirpos {
+	int		n;
+	int		size;
+	u64*		offset;
+	u64*		cookie;
 };
 
 struct Npbuf {
@@ -258,6 +427,11 @@ struct Npbuf {
 	int		size;
 	int		pos;
 	u8*		buf;
+	struct iovec*	iov;	/* if set, the data is in iov, not in buf */
+	int		iovcnt;
+	int		fd;	/* if not -1, the data from fdpos on is in fd */
+	int		fdpos;
+	u64		fdoff;	/* offset in fd of the byte at fdpos */
 
 	void*		aux;
 	void		(*changed)(void *);
@@ -269,6 +443,7 @@ struct Nptrans {
 	int		connected;
 	Npbuf*		txbuf;
 	Npbuf*		rxbuf;
+	int		sendfile;	/* can send buffers with an fd */
 	void*		aux;
 
 	void		(*settxbuf)(Nptrans *);
@@ -281,19 +456,32 @@ struct Npconn {
 	pthread_mutex_t	lock;
 	u32		msize;
 	int		dotu;
+	int		dotl;	/* speaks 9P2000.L */
 	int		shutdown;
+	int		sendfile;	/* replies can refer to files */
 	Npsrv*		srv;
 	Nptrans*	trans;
-	Npfid**		fidpool;
-	Npfcall*	rcall;
+	Npfidpool*	fidpool;
+	Npfcall*	rcall;	/* big message read into its own packet */
 	Npbuf		rbuf;
-	Npfcall*	wcall;
+	u8*		rxdata;	/* receive buffer */
+	u32		rxsize;
+	u32		rxstart;/* first unparsed byte in rxdata */
+	Npfcall*	wcall;	/* replies being sent, linked by next */
 	Npbuf		wbuf;
+	struct iovec	wiov[MAXWIOV];
 	Npfcall*	rcalls;
 	Npfcall**	rcallp;
-	int		freercnum;
-	Npfcall*	freerclist;
 	void*		aux;
+	int		home;	/* worker that gets the requests first */
+	Npreq*		reqs;	/* outstanding requests */
+	Npreq**		tags[256];/* outstanding requests by tag, two levels */
+	int		ordering;
+	Nporder**	ordtab;	/* ordering queues by key */
+	Nporder*	ordfree;
+	int		nreqs;	/* outstanding requests */
+	int		maxreqs;/* stop reading beyond that, 0 for no limit */
+	int		throttled;
 
 	Npconn*		next;	/* list of connections within a server */
 };
@@ -304,21 +492,95 @@ struct Npreq {
 	Npfcall*	tcall;
 	Npfcall*	rcall;
 	int		cancelled;
+	int		state;	/* pending, working or flushed */
 	Npreq*		flushreq;
 	Npfid*		fid;
+	int		fidref;	/* np_respond drops the reference to fid */
+
+	/* requests waiting for a backend fd, see np_req_wait_fd */
+	Npfdwait*	wait;
+	Npfcall*	(*resume)(Npreq *, void *);
+	void*		resumeaux;
 
-	Npreq*		next;	/* list of all outstanding requests */
-	Npreq*		prev;	/* used for requests that are worked on */
+	/* requests running on a coroutine, see np_srv_set_coroutines */
+	Npwthread*	cowthread;	/* the worker that owns the coroutine */
+	Npreq*		conext;		/* worker's list of coroutines to resume */
+
+	Nporder*	order;	/* ordering queue the request is in */
+	Npreq*		onext;
+
+	Npreq*		next;	/* list of the connection's outstanding requests */
+	Npreq*		prev;
 	Npwthread*	wthread;/* for requests that are worked on */
+	u64		qtime;	/* when it was queued for the workers, ns */
+	u64		rtime;	/* when it was received */
+	u64		dtime;	/* when a worker first took it */
+};
+
+struct Npreqstat {
+	u64		depth;		/* requests in the queues */
+	u64		nreqs;		/* requests taken from the queues */
+	u64		waitsum;	/* ns they spent in the queues */
+	u64		waitmax;
+};
+
+struct Npopstats {
+	u64		nmsgs;		/* replies */
+	u64		nerrors;	/* of which Rerror or Rlerror */
+	u64		bytesin;
+	u64		bytesout;
+	u64		svc[Nphistbuckets];	/* ns from worker to reply */
+	u64		total[Nphistbuckets];	/* ns from receive to reply */
+};
+
+struct Npstats {
+	u64		uptime;		/* ns since the server was created */
+	int		nwthreads;
+	u64		busy;		/* ns the workers were not idle, summed */
+	Npreqstat	classes[Npclasses];
+	Npopstats	op[Npstatops];
+};
+
+/*
+ * A trace file is NPTRACEMAGIC followed by records in host byte
+ * order. A record of type 0 says that size records were lost.
+ */
+struct Nptrace {
+	u64		time;		/* ns, CLOCK_MONOTONIC */
+	u64		conn;		/* identifies the connection */
+	u64		latency;	/* replies: ns since the request came in */
+	u32		fid;
+	u32		size;		/* of the whole message */
+	u16		tag;
+	u8		type;
+	u8		dotu;
+	u16		caplen;		/* bytes of the message in pkt */
+	u16		pad;
+	u8		pkt[Nptracecap];
 };
 
 struct Npwthread {
 	Npsrv*		srv;
+	int		id;
 	int		shutdown;
 	pthread_t	thread;
 	char*		errname;
 	u32		errcode;
 
+	Npreqq*		reqq[Npclasses];/* requests waiting for this worker */
+	u32		turn;		/* weighted round robin of the classes */
+	Npreqstat	stats[Npclasses];
+	u64		idle;		/* ns spent waiting for requests */
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		sleeping;
+
+	Npcoro*		coro;		/* coroutine running on the worker */
+	Npcoro*		cofree;		/* coroutines kept for reuse */
+	int		ncofree;
+	Npreq*		coready;	/* parked coroutines ready to resume */
+	Npreq*		coreadylast;
+
 	Npwthread	*next;
 };
 
@@ -333,6 +595,10 @@ struct Npauth {
 struct Npsrv {
 	u32		msize;
 	int		dotu;		/* 9P2000.u support flag */
+	int		dotl;		/* 9P2000.L support flag */
+	int		ordering;	/* Npordernone, Nporderfid or Nporderconn */
+	int		weight[Npclasses];/* share of the picks for each class */
+	int		maxreqs;	/* requests in flight per connection */
 	void*		srvaux;
 	void*		treeaux;
 	int		debuglevel;
@@ -352,6 +618,14 @@ struct Npsrv {
 	Npfcall*	(*flush)(Npreq *req);
 	int		(*clone)(Npfid *fid, Npfid *newfid);
 	int		(*walk)(Npfid *fid, Npstr *wname, Npqid *wqid);
+
+	/*
+	 * Optional, walks all the names at once instead of calling walk
+	 * for each. Returns how many were walked, as walk it sets the
+	 * error if it is none.
+	 */
+	int		(*walkpath)(Npfid *fid, int nwname, Npstr *wnames,
+				Npqid *wqids);
 	Npfcall*	(*open)(Npfid *fid, u8 mode);
 	Npfcall*	(*create)(Npfid *fid, Npstr* name, u32 perm, u8 mode, 
 				Npstr* extension);
@@ -363,15 +637,30 @@ struct Npsrv {
 	Npfcall*	(*stat)(Npfid *fid);
 	Npfcall*	(*wstat)(Npfid *fid, Npstat *stat);
 
+	/*
+	 * 9P2000.L. The defaults of lopen, lcreate, getattr and fsync
+	 * are built on open, create, stat and wstat, readdir has none.
+	 */
+	Npfcall*	(*statfs)(Npfid *fid);
+	Npfcall*	(*lopen)(Npfid *fid, u8 mode, u32 flags);
+	Npfcall*	(*lcreate)(Npfid *fid, Npstr *name, u32 perm, u8 mode,
+				u32 flags, u32 gid);
+	Npfcall*	(*getattr)(Npfid *fid, u64 mask);
+	Npfcall*	(*readdir)(Npfid *fid, u64 offset, u32 count, 
+				Npreq *req);
+	Npfcall*	(*fsync)(Npfid *fid, int datasync);
+
 	/* implementation specific */
 	pthread_mutex_t	lock;
-	pthread_cond_t	reqcond;
 	int		shuttingdown;
 	Npconn*		conns;
 	Npwthread*	wthreads;
-	Npreq*		reqs_first;
-	Npreq*		reqs_last;
-	Npreq*		workreqs;
+	int		nwthreads;
+	Npwthread**	wtab;
+	int		nexthome;
+	int		nsleeping;
+	int		costack;	/* coroutine stack size, 0 if none */
+	u64		ctime;		/* when it was created, ns */
 };
 
 struct Npuser {
@@ -392,7 +681,7 @@ struct Npgroup {
 };
 
 struct Npfile {
-	pthread_mutex_t	lock;
+	pthread_rwlock_t lock;		/* shared for lookups and reads */
 	int		refcount;
 	Npfile*		parent;
 	Npqid		qid;
@@ -406,8 +695,11 @@ struct Npfile {
 	Npuser*		muid;
 	char*		extension;
 	int		excl;
+	int		removed;	/* unlinked from parent by Tremove */
 	void*		ops;
 	void*		aux;
+	Npfileidx*	index;		/* children by name, see npfile_index */
+	Npfile*		inext;		/* bucket chain in the parent's index */
 
 	/* not used -- provided for user's convenience */
 	Npfile*		next;
@@ -426,6 +718,14 @@ struct Npfileops {
 
 	int		(*openfid)(Npfilefid *);
 	void		(*closefid)(Npfilefid *);
+
+	/*
+	 * For files kept on disk. Set *fd and *fdoff to where the data
+	 * at offset is and return how many bytes of it to send. The fd
+	 * is only used during the call, the reply keeps a dup of it.
+	 */
+	int		(*readfd)(Npfilefid* file, u64 offset, u32 count,
+				int *fd, u64 *fdoff, Npreq *req);
 };
 
 struct Npdirops {
@@ -443,8 +743,7 @@ struct Npfilefid {
 	Npfile*		file;
 	int		omode;
 	void*		aux;
-	u64		diroffset;
-	Npfile*		dirent;
+	Npdirpos	dirpos;		/* cookies are the next Npfile, see npfile_dirnext */
 };
 
 extern char *Eunknownfid;
@@ -464,33 +763,61 @@ extern char *Eopen;
 extern char *Eexist;
 extern char *Enotempty;
 extern char *Eunknownuser;
+extern char *Etaginuse;
 
 Npsrv *np_srv_create(int nwthread);
 void np_srv_remove_conn(Npsrv *, Npconn *);
 void np_srv_start(Npsrv *);
 void np_srv_shutdown(Npsrv *, int wait);
 int np_srv_add_conn(Npsrv *, Npconn *);
+int np_srv_set_coroutines(Npsrv *, int stacksize);
+int np_wait_fd(int fd, int events);
+void np_srv_get_reqstats(Npsrv *, Npreqstat *);
+void np_srv_get_stats(Npsrv *, Npstats *);
+char *np_srv_stats_text(Npsrv *);
+u64 np_hist_quantile(u64 *hist, double q);
+int np_trace_open(char *path);
+void np_trace_close(void);
 
 Npconn *np_conn_create(Npsrv *, Nptrans *);
-void np_conn_reset(Npconn *, u32, int);
+void np_conn_reset(Npconn *, u32, int, int);
 void np_conn_shutdown(Npconn *, int);
 void np_conn_send_fcall(Npconn *, Npfcall *);
 void np_respond(Npreq *, Npfcall *);
+void np_respond_error(Npreq *, char *, int);
+Npfcall *np_req_keep_tcall(Npreq *);
 
-Npfid **np_fidpool_create(void);
+Npfidpool *np_fidpool_create(void);
 Npfid *np_fid_find(Npconn *, u32);
+Npfid *np_fid_get(Npconn *, u32);
 Npfid *np_fid_create(Npconn *, u32, void *);
 int np_fid_destroy(Npfid *);
 void np_fid_incref(Npfid *);
 void np_fid_decref(Npfid *);
+int np_dirpos_find(Npdirpos *, u64 offset, u64 *cookie);
+int np_dirpos_add(Npdirpos *, u64 offset, u64 cookie);
+void np_dirpos_free(Npdirpos *);
 
 Nptrans *np_trans_create(void);
 void np_trans_destroy(Nptrans *);
 void np_trans_set_txbuf(Nptrans *, Npbuf *);
 void np_trans_set_rxbuf(Nptrans *, Npbuf *);
 
+/*
+ * Messages come from per-thread caches and carry a reference count in
+ * a header in front of the Npfcall. Every Npfcall a backend gets from
+ * np_fcall_alloc, np_create_* or np_alloc_* and does not return as a
+ * reply must be released with np_fcall_free, never with free.
+ */
+Npfcall *np_fcall_alloc(u32);
+void np_fcall_free(Npfcall *);
+void np_fcall_incref(Npfcall *);
 int np_deserialize(Npfcall*, u8*, int);
+int np_deserialize_rcall(Npfcall*, u8*, int);
 int np_serialize_stat(Npwstat *wstat, u8* buf, int buflen, int dotu);
+int np_serialize_dirent(Npqid *qid, u64 offset, char *name, u8 *buf, 
+	int buflen);
+u32 np_mode2lmode(u32 mode);
 
 char *np_strdup(Npstr *str);
 int np_strcmp(Npstr *str, char *cs);
@@ -513,7 +840,15 @@ Npfcall *np_create_rremove(void);
 Npfcall *np_create_rstat(Npwstat *stat, int dotu);
 Npfcall *np_create_rwstat(void);
 Npfcall * np_alloc_rread(u32);
+Npfcall *np_create_rread_fd(u32 count, int fd, u64 offset);
 void np_set_rread_count(Npfcall *, u32);
+Npfcall *np_create_rlerror(int ecode);
+Npfcall *np_create_rstatfs(Npstatfs *statfs);
+Npfcall *np_create_rlopen(Npqid *qid, u32 iounit);
+Npfcall *np_create_rlcreate(Npqid *qid, u32 iounit);
+Npfcall *np_create_rgetattr(Npattr *attr);
+Npfcall *np_alloc_rreaddir(u32);
+Npfcall *np_create_rfsync(void);
 
 Npuser* np_uid2user(int uid);
 Npuser* np_uname2user(char *uname);
@@ -523,6 +858,9 @@ int np_usergroups(Npuser *u, gid_t **gids);
 int np_change_user(Npuser *u);
 
 Nptrans *np_fdtrans_create(int, int);
+void np_fdtrans_set_nreactors(int);
+int np_req_wait_fd(Npreq *, int, int, Npfcall *(*)(Npreq *, void *), void *);
+Nptrans *np_uringtrans_create(int);
 Npsrv *np_socksrv_create_tcp(int, int*);
 Npsrv *np_pipesrv_create(int nwthreads);
 int np_pipesrv_mount(Npsrv *srv, char *mntpt, char *user, int mntflags, char *opts);
@@ -536,8 +874,10 @@ Npfile* npfile_alloc(Npfile *parent, char *name, u32 mode, u64 qpath,
 void npfile_incref(Npfile *);
 int npfile_decref(Npfile *);
 Npfile *npfile_find(Npfile *, char *);
+int npfile_index(Npfile *);
 int npfile_checkperm(Npfile *file, Npuser *user, int perm);
 void npfile_init_srv(Npsrv *, Npfile *);
+extern Npfileops npfile_statsops;
 
 
 /* some useful macros */
@@ -32,12 +32,34 @@ extern int printfcall(FILE *f, Npfcall *fc, int dotu);
 static void np_conn_error(Npconn *conn, int err);
 static void np_conn_data_in(void *);
 static void np_conn_data_out(void *);
-static void np_conn_call_in(Npconn *, Npfcall *);
-static void np_conn_new_rcall(Npconn *);
-static void np_conn_new_wcall(Npconn *, Npfcall *);
+static int np_conn_parse(Npconn *, Npfcall *, Npreq **, Npreq **);
+static void np_conn_call_in(Npconn *, Npreq *);
+static int np_conn_add_tag(Npconn *, Npreq *);
+static int np_conn_order(Npconn *, Npreq *);
+static void np_conn_new_wcall(Npconn *);
 static void np_buf_init(Npbuf *, void *, void (*)(void *),
 	void (*)(void *, int));
 static void np_buf_set(Npbuf *, u8 *, u32);
+static void np_buf_setv(Npbuf *, struct iovec *, int, u32);
+static void np_buf_setfd(Npbuf *, int, u32, u64);
+
+enum {
+	Rxminsize	= 65536,	/* receive buffer size */
+	Directsize	= 8192,		/* read bigger messages into their packet */
+	Maxbatch	= 64,		/* requests queued per lock of the connection */
+	Ordersize	= 64,		/* buckets of the ordering queues */
+};
+
+/*
+ * Requests with the same ordering key, see Npsrv.ordering. The first
+ * one is queued for the workers, the rest wait for it to respond.
+ */
+struct Nporder {
+	u32		key;
+	Npreq*		first;	/* queued or working, linked by onext */
+	Npreq*		last;
+	Nporder*	next;	/* bucket chain, or list of free ones */
+};
 
 Npconn*
 np_conn_create(Npsrv *srv, Nptrans *trans)
@@ -52,7 +74,9 @@ np_conn_create(Npsrv *srv, Nptrans *trans)
 	conn->srv = srv;
 	conn->msize = srv->msize;
 	conn->dotu = srv->dotu;
+	conn->dotl = 0;
 	conn->shutdown = 0;
+	conn->sendfile = trans->sendfile;
 	conn->fidpool = np_fidpool_create();
 	conn->trans = trans;
 	np_buf_init(&conn->rbuf, conn, np_conn_data_in, 
@@ -64,96 +88,166 @@ np_conn_create(Npsrv *srv, Nptrans *trans)
 	conn->aux = NULL;
 	conn->wcall = NULL;
 	conn->rcall = NULL;
-	conn->freercnum = 0;
-	conn->freerclist = NULL;
-	np_conn_new_rcall(conn);
+	conn->home = np_srv_home(srv);
+	conn->reqs = NULL;
+	memset(conn->tags, 0, sizeof(conn->tags));
+	conn->ordering = srv->ordering;
+	conn->ordtab = NULL;
+	conn->ordfree = NULL;
+	conn->nreqs = 0;
+	conn->maxreqs = srv->maxreqs;
+	conn->throttled = 0;
+
+	/* room for many small messages, and at least one of each size */
+	conn->rxsize = 2 * srv->msize;
+	if (conn->rxsize < Rxminsize)
+		conn->rxsize = Rxminsize;
+	conn->rxdata = malloc(conn->rxsize);
+	conn->rxstart = 0;
+	np_buf_set(&conn->rbuf, conn->rxdata, conn->rxsize);
 	np_trans_set_rxbuf(conn->trans, &conn->rbuf);
-	np_conn_new_wcall(conn, NULL);
+	np_conn_new_wcall(conn);
 
 	return conn;
 }
 
+/*
+ * Free the tag tables and the ordering queues of a connection that is
+ * shut down. The requests still working are the only ones left, each
+ * first in its queue, so they are taken out of the queues and find
+ * no tag table when they respond. Called with the connection lock
+ * held.
+ */
+static void
+np_conn_free_tables(Npconn *conn)
+{
+	int i;
+	Npreq *req;
+	Nporder *o, *o1;
+
+	for(req = conn->reqs; req != NULL; req = req->next) {
+		req->order = NULL;
+		req->onext = NULL;
+	}
+
+	for(i = 0; i < 256; i++) {
+		free(conn->tags[i]);
+		conn->tags[i] = NULL;
+	}
+
+	if (conn->ordtab) {
+		for(i = 0; i < Ordersize; i++) {
+			for(o = conn->ordtab[i]; o != NULL; o = o1) {
+				o1 = o->next;
+				free(o);
+			}
+		}
+
+		free(conn->ordtab);
+		conn->ordtab = NULL;
+	}
+
+	for(o = conn->ordfree; o != NULL; o = o1) {
+		o1 = o->next;
+		free(o);
+	}
+	conn->ordfree = NULL;
+}
+
 void
-np_conn_reset(Npconn *conn, u32 msize, int dotu)
+np_conn_reset(Npconn *conn, u32 msize, int dotu, int dotl)
 {
-	Npsrv *srv;
-	Npreq *req, *req1, **prevp;
+	Npreq *req, *req1, *wreqs;
 	Npfcall *rc, *rc1;
 
-	pthread_mutex_lock(&conn->srv->lock);
-	srv = conn->srv;
-	// first flush all outstanding requests
-	req = srv->reqs_first;
-	while (req != NULL) {
-		if (req->conn == conn) {
-			req1 = req->next;
-			np_srv_remove_request(srv, req);
-			free(req->tcall);
-			free(req);
-			req = req1;
-		} else {
-			prevp = &req->next;
-			req = *prevp;
+	wreqs = NULL;
+	pthread_mutex_lock(&conn->lock);
+	// the requests waiting in ordering queues never got to the
+	// workers, free them before their queues can move on
+	for(req = conn->reqs; req != NULL; req = req1) {
+		req1 = req->next;
+		if (np_req_waiting(req)) {
+			np_conn_remove_req(conn, req);
+			np_fcall_free(req->tcall);
+			reqfree(req);
 		}
 	}
 
-	// then mark all working requests as cancelled
-	req = conn->srv->workreqs;
-	while (req != NULL) {
-		if (req->conn == conn && req->tcall->id != Tversion) {
+	// flush all pending requests, the workers will drop them,
+	// and mark all working requests as cancelled
+	for(req = conn->reqs; req != NULL; req = req1) {
+		req1 = req->next;
+		if (np_req_claim(req, Reqflushed))
+			np_conn_remove_req(conn, req);
+		else if (req->tcall->id != Tversion) {
 			req->cancelled = 1;
+			// not on a worker's list while it waits for an fd
+			if (np_req_cancel_wait(req)) {
+				req->conext = wreqs;
+				wreqs = req;
+			}
 		}
-		req = req->next;
 	}
-	pthread_mutex_unlock(&conn->srv->lock);
 
-	pthread_mutex_lock(&conn->lock);
 	// don't send any responses queued for sending
 	rc = conn->rcalls;
 	conn->rcalls = NULL;
+	conn->rcallp = &conn->rcalls;
 	while (rc != NULL) {
 		rc1 = rc->next;
-		free(rc);
-		rc = rc->next;
-	}
-
-	// free all rcall from the pool
-	rc = conn->freerclist;
-	while (rc != NULL) {
-		rc1 = rc->next;
-		free(rc);
+		np_fcall_free(rc);
 		rc = rc1;
 	}
-	conn->freercnum = 0;
-	conn->freerclist = NULL;
 
-	// TODO: wait until the transport finishes sending (if it does)
+	// the replies being sent are left to the transport to finish
 	if (!conn->shutdown) {
+		/*
+		 * Keep the receive buffer, the transport may be reading
+		 * into it. It is big enough for any msize.
+		 */
 		conn->msize = msize;
 		conn->dotu = dotu;
-		free(conn->rcall);
-		np_conn_new_rcall(conn);
-		np_trans_set_rxbuf(conn->trans, &conn->rbuf);
-		np_conn_new_wcall(conn, NULL);
+		conn->dotl = dotl;
 		pthread_mutex_unlock(&conn->lock);
 	} else {
-		free(conn->rcall);
-		free(conn->wcall);
+		np_fcall_free(conn->rcall);
+		free(conn->rxdata);
+		conn->rcall = NULL;
+		conn->rxdata = NULL;
+		np_conn_free_tables(conn);
+		np_conn_new_wcall(conn);
+		pthread_mutex_unlock(&conn->lock);
+	}
+
+	// the requests that waited for backend fds finish as cancelled
+	for(req = wreqs; req != NULL; req = req1) {
+		req1 = req->conext;
+		np_req_requeue(req);
 	}
 }
 
 void
 np_conn_shutdown(Npconn *conn, int reset)
 {
-	np_srv_remove_conn(conn->srv, conn);
-
 	pthread_mutex_lock(&conn->lock);
+	if (conn->shutdown) {
+		pthread_mutex_unlock(&conn->lock);
+		return;
+	}
 	conn->shutdown = 1;
-	np_trans_destroy(conn->trans);
 	pthread_mutex_unlock(&conn->lock);
 
+	np_srv_remove_conn(conn->srv, conn);
+
+	/*
+	 * The transport may wait for its outstanding I/O to finish, and
+	 * the completions can call back into the connection, so don't
+	 * hold the lock while destroying it.
+	 */
+	np_trans_destroy(conn->trans);
+
 	if (reset)
-		np_conn_reset(conn, conn->srv->msize, 0);
+		np_conn_reset(conn, conn->srv->msize, 0, 0);
 }
 
 static void
@@ -162,67 +256,167 @@ np_conn_error(Npconn *conn, int err)
 	np_conn_shutdown(conn, 1);
 }
 
+/*
+ * Parse all complete messages that were received and queue them for
+ * the worker threads at once. The small messages are copied out of
+ * the receive buffer, which is consumed from rxstart on and compacted
+ * only when there is no room for a full message at its end. A big
+ * message that is not received in full is moved to its own packet,
+ * and the rest of it is read directly there.
+ */
 static void
 np_conn_data_in(void *a)
 {
-	int n, rpos, bufchanged;
+	int n, err, bufchanged;
+	u32 start, avail;
+	u8 *p;
 	Npconn *conn;
 	Npbuf *rb;
-	Npfcall *rcall;
-	u8 *rbuf;
+	Npfcall *rc;
+	Npreq *req, *req1, *reqs, *reqlast;
 
 	conn = a;
 	rb = &conn->rbuf;
-
+	err = 0;
+	reqs = NULL;
+	reqlast = NULL;
 	bufchanged = 0;
-	while (rb->pos > 4) {
-		n = rb->buf[0] | (rb->buf[1]<<8) | (rb->buf[2]<<16) | 
-			(rb->buf[3]<<24);
 
-		if (n > rb->size) {
-			np_conn_error(conn, ENOMEM);
+	if (conn->rcall) {
+		if (rb->pos < rb->size)
 			return;
+
+		rc = conn->rcall;
+		conn->rcall = NULL;
+		np_buf_set(rb, conn->rxdata, conn->rxsize);
+		conn->rxstart = 0;
+		bufchanged = 1;
+		err = np_conn_parse(conn, rc, &reqs, &reqlast);
+	}
+
+	n = 0;
+	start = conn->rxstart;
+	while (!err && (avail = rb->pos - start) >= 4) {
+		p = rb->buf + start;
+		n = p[0] | (p[1]<<8) | (p[2]<<16) | (p[3]<<24);
+		if (n < 7) {
+			err = EPROTO;
+			break;
+		}
+
+		if (n > conn->msize) {
+			err = ENOMEM;
+			break;
 		}
 
-		if (rb->pos < n)
+		if (avail < n)
 			break;
 
-		n = np_deserialize(conn->rcall, rb->buf, conn->dotu);
-		if (conn->srv->debuglevel) {
-			fprintf(stderr, "<<< ");
-			printfcall(stderr, conn->rcall, conn->dotu);
-			fprintf(stderr, "\n");
+		rc = np_fcall_alloc(n);
+		if (!rc) {
+			err = ENOMEM;
+			break;
 		}
 
-		if (!n) {
-			np_conn_error(conn, EPROTO);
-			return;
+		memcpy(rc->pkt, p, n);
+		err = np_conn_parse(conn, rc, &reqs, &reqlast);
+		start += n;
+	}
+
+	if (!err) {
+		avail = rb->pos - start;
+		if (!avail) {
+			if (rb->pos) {
+				rb->pos = 0;
+				bufchanged = 1;
+			}
+			start = 0;
+		} else if (avail >= 4 && n >= Directsize &&
+			   (rc = np_fcall_alloc(n)) != NULL) {
+			memcpy(rc->pkt, rb->buf + start, avail);
+			conn->rcall = rc;
+			np_buf_set(rb, rc->pkt, n);
+			rb->pos = avail;
+			start = 0;
+			bufchanged = 1;
+		} else if (start + conn->msize > rb->size) {
+			memmove(rb->buf, rb->buf + start, avail);
+			rb->pos = avail;
+			start = 0;
+			bufchanged = 1;
+		}
+		conn->rxstart = start;
+	}
+
+	if (err) {
+		for(req = reqs; req != NULL; req = req1) {
+			req1 = req->next;
+			np_fcall_free(req->tcall);
+			reqfree(req);
 		}
 
-		rcall = conn->rcall;
-		rbuf = rb->buf;
-		rpos = rb->pos;
+		np_conn_error(conn, err);
+		return;
+	}
+
+	if (reqs)
+		np_conn_call_in(conn, reqs);
+
+	if (conn->maxreqs) {
+		/*
+		 * Too many requests in flight, stop reading until the
+		 * replies drain, np_conn_remove_req gives the buffer back.
+		 */
 		pthread_mutex_lock(&conn->lock);
-		np_conn_new_rcall(conn);
+		if (!conn->throttled && conn->nreqs >= conn->maxreqs) {
+			conn->throttled = 1;
+			np_trans_set_rxbuf(conn->trans, NULL);
+		} else if (bufchanged && !conn->throttled)
+			np_trans_set_rxbuf(conn->trans, rb);
 		pthread_mutex_unlock(&conn->lock);
-		if (rpos > n)
-			memmove(conn->rbuf.buf, rbuf + n, rpos - n);
+	} else if (bufchanged)
+		np_trans_set_rxbuf(conn->trans, rb);
+}
 
-		conn->rbuf.pos = rpos-n;
+/*
+ * Deserialize a message and append a request for it to the list.
+ */
+static int
+np_conn_parse(Npconn *conn, Npfcall *rc, Npreq **reqs, Npreq **reqlast)
+{
+	int n;
+	Npreq *req;
 
-		np_conn_call_in(conn, rcall);
-		bufchanged = 1;
+	n = np_deserialize(rc, rc->pkt, conn->dotu);
+	if (conn->srv->debuglevel) {
+		fprintf(stderr, "<<< ");
+		printfcall(stderr, rc, conn->dotu);
+		fprintf(stderr, "\n");
 	}
 
-	if (bufchanged)
-		np_trans_set_rxbuf(conn->trans, &conn->rbuf);
+	if (!n) {
+		np_fcall_free(rc);
+		return EPROTO;
+	}
+
+	req = reqalloc();
+	req->conn = conn;
+	req->tag = rc->tag;
+	req->tcall = rc;
+	req->prev = *reqlast;
+	if (*reqlast)
+		(*reqlast)->next = req;
+	else
+		*reqs = req;
+	*reqlast = req;
+
+	return 0;
 }
 
 static void
 np_conn_data_out(void *a)
 {
 	Npbuf *wb;
-	Npfcall *rc;
 	Npconn *conn;
 
 	conn = a;
@@ -231,113 +425,377 @@ np_conn_data_out(void *a)
 		return;
 
 	pthread_mutex_lock(&conn->lock);
-	rc = conn->rcalls;
-	if (rc) {
-		conn->rcalls = rc->next;
-		if (conn->rcalls == NULL)
-			conn->rcallp = &conn->rcalls;
-	}
-
-	np_conn_new_wcall(conn, rc);
+	np_conn_new_wcall(conn);
 	pthread_mutex_unlock(&conn->lock);
 	np_trans_set_txbuf(conn->trans, &conn->wbuf);
 }
 
+/*
+ * Add the requests to the connection's outstanding requests and queue
+ * them for the workers. This is done in chunks, so the requests are
+ * queued without holding the connection lock. A request that reuses
+ * the tag of an outstanding one gets an error right away.
+ */
 static void
-np_conn_call_in(Npconn *conn, Npfcall *tc)
+np_conn_call_in(Npconn *conn, Npreq *reqs)
 {
-	Npsrv *srv;
-	Npreq *req;
+	int n;
+	u64 now;
+	Npreq *req, *dups, *batch[Maxbatch];
+	Npfcall *rc;
 
-	req = reqalloc();
-	req->conn = conn;
-	req->tag = tc->tag;
-	req->tcall = tc;
-
-	pthread_mutex_lock(&conn->srv->lock);
-	srv = conn->srv;
-	req->prev = srv->reqs_last;
-	if (srv->reqs_last)
-		srv->reqs_last->next = req;
-	srv->reqs_last = req;
-	if (!srv->reqs_first)
-		srv->reqs_first = req;
-
-	pthread_mutex_unlock(&conn->srv->lock);
-	pthread_cond_signal(&conn->srv->reqcond);
+	now = np_nsec();
+	while (reqs != NULL) {
+		dups = NULL;
+		pthread_mutex_lock(&conn->lock);
+		for(n = 0; reqs != NULL && n < Maxbatch; ) {
+			req = reqs;
+			reqs = req->next;
+			req->rtime = now;
+			np_stats_in(req->tcall);
+			if (np_tracing)
+				np_trace(conn, req->tcall, req->tcall->fid, 0);
+			if (!np_conn_add_tag(conn, req)) {
+				req->next = dups;
+				dups = req;
+				continue;
+			}
+
+			req->prev = NULL;
+			req->next = conn->reqs;
+			if (conn->reqs)
+				conn->reqs->prev = req;
+			conn->reqs = req;
+			conn->nreqs++;
+			if (np_conn_order(conn, req))
+				batch[n++] = req;
+		}
+		pthread_mutex_unlock(&conn->lock);
+
+		np_srv_add_reqs(conn->srv, conn->home, batch, n);
+		while ((req = dups) != NULL) {
+			dups = req->next;
+			rc = np_conn_rerror(conn, Etaginuse, EIO);
+			np_set_tag(rc, req->tag);
+			if (np_tracing)
+				np_trace(conn, rc, req->tcall->fid, 0);
+			np_conn_send_fcall(conn, rc);
+			np_fcall_free(req->tcall);
+			reqfree(req);
+		}
+	}
 }
 
-void
-np_conn_send_fcall(Npconn *conn, Npfcall *rc)
+/*
+ * Returns 1 if the request waits behind another one in its ordering
+ * queue, so it was never queued for the workers and nobody else will
+ * free it. Called with the connection lock held.
+ */
+int
+np_req_waiting(Npreq *req)
 {
-	if (conn->srv->debuglevel) {
-		fprintf(stderr, ">>> ");
-		printfcall(stderr, rc, conn->dotu);
-		fprintf(stderr, "\n");
+	return req->order && req->order->first != req;
+}
+
+/*
+ * Remove a request from the connection's outstanding requests, and
+ * from its ordering queue. Returns the request that may run after it,
+ * for the caller to queue when it has released the connection lock.
+ * Called with the connection lock held.
+ */
+Npreq *
+np_conn_remove_req(Npconn *conn, Npreq *req)
+{
+	Npreq **tt, *r, *next;
+	Nporder *o, **po;
+
+	tt = conn->tags[req->tag >> 8];
+	if (tt && tt[req->tag & 0xFF] == req)
+		tt[req->tag & 0xFF] = NULL;
+
+	if (req->prev || conn->reqs == req)
+		conn->nreqs--;
+
+	if (req->prev)
+		req->prev->next = req->next;
+	else if (conn->reqs == req)
+		conn->reqs = req->next;
+
+	if (req->next)
+		req->next->prev = req->prev;
+
+	req->next = NULL;
+	req->prev = NULL;
+
+	/* half of the requests replied, read again */
+	if (conn->throttled && !conn->shutdown &&
+	    conn->nreqs <= conn->maxreqs / 2) {
+		conn->throttled = 0;
+		np_trans_set_rxbuf(conn->trans, &conn->rbuf);
 	}
 
-	pthread_mutex_lock(&conn->lock);
-	if (!conn->wbuf.size) {
-		np_conn_new_wcall(conn, rc);
-		pthread_mutex_unlock(&conn->lock);
-		np_trans_set_txbuf(conn->trans, &conn->wbuf);
+	o = req->order;
+	if (!o)
+		return NULL;
+
+	next = NULL;
+	if (o->first == req) {
+		o->first = req->onext;
+		next = o->first;
 	} else {
-		rc->next = NULL;
-		*conn->rcallp = rc;
-		conn->rcallp = &rc->next;
-		pthread_mutex_unlock(&conn->lock);
+		// flushed while waiting for its turn
+		for(r = o->first; r->onext != req; r = r->onext)
+			;
+		r->onext = req->onext;
+		if (o->last == req)
+			o->last = r;
 	}
+
+	req->order = NULL;
+	req->onext = NULL;
+	if (!o->first) {
+		po = &conn->ordtab[o->key % Ordersize];
+		while (*po != o)
+			po = &(*po)->next;
+		*po = o->next;
+		o->next = conn->ordfree;
+		conn->ordfree = o;
+	}
+
+	return next;
 }
 
-static void
-np_conn_new_rcall(Npconn *conn)
+/*
+ * Put a request at the end of the ordering queue for its key. Returns
+ * 1 if it is first and can be queued for the workers. Called with the
+ * connection lock held.
+ */
+static int
+np_conn_order(Npconn *conn, Npreq *req)
 {
-	Npfcall *rc;
+	u32 key;
+	Npfcall *tc;
+	Nporder *o, **po;
+
+	tc = req->tcall;
+	if (!conn->ordering || tc->id == Tversion || tc->id == Tflush)
+		return 1;
+
+	if (conn->ordering == Nporderconn)
+		key = 0;
+	else if (tc->id == Twalk)
+		key = tc->newfid;	// the walk only reads fid
+	else
+		key = tc->fid;
+
+	if (key == NOFID)
+		return 1;
+
+	if (!conn->ordtab) {
+		conn->ordtab = calloc(Ordersize, sizeof(Nporder *));
+		if (!conn->ordtab)
+			return 1;
+	}
 
-	if (conn->freerclist) {
-		rc = conn->freerclist;
-		conn->freerclist = rc->next;
-		conn->freercnum--;
-	} else {
-		rc = malloc(sizeof(*rc) + conn->msize);
+	po = &conn->ordtab[key % Ordersize];
+	for(o = *po; o != NULL; o = o->next)
+		if (o->key == key)
+			break;
+
+	req->onext = NULL;
+	if (o) {
+		req->order = o;
+		o->last->onext = req;
+		o->last = req;
+		return 0;
+	}
+
+	o = conn->ordfree;
+	if (o)
+		conn->ordfree = o->next;
+	else {
+		o = malloc(sizeof(*o));
+		if (!o)
+			return 1;
 	}
 
-	rc->pkt = (u8*) rc + sizeof(*rc);
-	conn->rcall = rc;
-	np_buf_set(&conn->rbuf, rc->pkt, conn->msize);
+	o->key = key;
+	o->first = req;
+	o->last = req;
+	o->next = *po;
+	*po = o;
+	req->order = o;
+	return 1;
+}
+
+/*
+ * Find an outstanding request by tag.
+ * Called with the connection lock held.
+ */
+Npreq *
+np_conn_find_req(Npconn *conn, u16 tag)
+{
+	Npreq **tt;
+
+	tt = conn->tags[tag >> 8];
+	return tt?tt[tag & 0xFF]:NULL;
+}
+
+/*
+ * Enter the request in the tag table, the second level is allocated
+ * when it is first used. Returns 0 if the tag is already in use.
+ * Tversion uses NOTAG and can't be flushed, it is not entered.
+ * Called with the connection lock held.
+ */
+static int
+np_conn_add_tag(Npconn *conn, Npreq *req)
+{
+	Npreq **tt;
+
+	if (req->tag == NOTAG)
+		return 1;
+
+	tt = conn->tags[req->tag >> 8];
+	if (!tt) {
+		tt = calloc(256, sizeof(Npreq *));
+		if (!tt)
+			return 1;
+
+		conn->tags[req->tag >> 8] = tt;
+	}
+
+	if (tt[req->tag & 0xFF])
+		return 0;
+
+	tt[req->tag & 0xFF] = req;
+	return 1;
+}
+
+/*
+ * Add a reply to the ones waiting to be sent. Returns 1 if the caller
+ * has to start the transmission with np_trans_set_txbuf, after it
+ * releases the lock. Called with the connection lock held.
+ */
+int
+np_conn_queue_fcall(Npconn *conn, Npfcall *rc)
+{
+	if (conn->shutdown) {
+		np_fcall_free(rc);
+		return 0;
+	}
+
+	rc->next = NULL;
+	*conn->rcallp = rc;
+	conn->rcallp = &rc->next;
+	if (conn->wbuf.size)
+		return 0;
+
+	np_conn_new_wcall(conn);
+	return 1;
+}
+
+/* error reply in the dialect of the connection */
+Npfcall *
+np_conn_rerror(Npconn *conn, char *ename, int ecode)
+{
+	if (conn->dotl)
+		return np_create_rlerror(ecode ? ecode : EIO);
+
+	return np_create_rerror(ename, ecode, conn->dotu);
+}
+
+/*
+ * Print a reply for debugging. The caller holds a reference to it and
+ * not the connection lock, so the other replies don't wait for stderr.
+ */
+void
+np_conn_print_fcall(Npconn *conn, Npfcall *rc)
+{
+	fprintf(stderr, ">>> ");
+	printfcall(stderr, rc, conn->dotu);
+	fprintf(stderr, "\n");
 }
 
 void
-np_conn_free_rcall(Npconn* conn, Npfcall *rc)
+np_conn_send_fcall(Npconn *conn, Npfcall *rc)
 {
+	int kick, debug;
+
+	/* once queued, the reply is freed when it is sent */
+	debug = conn->srv->debuglevel;
+	if (debug)
+		np_fcall_incref(rc);
+
 	pthread_mutex_lock(&conn->lock);
-	if (conn->freercnum < 64) {
-		rc->next = conn->freerclist;
-		conn->freerclist = rc;
-		rc = NULL;
-	}
+	kick = np_conn_queue_fcall(conn, rc);
 	pthread_mutex_unlock(&conn->lock);
 
-	if (rc)
-		free(rc);
+	if (kick)
+		np_trans_set_txbuf(conn->trans, &conn->wbuf);
+
+	if (debug) {
+		np_conn_print_fcall(conn, rc);
+		np_fcall_free(rc);
+	}
 }
 
+/*
+ * Free the replies that were sent and gather the queued ones, up to
+ * MAXWIOV replies or MAXWBATCH bytes, so the transport can write them
+ * with a single call. A reply with its data in a file ends the batch,
+ * the transport sends the data after the headers. Called with the
+ * connection lock held.
+ */
 static void
-np_conn_new_wcall(Npconn *conn, Npfcall *wc)
+np_conn_new_wcall(Npconn *conn)
 {
-	u32 size;
-	u8* buf;
-
-	free(conn->wcall);
-	conn->wcall = wc;
-	if (wc) {
-		size = wc->size;
-		buf = wc->pkt;
-	} else {
-		size = 0;
-		buf = NULL;
+	int n;
+	u32 size, len;
+	Npfcall *wc, *wc1, *fc, **wcp;
+
+	wc = conn->wcall;
+	while (wc != NULL) {
+		wc1 = wc->next;
+		np_fcall_free(wc);
+		wc = wc1;
 	}
-	np_buf_set(&conn->wbuf, buf, size);
+
+	n = 0;
+	size = 0;
+	fc = NULL;
+	wcp = &conn->wcall;
+	while (!fc && (wc = conn->rcalls) != NULL && n < MAXWIOV) {
+		if (n && size + wc->size > MAXWBATCH)
+			break;
+
+		conn->rcalls = wc->next;
+		wc->next = NULL;
+		*wcp = wc;
+		wcp = &wc->next;
+
+		len = wc->size;
+		if (wc->fd >= 0) {
+			len -= wc->count;
+			fc = wc;
+		}
+
+		conn->wiov[n].iov_base = wc->pkt;
+		conn->wiov[n].iov_len = len;
+		size += len;
+		n++;
+	}
+	*wcp = NULL;
+
+	if (!conn->rcalls)
+		conn->rcallp = &conn->rcalls;
+
+	if (fc) {
+		np_buf_setfd(&conn->wbuf, fc->fd, size, fc->offset);
+		size += fc->count;
+	} else
+		np_buf_setfd(&conn->wbuf, -1, 0, 0);
+
+	np_buf_setv(&conn->wbuf, conn->wiov, n, size);
 }
 
 static void
@@ -348,6 +806,11 @@ np_buf_init(Npbuf *buf, void *aux, void (*changed)(void *),
 	buf->size = 0;
 	buf->pos = 0;
 	buf->buf = NULL;
+	buf->iov = NULL;
+	buf->iovcnt = 0;
+	buf->fd = -1;
+	buf->fdpos = 0;
+	buf->fdoff = 0;
 	buf->aux = aux;
 	buf->changed = changed;
 	buf->error = error;
@@ -359,6 +822,66 @@ np_buf_set(Npbuf *buf, u8 *data, u32 size)
 	buf->pos = 0;
 	buf->size = size;
 	buf->buf = data;
+	buf->iov = NULL;
+	buf->iovcnt = 0;
+	buf->fd = -1;
+}
+
+/*
+ * The transport looks at the write buffer without the connection lock,
+ * so the size is stored last: once it sees a size the rest of the
+ * buffer is valid.
+ */
+static void
+np_buf_setv(Npbuf *buf, struct iovec *iov, int iovcnt, u32 size)
+{
+	buf->pos = 0;
+	buf->buf = NULL;
+	buf->iov = iovcnt?iov:NULL;
+	buf->iovcnt = iovcnt;
+	__atomic_store_n(&buf->size, size, __ATOMIC_RELEASE);
+}
+
+/*
+ * Make the transport send the data at offset of fd after the first
+ * fdpos bytes of the buffer. Called before np_buf_setv, which
+ * includes the data in the size.
+ */
+static void
+np_buf_setfd(Npbuf *buf, int fd, u32 fdpos, u64 offset)
+{
+	buf->fd = fd;
+	buf->fdpos = fdpos;
+	buf->fdoff = offset;
+}
+
+/*
+ * Fill iov with the part of the buffer that is not transferred yet.
+ * Returns the number of entries used.
+ */
+int
+np_buf_getiov(Npbuf *buf, struct iovec *iov, int maxiov)
+{
+	int i, n;
+	u32 off;
+
+	if (!buf->iov) {
+		iov[0].iov_base = buf->buf + buf->pos;
+		iov[0].iov_len = buf->size - buf->pos;
+		return 1;
+	}
+
+	off = buf->pos;
+	for(i = 0; i < buf->iovcnt && off >= buf->iov[i].iov_len; i++)
+		off -= buf->iov[i].iov_len;
+
+	for(n = 0; i < buf->iovcnt && n < maxiov; i++, n++) {
+		iov[n].iov_base = (u8 *) buf->iov[i].iov_base + off;
+		iov[n].iov_len = buf->iov[i].iov_len - off;
+		off = 0;
+	}
+
+	return n;
 }
 
 Nptrans *
@@ -370,6 +893,7 @@ np_trans_create()
 	pthread_mutex_init(&trans->lock, NULL);
 	trans->txbuf = NULL;
 	trans->rxbuf = NULL;
+	trans->sendfile = 0;
 
 	return trans;
 }
@@ -385,7 +909,7 @@ void
 np_trans_set_txbuf(Nptrans *trans, Npbuf *buf)
 {
 	pthread_mutex_lock(&trans->lock);
-	trans->txbuf = buf;
+	__atomic_store_n(&trans->txbuf, buf, __ATOMIC_RELEASE);
 	if (trans->settxbuf)
 		(*trans->settxbuf)(trans);
 	pthread_mutex_unlock(&trans->lock);
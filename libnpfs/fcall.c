@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+typedef union Fchdr Fchdr;
+typedef struct Fcmag Fcmag;
+typedef struct Fcdepot Fcdepot;
+typedef struct Fccache Fccache;
+
+/*
+ * Message buffers come from a few size classes. Each thread keeps a
+ * magazine of free buffers per class and allocates from and frees to
+ * it without locking. When a magazine runs empty it is swapped for a
+ * full one from the class depot, when it fills up it is handed to the
+ * depot. Replies are usually built by the workers and freed by the
+ * transport thread, so the magazines go around between them and in
+ * steady state nothing is malloc'd. Buffers bigger than the largest
+ * class go straight to malloc.
+ *
+ * A message can have more than one owner, for example a backend that
+ * keeps the data of a Twrite after the request is done. Each owner
+ * calls np_fcall_free when it is done with it. The count is only
+ * touched atomically when the message is shared.
+ */
+enum {
+	Nclasses	= 4,
+	Magsize		= 32,
+};
+
+union Fchdr {
+	struct {
+		int	cls;
+		int	ref;
+	};
+	long double	align;
+};
+
+struct Fcmag {
+	int		n;
+	Fcmag*		next;
+	Fchdr*		objs[Magsize];
+};
+
+struct Fcdepot {
+	pthread_mutex_t	lock;
+	int		nfull;
+	Fcmag*		full;
+	Fcmag*		empty;
+};
+
+struct Fccache {
+	Fcmag*		mags[Nclasses];
+};
+
+static struct {
+	u32		size;
+	int		maxfull;
+} fcclass[Nclasses] = {
+	{ 128, 64 },			/* most replies */
+	{ 1024, 32 },			/* stat, walk */
+	{ 8192 + IOHDRSZ, 8 },		/* default msize */
+	{ 65536 + IOHDRSZ, 2 },		/* big msize */
+};
+
+static Fcdepot fcdepot[Nclasses];
+static pthread_key_t fccache_key;
+static pthread_once_t fccache_once = PTHREAD_ONCE_INIT;
+
+static void np_fccache_destroy(void *);
+
+static void
+np_fccache_init(void)
+{
+	int i;
+
+	for(i = 0; i < Nclasses; i++) {
+		pthread_mutex_init(&fcdepot[i].lock, NULL);
+		fcdepot[i].nfull = 0;
+		fcdepot[i].full = NULL;
+		fcdepot[i].empty = NULL;
+	}
+
+	pthread_key_create(&fccache_key, np_fccache_destroy);
+}
+
+static Fccache *
+np_fccache(void)
+{
+	Fccache *cache;
+
+	pthread_once(&fccache_once, np_fccache_init);
+	cache = pthread_getspecific(fccache_key);
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (cache)
+			pthread_setspecific(fccache_key, cache);
+	}
+
+	return cache;
+}
+
+static void
+np_fcmag_empty(Fcmag *m)
+{
+	while (m->n > 0)
+		free(m->objs[--m->n]);
+}
+
+/*
+ * Swap the (empty or missing) magazine for a full one from the depot.
+ * Returns the old magazine if the depot has none.
+ */
+static Fcmag *
+np_depot_get(Fcdepot *d, Fcmag *m)
+{
+	Fcmag *f;
+
+	pthread_mutex_lock(&d->lock);
+	f = d->full;
+	if (f) {
+		d->full = f->next;
+		d->nfull--;
+		if (m) {
+			m->next = d->empty;
+			d->empty = m;
+		}
+		m = f;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return m;
+}
+
+/*
+ * Hand the (full or missing) magazine to the depot and return an
+ * empty one. If the depot has enough, the buffers are freed instead.
+ */
+static Fcmag *
+np_depot_put(Fcdepot *d, Fcmag *m, int maxfull)
+{
+	Fcmag *e;
+
+	pthread_mutex_lock(&d->lock);
+	if (m && d->nfull < maxfull) {
+		m->next = d->full;
+		d->full = m;
+		d->nfull++;
+		m = NULL;
+	}
+
+	e = NULL;
+	if (!m) {
+		e = d->empty;
+		if (e)
+			d->empty = e->next;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (m) {
+		np_fcmag_empty(m);
+		return m;
+	}
+
+	if (!e)
+		e = calloc(1, sizeof(*e));
+
+	return e;
+}
+
+static void
+np_fccache_destroy(void *a)
+{
+	int i;
+	Fcmag *m;
+	Fccache *cache;
+
+	cache = a;
+	for(i = 0; i < Nclasses; i++) {
+		m = cache->mags[i];
+		if (!m)
+			continue;
+
+		if (m->n)
+			m = np_depot_put(&fcdepot[i], m, fcclass[i].maxfull);
+
+		free(m);
+	}
+
+	free(cache);
+}
+
+/*
+ * Allocate a message with room for size bytes of packet right after
+ * it. The result must be freed with np_fcall_free.
+ */
+Npfcall *
+np_fcall_alloc(u32 size)
+{
+	int c;
+	Fchdr *h;
+	Fcmag *m;
+	Fccache *cache;
+	Npfcall *fc;
+
+	for(c = 0; c < Nclasses; c++)
+		if (size <= fcclass[c].size)
+			break;
+
+	h = NULL;
+	if (c < Nclasses && (cache = np_fccache()) != NULL) {
+		m = cache->mags[c];
+		if (!m || !m->n)
+			m = cache->mags[c] = np_depot_get(&fcdepot[c], m);
+
+		if (m && m->n)
+			h = m->objs[--m->n];
+	}
+
+	if (!h) {
+		if (c < Nclasses)
+			size = fcclass[c].size;
+		else
+			c = -1;
+
+		h = malloc(sizeof(*h) + sizeof(*fc) + size);
+		if (!h)
+			return NULL;
+
+		h->cls = c;
+	}
+
+	h->ref = 1;
+	fc = (Npfcall *) (h + 1);
+	fc->pkt = (u8 *) fc + sizeof(*fc);
+	fc->fd = -1;
+	return fc;
+}
+
+/*
+ * Take another reference to the message, np_fcall_free drops it.
+ */
+void
+np_fcall_incref(Npfcall *fc)
+{
+	Fchdr *h;
+
+	h = (Fchdr *) fc - 1;
+	__atomic_add_fetch(&h->ref, 1, __ATOMIC_RELAXED);
+}
+
+void
+np_fcall_free(Npfcall *fc)
+{
+	int c;
+	Fchdr *h;
+	Fcmag *m;
+	Fccache *cache;
+
+	if (!fc)
+		return;
+
+	/* if the count is 1 nobody else can take a reference */
+	h = (Fchdr *) fc - 1;
+	if (__atomic_load_n(&h->ref, __ATOMIC_ACQUIRE) != 1
+	&& __atomic_sub_fetch(&h->ref, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	if (fc->fd >= 0)
+		close(fc->fd);
+
+	c = h->cls;
+	if (c < 0 || (cache = np_fccache()) == NULL) {
+		free(h);
+		return;
+	}
+
+	m = cache->mags[c];
+	if (!m || m->n == Magsize)
+		m = cache->mags[c] = np_depot_put(&fcdepot[c], m,
+			fcclass[c].maxfull);
+
+	if (!m) {
+		free(h);
+		return;
+	}
+
+	m->objs[m->n++] = h;
+}
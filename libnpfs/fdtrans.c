@@ -20,196 +20,314 @@
  * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 #include <errno.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "npfs.h"
 #include "npfsimpl.h"
 
 typedef struct Fdtrans Fdtrans;
+typedef struct Npreactor Npreactor;
+typedef struct Npfdwatch Npfdwatch;
+
+enum {
+	Maxevents	= 64,
+	Watchsize	= 64,
+};
+
+/* what an epoll event is for */
+enum {
+	Evtrans,
+	Evwait,
+};
 
 struct Fdtrans {
+	int		kind;	/* Evtrans */
 	Nptrans*	trans;
+	Npreactor*	reactor;
 	int		connected;
 	int 		fdin;
 	int		fdout;
-	struct pollfd*	pfdin;
-	struct pollfd*	pfdout;
+
+	/* readiness cached from the edge-triggered events, reactor only */
+	int		canread;
+	int		canwrite;
+
+	/* protected by the reactor lock */
+	int		queued;
+	Fdtrans*	next;	/* reactor's list of transports to service */
+	Fdtrans*	dnext;	/* reactor's list of transports to close */
 };
 
-enum {
-	TblModified	= 1,
-	Notified	= 2,
+/*
+ * The requests waiting for a backend fd. An fd is registered one-shot
+ * once, with the reactor it hashes to, whatever number of requests
+ * wait on it; the waiters are chained to its watch. When the fd is
+ * ready, the reactor takes the waiters for the events it got and
+ * arms the fd again for the rest. Whoever sets done first, under the
+ * connection lock, gets to queue a request again: the reactor when
+ * the fd is ready, or the caller of np_req_cancel_wait when the
+ * request is flushed. A watch left without waiters is removed from
+ * epoll, and freed by the reactor after it is done with the events
+ * at hand, which may still include one for it.
+ */
+struct Npfdwatch {
+	int		kind;	/* Evwait */
+	int		fd;
+	int		dead;
+	u32		armed;	/* epoll events, 0 after they fired */
+	Npfdwait*	waiters;
+	Npfdwatch*	next;	/* reactor's hash chain or list to free */
+};
+
+struct Npfdwait {
+	int		events;	/* Npwaitread, Npwaitwrite */
+	int		done;
+	Npreq*		req;
+	Npconn*		conn;
+	Npreactor*	reactor;
+	Npfdwatch*	watch;	/* NULL once the reactor took it */
+	Npfdwait*	next;	/* the watch's waiters */
 };
 
-typedef struct Nppoll Nppoll;
-struct Nppoll {
+/*
+ * Each reactor thread owns an epoll instance. Transports are assigned
+ * to the reactors round-robin when they are created and stay there
+ * until they are destroyed. The file descriptors are registered once,
+ * edge-triggered, and the reactor remembers whether the last read or
+ * write drained the descriptor, so setting a new rx or tx buffer only
+ * queues the transport for servicing instead of touching epoll.
+ */
+struct Npreactor {
 	pthread_mutex_t	lock;
-	int		shutdown;
-	int		init;
-	int		pipe[2];
+	int		epfd;
+	int		evfd;
+	int		notified;
 	pthread_t	thread;
-	int		flags;
-	int		fdnum;
-	int		fdsize;
-	Fdtrans**	trans;
-	struct pollfd*	fds;
+	Fdtrans*	ready;
+	Fdtrans*	dead;
+	Npfdwatch*	watches[Watchsize];	/* by fd */
+	Npfdwatch*	deadwatches;
 };
 
-Nppoll nppoll = {PTHREAD_MUTEX_INITIALIZER, 0 };
+struct Npreactors {
+	pthread_mutex_t	lock;
+	int		init;
+	int		nreactors;
+	int		next;
+	Npreactor*	reactors;
+} npreactors = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, NULL };
+
+#ifdef HAVE_SYS_SENDFILE_H
+static u8 zeros[4096];	/* for the data of files that got shorter */
+#endif
 
 static void np_fdtrans_destroy(Nptrans *trans);
 static void np_fdtrans_settbuf(Nptrans *trans);
 static void np_fdtrans_setrbuf(Nptrans *trans);
-static void poll_init(void);
-static int poll_add(Fdtrans *trans, int fd, int events, struct pollfd **pfd);
-static void poll_remove(Fdtrans *trans);
-static void* poll_proc(void *a);
-static void poll_notify(void);
-static void np_fdtrans_read(Fdtrans *trans);
-static void np_fdtrans_write(Fdtrans *trans);
+static int np_fdtrans_read(Fdtrans *trans);
+static int np_fdtrans_write(Fdtrans *trans);
 static void np_fdtrans_error(Nptrans *trans);
+static void np_fdtrans_service(Fdtrans *fdt);
+static Npreactor *reactor_get(void);
+static int reactor_add(Npreactor *r, Fdtrans *fdt);
+static void reactor_kick(Fdtrans *fdt);
+static void reactor_notify(Npreactor *r);
+static void *reactor_proc(void *a);
 
 Nptrans *
 np_fdtrans_create(int fdin, int fdout)
 {
 	Nptrans *npt;
 	Fdtrans *fdt;
-	int n;
 
 	fdt = malloc(sizeof(*fdt));
 	npt = np_trans_create();
+	fdt->kind = Evtrans;
 	fdt->trans = npt;
-	fdt->connected = 0;
 	fdt->fdin = fdin;
 	fdt->fdout = fdout;
 	fdt->connected = 1;
+	fdt->canread = 0;
+	fdt->canwrite = 0;
+	fdt->queued = 0;
+	fdt->next = NULL;
+	fdt->dnext = NULL;
 	npt->aux = fdt;
 	npt->destroy = np_fdtrans_destroy;
 	npt->settxbuf = np_fdtrans_settbuf;
 	npt->setrxbuf = np_fdtrans_setrbuf;
 	npt->error = np_fdtrans_error;
+#ifdef HAVE_SYS_SENDFILE_H
+	npt->sendfile = 1;
+#endif
 
 	fcntl(fdin, F_SETFL, O_NONBLOCK);
 	if (fdin != fdout)
 		fcntl(fdout, F_SETFL, O_NONBLOCK);
 
-	if (fdin != fdout) {
-		n = poll_add(fdt, fdin, 0, &fdt->pfdin);
-		n &= poll_add(fdt, fdout, 0, &fdt->pfdout);
-	} else {
-		fdt->pfdout = NULL;
-		n = poll_add(fdt, fdin, 0, &fdt->pfdin);
-		fdt->pfdout = fdt->pfdin;
-	}
-
-	fdt->connected = n;
+	fdt->reactor = reactor_get();
+	if (!fdt->reactor || !reactor_add(fdt->reactor, fdt))
+		fdt->connected = 0;
 
 	return npt;
 }
 
+/*
+ * Set the number of reactor threads used by the fd transports. It has
+ * effect only if called before the first transport is created. If it
+ * is never called, one reactor per online CPU is started.
+ */
+void
+np_fdtrans_set_nreactors(int n)
+{
+	pthread_mutex_lock(&npreactors.lock);
+	if (!npreactors.init && n > 0)
+		npreactors.nreactors = n;
+	pthread_mutex_unlock(&npreactors.lock);
+}
+
 static void
 np_fdtrans_destroy(Nptrans *trans)
 {
 	Fdtrans *fdt;
+	Npreactor *r;
 
 	fdt = trans->aux;
-	poll_remove(fdt);
+	r = fdt->reactor;
+	if (!r) {
+		free(fdt);
+		return;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	fdt->connected = 0;
+	fdt->dnext = r->dead;
+	r->dead = fdt;
+	pthread_mutex_unlock(&r->lock);
+	reactor_kick(fdt);
 }
 
 static void
 np_fdtrans_settbuf(Nptrans *trans)
 {
-	Fdtrans *fdt;
-	int n;
-
-	fdt = trans->aux;
-	if (trans->txbuf && trans->txbuf->buf) {
-		fdt->pfdout->events |= POLLOUT;
+	Npbuf *wbuf;
 
-		n = nppoll.flags & Notified;
-		nppoll.flags |= Notified;
-		if (!n)
-			poll_notify();
-	} else
-		fdt->pfdout->events = fdt->pfdout->events & ~POLLOUT;
+	wbuf = __atomic_load_n(&trans->txbuf, __ATOMIC_ACQUIRE);
+	if (wbuf && __atomic_load_n(&wbuf->size, __ATOMIC_ACQUIRE))
+		reactor_kick(trans->aux);
 }
 
 static void
 np_fdtrans_setrbuf(Nptrans *trans)
 {
-	Fdtrans *fdt;
-	int n;
-
-	fdt = trans->aux;
-	if (trans->rxbuf && trans->rxbuf->buf) {
-		fdt->pfdin->events |= POLLIN;
-		n = nppoll.flags & Notified;
-		nppoll.flags |= Notified;
-		if (!n)
-			poll_notify();
-	} else
-		fdt->pfdout->events = fdt->pfdout->events & ~POLLIN;
+	if (trans->rxbuf && trans->rxbuf->buf)
+		reactor_kick(trans->aux);
 }
 
-static void
+static int
 np_fdtrans_read(Fdtrans *fdt)
 {
 	int n;
 	Npbuf *rbuf;
 	Nptrans *trans;
 
-	if (!fdt->connected)
-		return;
-
 	trans = fdt->trans;
 	rbuf = trans->rxbuf;
+	if (!rbuf || !rbuf->buf || rbuf->pos >= rbuf->size)
+		return 0;
+
 	n = read(fdt->fdin, rbuf->buf + rbuf->pos, rbuf->size - rbuf->pos);
-	if (n <= 0) {
-		if (n != EAGAIN) {
-			trans->connected = 0;
-			(*rbuf->error)(rbuf->aux, n);
-		}
-	} else {
+	if (n > 0) {
 		rbuf->pos += n;
 		(*rbuf->changed)(rbuf->aux);
+		return 1;
 	}
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		if (errno == EAGAIN)
+			fdt->canread = 0;
+		return 0;
+	}
+
+	fdt->connected = 0;
+	trans->connected = 0;
+	(*rbuf->error)(rbuf->aux, n?errno:EPIPE);
+	return 0;
 }
 
-static void
+static int
 np_fdtrans_write(Fdtrans *fdt)
 {
 	int n;
+	u32 size;
 	Npbuf *wbuf;
 	Nptrans *trans;
-
-	if (!fdt->connected)
-		return;
-
+	struct iovec iov[MAXWIOV];
+#ifdef HAVE_SYS_SENDFILE_H
+	off_t off;
+#endif
+
+	/*
+	 * A worker only fills an empty buffer, don't look at pos before
+	 * the size says the buffer is ours.
+	 */
 	trans = fdt->trans;
-	wbuf = trans->txbuf;
-	if (!wbuf || !wbuf->size)
-		return;
-
-	n = write(fdt->fdout, wbuf->buf+wbuf->pos, wbuf->size-wbuf->pos);
-	if (n <= 0) {
-		if (n != EAGAIN) {
-			trans->connected = 0;
-			if (n)
-				n = errno;
-			else
-				n = EPIPE;
-			(*wbuf->error)(wbuf->aux, n);
-		}
-	} else {		
+	wbuf = __atomic_load_n(&trans->txbuf, __ATOMIC_ACQUIRE);
+	if (!wbuf)
+		return 0;
+
+	size = __atomic_load_n(&wbuf->size, __ATOMIC_ACQUIRE);
+	if (!size || wbuf->pos >= size)
+		return 0;
+
+#ifdef HAVE_SYS_SENDFILE_H
+	/*
+	 * The data from the file is at the end of the buffer. If the file
+	 * got shorter since the reply was made, sendfile returns 0, send
+	 * zeros for the rest of it to keep the message whole.
+	 */
+	if (wbuf->fd >= 0 && wbuf->pos >= wbuf->fdpos) {
+		off = wbuf->fdoff + (wbuf->pos - wbuf->fdpos);
+		n = sendfile(fdt->fdout, wbuf->fd, &off, wbuf->size - wbuf->pos);
+		if (n == 0)
+			n = write(fdt->fdout, zeros, wbuf->size - wbuf->pos <
+				sizeof(zeros) ? wbuf->size - wbuf->pos : sizeof(zeros));
+	} else
+#endif
+	if (wbuf->iov) {
+		n = np_buf_getiov(wbuf, iov, MAXWIOV);
+		n = writev(fdt->fdout, iov, n);
+	} else
+		n = write(fdt->fdout, wbuf->buf+wbuf->pos, wbuf->size-wbuf->pos);
+	if (n > 0) {
 		wbuf->pos += n;
 		(*wbuf->changed)(wbuf->aux);
+		return 1;
+	}
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		if (errno == EAGAIN)
+			fdt->canwrite = 0;
+		return 0;
 	}
+
+	fdt->connected = 0;
+	trans->connected = 0;
+	(*wbuf->error)(wbuf->aux, n?errno:EPIPE);
+	return 0;
 }
 
 static void
@@ -217,197 +335,555 @@ np_fdtrans_error(Nptrans *trans)
 {
 	if (trans->txbuf && trans->txbuf->error)
 		trans->txbuf->error(trans->txbuf->aux, EPIPE);
+	else if (trans->rxbuf && trans->rxbuf->error)
+		trans->rxbuf->error(trans->rxbuf->aux, EPIPE);
 }
 
+/*
+ * Read and write until the descriptors would block or the connection
+ * has no buffers to offer. The callbacks may destroy the transport,
+ * so check for it after each step.
+ */
 static void
-poll_init(void)
+np_fdtrans_service(Fdtrans *fdt)
 {
-	nppoll.shutdown = 0;
-	nppoll.fdnum = 1;
-	nppoll.fdsize = 32;
-	nppoll.trans = calloc(nppoll.fdsize, sizeof(Fdtrans *));
-	nppoll.fds = calloc(nppoll.fdsize, sizeof(struct pollfd));
-	pipe(nppoll.pipe);
-	nppoll.flags = 0;
-
-	nppoll.trans[0] = NULL;
-	nppoll.fds[0].fd = nppoll.pipe[0];
-	nppoll.fds[0].events = POLLIN | POLLOUT;
-	nppoll.fds[0].revents = 0;
-
-	pthread_create(&nppoll.thread, NULL, poll_proc, &nppoll);
-	nppoll.init = 1;
+	int progress;
+
+	do {
+		progress = 0;
+		if (fdt->canread)
+			progress |= np_fdtrans_read(fdt);
+
+		if (!fdt->connected)
+			break;
+
+		if (fdt->canwrite)
+			progress |= np_fdtrans_write(fdt);
+	} while (progress && fdt->connected);
 }
 
-static int
-poll_add(Fdtrans *trans, int fd, int events, struct pollfd **ppfd)
+static void
+reactor_init(void)
 {
-	int i, ret;
+	int i, n;
+	Npreactor *r;
+	struct epoll_event ev;
+
+	n = npreactors.nreactors;
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+
+	npreactors.reactors = calloc(n, sizeof(Npreactor));
+	for(i = 0; i < n; i++) {
+		r = &npreactors.reactors[i];
+		pthread_mutex_init(&r->lock, NULL);
+		r->notified = 0;
+		r->ready = NULL;
+		r->dead = NULL;
+		r->deadwatches = NULL;
+		r->epfd = epoll_create(Maxevents);
+		r->evfd = eventfd(0, EFD_NONBLOCK);
+		if (r->epfd < 0 || r->evfd < 0) {
+			fprintf(stderr, "cannot create reactor: %d\n", errno);
+			break;
+		}
 
-	pthread_mutex_lock(&nppoll.lock);
-	if (!nppoll.init) {
-		poll_init();
-	}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->evfd, &ev) < 0)
+			break;
 
-	for(i = nppoll.fdnum; i < nppoll.fdsize; i++)
-		if (!nppoll.trans[i])
+		if (pthread_create(&r->thread, NULL, reactor_proc, r))
 			break;
+	}
+
+	npreactors.nreactors = i;
+	npreactors.next = 0;
+	npreactors.init = 1;
+}
+
+static Npreactor *
+reactor_get(void)
+{
+	Npreactor *r;
 
-	if (i >= nppoll.fdsize)
-		ret = 0;
-	else {
-		nppoll.trans[i] = trans;
-		nppoll.fds[i].fd = fd;
-		nppoll.fds[i].events = events | POLLERR | POLLHUP;
-		*ppfd = &nppoll.fds[i];
-		ret = 1;
+	r = NULL;
+	pthread_mutex_lock(&npreactors.lock);
+	if (!npreactors.init)
+		reactor_init();
+
+	if (npreactors.nreactors > 0) {
+		r = &npreactors.reactors[npreactors.next];
+		npreactors.next = (npreactors.next + 1) % npreactors.nreactors;
 	}
+	pthread_mutex_unlock(&npreactors.lock);
 
-	i = nppoll.flags & Notified;
-	nppoll.flags = TblModified | Notified;
-	pthread_mutex_unlock(&nppoll.lock);
-	if (!i)
-		poll_notify();
+	return r;
+}
 
-	return ret;
+/* all the requests waiting for an fd go to the same reactor */
+static Npreactor *
+reactor_forfd(int fd)
+{
+	Npreactor *r;
+
+	r = NULL;
+	pthread_mutex_lock(&npreactors.lock);
+	if (!npreactors.init)
+		reactor_init();
+
+	if (npreactors.nreactors > 0)
+		r = &npreactors.reactors[fd % npreactors.nreactors];
+	pthread_mutex_unlock(&npreactors.lock);
+
+	return r;
+}
+
+static int
+reactor_add(Npreactor *r, Fdtrans *fdt)
+{
+	struct epoll_event ev;
+
+	ev.data.ptr = fdt;
+	if (fdt->fdin == fdt->fdout) {
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fdt->fdin, &ev) == 0;
+	}
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fdt->fdin, &ev) < 0)
+		return 0;
+
+	ev.events = EPOLLOUT | EPOLLET;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fdt->fdout, &ev) < 0) {
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, fdt->fdin, NULL);
+		return 0;
+	}
+
+	return 1;
 }
 
+/*
+ * Queue the transport for servicing by its reactor. The reactor thread
+ * itself drains the queue before it goes back to epoll_wait, so only
+ * the other threads need to wake it up.
+ */
 static void
-poll_remove(Fdtrans *trans)
+reactor_kick(Fdtrans *fdt)
 {
-	int i;
+	int wake;
+	Npreactor *r;
 
-	if (!nppoll.init)
+	r = fdt->reactor;
+	if (!r)
 		return;
 
-	pthread_mutex_lock(&nppoll.lock);
-	for(i = 1; i < nppoll.fdnum; i++)
-		if (nppoll.trans[i] == trans)
-			nppoll.trans[i]->connected = 0;
+	wake = 0;
+	pthread_mutex_lock(&r->lock);
+	if (!fdt->queued) {
+		fdt->queued = 1;
+		fdt->next = r->ready;
+		r->ready = fdt;
+	}
+
+	if (!r->notified && !pthread_equal(r->thread, pthread_self())) {
+		r->notified = 1;
+		wake = 1;
+	}
+	pthread_mutex_unlock(&r->lock);
 
-	i = nppoll.flags & Notified;
-	nppoll.flags = TblModified | Notified;
-	pthread_mutex_unlock(&nppoll.lock);
-	if (!i)
-		poll_notify();
+	if (wake)
+		reactor_notify(r);
 }
 
 static void
-poll_update_table(Nppoll *p)
+reactor_notify(Npreactor *r)
 {
-	int i, n;
-	struct pollfd *tfds;
-	struct Fdtrans *fdt, **tfdt;
+	u64 val;
+
+	val = 1;
+	if (write(r->evfd, &val, sizeof(val)) < 0)
+		fprintf(stderr, "cannot wake reactor: %d\n", errno);
+}
 
-	for(i = n = 1; i < p->fdsize; i++) {
-		fdt = p->trans[i];
-		if (!fdt)
-			continue;
+static void
+reactor_reap(Npreactor *r)
+{
+	Fdtrans *fdt, *fdt1, *keep;
+	Npfdwatch *wt, *wt1;
+
+	pthread_mutex_lock(&r->lock);
+	wt = r->deadwatches;
+	r->deadwatches = NULL;
+	pthread_mutex_unlock(&r->lock);
+	while (wt != NULL) {
+		wt1 = wt->next;
+		free(wt);
+		wt = wt1;
+	}
 
-		if (!fdt->connected) {
+	pthread_mutex_lock(&r->lock);
+	fdt = r->dead;
+	r->dead = NULL;
+	keep = NULL;
+	while (fdt != NULL) {
+		fdt1 = fdt->dnext;
+		if (fdt->queued) {
+			/* still on the ready list, try next time */
+			fdt->dnext = keep;
+			keep = fdt;
+		} else {
+			epoll_ctl(r->epfd, EPOLL_CTL_DEL, fdt->fdin, NULL);
 			close(fdt->fdin);
-			if (fdt->fdin != fdt->fdout)
+			if (fdt->fdin != fdt->fdout) {
+				epoll_ctl(r->epfd, EPOLL_CTL_DEL, fdt->fdout, NULL);
 				close(fdt->fdout);
-			free(fdt);
-			p->trans[i] = NULL;
-		} else {
-			if (i != n) {
-				p->trans[n] = p->trans[i];
-				p->fds[n] = p->fds[i];
-				if (p->fds[n].fd == p->trans[n]->fdin)
-					p->trans[n]->pfdin = &p->fds[n];
-				if (p->fds[n].fd == p->trans[n]->fdout)
-					p->trans[n]->pfdout = &p->fds[n];
-
-				p->trans[i] = NULL;
 			}
+			free(fdt);
+		}
+		fdt = fdt1;
+	}
+	r->dead = keep;
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* the epoll events for what the waiters wait for */
+static u32
+watch_events(Npfdwatch *wt)
+{
+	u32 events;
+	Npfdwait *w;
+
+	events = 0;
+	for(w = wt->waiters; w != NULL; w = w->next) {
+		if (w->events & Npwaitread)
+			events |= EPOLLIN | EPOLLRDHUP;
+		if (w->events & Npwaitwrite)
+			events |= EPOLLOUT;
+	}
+
+	return events;
+}
+
+/*
+ * Arm the fd for all its waiters, or remove it from epoll if there
+ * are none left. Called with the reactor lock held.
+ */
+static int
+watch_arm(Npreactor *r, Npfdwatch *wt)
+{
+	int ret;
+	u32 events;
+	Npfdwatch **pwt;
+	struct epoll_event ev;
+
+	events = watch_events(wt);
+	if (!events) {
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, wt->fd, NULL);
+
+		for(pwt = &r->watches[wt->fd % Watchsize]; *pwt != wt; )
+			pwt = &(*pwt)->next;
+		*pwt = wt->next;
+		wt->dead = 1;
+		wt->next = r->deadwatches;
+		r->deadwatches = wt;
+		return 0;
+	}
+
+	if ((wt->armed & events) == events)
+		return 0;
+
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = wt;
+	ret = epoll_ctl(r->epfd, EPOLL_CTL_MOD, wt->fd, &ev);
+	if (ret < 0 && errno == ENOENT)
+		/* new, or closed and removed by the kernel since */
+		ret = epoll_ctl(r->epfd, EPOLL_CTL_ADD, wt->fd, &ev);
+
+	if (ret == 0)
+		wt->armed = events;
+
+	return ret;
+}
+
+/* unlink a waiter from its watch, called with the reactor lock held */
+static void
+watch_remove(Npfdwait *w)
+{
+	Npfdwait **pw;
+
+	for(pw = &w->watch->waiters; *pw != w; )
+		pw = &(*pw)->next;
+	*pw = w->next;
+	w->watch = NULL;
+}
 
-			n++;
+/*
+ * The fd some requests wait for is ready, queue the ones waiting for
+ * the events that came unless they were cancelled, and arm the fd
+ * again for the others.
+ */
+static void
+reactor_wakeup(Npreactor *r, Npfdwatch *wt, u32 events)
+{
+	Npreq *req;
+	Npfdwait *w, *w1, *ready;
+
+	ready = NULL;
+	pthread_mutex_lock(&r->lock);
+	if (wt->dead) {
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+
+	wt->armed = 0;
+	for(w = wt->waiters; w != NULL; w = w1) {
+		w1 = w->next;
+		if (events & (EPOLLERR | EPOLLHUP)
+		|| (w->events & Npwaitread && events & (EPOLLIN | EPOLLRDHUP))
+		|| (w->events & Npwaitwrite && events & EPOLLOUT)) {
+			watch_remove(w);
+			w->next = ready;
+			ready = w;
 		}
 	}
 
-	p->fdnum = n;
-	if (p->fdsize-p->fdnum < 32) {
-		tfds = realloc(p->fds, sizeof(struct pollfd) * (p->fdsize+32));
-		tfdt = realloc(p->trans, sizeof(Fdtrans *) * (p->fdsize+32));
-		if (tfds && tfdt) {
-			for(i = 0; i < 32; i++)
-				tfdt[p->fdsize + i] = NULL;
-			p->fdsize += 32;
-			p->fds = tfds;
-			p->trans = tfdt;
-
-			for(i = 1; i < p->fdnum; i++) {
-				if (p->fds[i].fd == p->trans[i]->fdin)
-					p->trans[i]->pfdin = &p->fds[i];
-				if (p->fds[i].fd == p->trans[i]->fdout)
-					p->trans[i]->pfdout = &p->fds[i];
-			}
+	if (watch_arm(r, wt) < 0) {
+		/* can't wait any longer, let the handlers try */
+		while ((w = wt->waiters) != NULL) {
+			watch_remove(w);
+			w->next = ready;
+			ready = w;
 		}
+		watch_arm(r, wt);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	for(w = ready; w != NULL; w = w1) {
+		w1 = w->next;
+		req = NULL;
+		pthread_mutex_lock(&w->conn->lock);
+		if (!w->done) {
+			w->done = 1;
+			req = w->req;
+			req->wait = NULL;
+		}
+		pthread_mutex_unlock(&w->conn->lock);
+
+		free(w);
+		if (req)
+			np_req_requeue(req);
 	}
 }
 
 static void*
-poll_proc(void *a)
+reactor_proc(void *a)
 {
-	int i, n, shutdown;
-	Nppoll *p;
-	struct pollfd *pfd;
-	struct Fdtrans *fdt;
-	char buf[10];
-
-	p = a;
-	shutdown = 0;
-	while (!shutdown) {
-		n = poll(p->fds, p->fdnum, 10000);
-		if (p->fds[0].revents & POLLIN)
-			n--;
-
-		for(i = 1; i<p->fdnum && n; i++) {
-			fdt = p->trans[i];
-			pfd = &p->fds[i];
-			if (pfd->revents)
-				n--;
-
-			if (!fdt)
-				continue;
+	int i, n;
+	u64 val;
+	Npreactor *r;
+	Fdtrans *fdt, *fdt1;
+	struct epoll_event events[Maxevents];
+
+	r = a;
+	while (1) {
+		n = epoll_wait(r->epfd, events, Maxevents, -1);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait: %d\n", errno);
+			break;
+		}
 
-			if (pfd->revents & (POLLERR|POLLHUP|POLLNVAL)) {
-				fdt->connected = 0;
-				if (fdt->trans->error)
-					(*fdt->trans->error)(fdt->trans);
-				pfd->events = 0;
+		for(i = 0; i < n; i++) {
+			fdt = events[i].data.ptr;
+			if (fdt && *(int *) fdt == Evwait) {
+				reactor_wakeup(r, events[i].data.ptr,
+					events[i].events);
 				continue;
 			}
 
-			if (pfd->revents & POLLIN) {
-				np_fdtrans_read(fdt);
+			/*
+			 * Drain the eventfd before clearing notified, or a
+			 * kick in between is read here and every later one
+			 * skips the wakeup. A kick that still finds notified
+			 * set has its transport on the ready list, which is
+			 * serviced below.
+			 */
+			if (!fdt) {
+				if (read(r->evfd, &val, sizeof(val)) < 0)
+					;
+				pthread_mutex_lock(&r->lock);
+				r->notified = 0;
+				pthread_mutex_unlock(&r->lock);
+				continue;
 			}
 
-			if (pfd->revents & POLLOUT) {
-				np_fdtrans_write(fdt);
+			if (!fdt->connected)
+				continue;
+
+			if (events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP))
+				fdt->canread = 1;
+			if (events[i].events & EPOLLOUT)
+				fdt->canwrite = 1;
+
+			np_fdtrans_service(fdt);
+			if (fdt->connected && events[i].events & EPOLLERR) {
+				fdt->connected = 0;
+				np_fdtrans_error(fdt->trans);
 			}
 		}
 
-		if (p->fds[0].revents & POLLIN) {
-			pthread_mutex_lock(&p->lock);
-			shutdown = p->shutdown;
-			n = read(p->pipe[0], buf, sizeof(buf));
-			if (p->flags&TblModified)
-				poll_update_table(p);
-			p->flags = 0;
-			pthread_mutex_unlock(&p->lock);
+		/* service the transports that got new buffers */
+		pthread_mutex_lock(&r->lock);
+		while ((fdt = r->ready) != NULL) {
+			r->ready = NULL;
+			while (fdt != NULL) {
+				fdt1 = fdt->next;
+				fdt->queued = 0;
+				pthread_mutex_unlock(&r->lock);
+				if (fdt->connected)
+					np_fdtrans_service(fdt);
+				pthread_mutex_lock(&r->lock);
+				fdt = fdt1;
+			}
 		}
+		pthread_mutex_unlock(&r->lock);
+
+		if (r->dead || r->deadwatches)
+			reactor_reap(r);
 	}
 
 	return NULL;
 }
 
-static void
-poll_notify(void)
+/*
+ * Park a request until fd is ready for the events (Npwaitread,
+ * Npwaitwrite), then call fn(req, aux) in a worker thread. fn returns
+ * the reply, or NULL with an error set, or NULL after waiting again
+ * or responding later with np_respond. If the request is flushed or
+ * the connection is reset while waiting, fn is called right away with
+ * req->cancelled set. A handler that parks its request returns NULL
+ * without an error. Any number of requests can wait for the same fd.
+ * Returns -1 if the fd cannot be waited on.
+ */
+int
+np_req_wait_fd(Npreq *req, int fd, int events,
+	Npfcall *(*fn)(Npreq *, void *), void *aux)
 {
-	int n;
-	char *buf = "";
+	int ret, cancelled;
+	Npconn *conn;
+	Npfdwait *w;
+	Npfdwatch *wt;
+	Npreactor *r;
+
+	r = reactor_forfd(fd);
+	if (!r) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -1;
+
+	conn = req->conn;
+	w->events = events;
+	w->done = 0;
+	w->req = req;
+	w->conn = conn;
+	w->reactor = r;
+	w->watch = NULL;
+	w->next = NULL;
+
+	ret = 0;
+	cancelled = 0;
+	pthread_mutex_lock(&conn->lock);
+	req->resume = fn;
+	req->resumeaux = aux;
+	if (req->cancelled || req->flushreq) {
+		/* flushed while the handler was working */
+		req->cancelled = 1;
+		cancelled = 1;
+	} else {
+		pthread_mutex_lock(&r->lock);
+		for(wt = r->watches[fd % Watchsize]; wt != NULL; wt = wt->next)
+			if (wt->fd == fd)
+				break;
+
+		if (!wt) {
+			wt = malloc(sizeof(*wt));
+			if (wt) {
+				wt->kind = Evwait;
+				wt->fd = fd;
+				wt->dead = 0;
+				wt->armed = 0;
+				wt->waiters = NULL;
+				wt->next = r->watches[fd % Watchsize];
+				r->watches[fd % Watchsize] = wt;
+			}
+		}
+
+		ret = -1;
+		if (wt) {
+			w->watch = wt;
+			w->next = wt->waiters;
+			wt->waiters = w;
+			ret = watch_arm(r, wt);
+			if (ret < 0) {
+				watch_remove(w);
+				watch_arm(r, wt);
+			}
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		if (ret == 0)
+			req->wait = w;
+		else
+			req->resume = NULL;
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	if (ret < 0 || cancelled)
+		free(w);
+
+	if (cancelled)
+		np_req_requeue(req);
+
+	return ret;
+}
+
+/*
+ * Stop waiting for the fd of a flushed request. Called with the
+ * connection lock held. Returns the request if it was waiting, the
+ * caller queues it with np_req_requeue after dropping the lock, so
+ * the backend can finish it.
+ */
+Npreq *
+np_req_cancel_wait(Npreq *req)
+{
+	Npfdwait *w;
+	Npfdwatch *wt;
+	Npreactor *r;
+
+	w = req->wait;
+	if (!w)
+		return NULL;
+
+	w->done = 1;
+	req->wait = NULL;
+	req->cancelled = 1;
+	r = w->reactor;
+
+	/* if the reactor took it already, it frees it */
+	pthread_mutex_lock(&r->lock);
+	wt = w->watch;
+	if (wt) {
+		watch_remove(w);
+		watch_arm(r, wt);
+		free(w);
+	}
+	pthread_mutex_unlock(&r->lock);
 
-	n = write(nppoll.pipe[1], buf, 1);
+	return req;
 }
@@ -27,100 +27,286 @@
 #include "npfs.h"
 #include "npfsimpl.h"
 
-Npfid**
+typedef struct Npfidtab Npfidtab;
+
+/*
+ * The fids of a connection are kept in an open-addressing hash table
+ * with linear probing. Lookups don't lock: they load the current
+ * table and probe it. Creating and destroying fids is serialized by
+ * the pool lock. When the table grows, a new one is published and the
+ * old one is kept until the pool goes away, because readers may still
+ * be probing it. The tables double in size, so the retired ones take
+ * no more memory than the current one.
+ *
+ * Destroyed fids are not freed, but kept on a free list and reused by
+ * the pool, so a reader can always look at a fid it found in a table.
+ * It makes sure the fid is still there after it compared the number.
+ */
+struct Npfidtab {
+	u32		mask;
+	Npfidtab*	prev;		/* retired tables */
+	Npfid*		fids[];
+};
+
+struct Npfidpool {
+	pthread_mutex_t	lock;
+	Npfidtab*	tab;
+	u32		nfids;
+	u32		ntombs;
+	Npfid*		freefids;
+	Npfidtab*	retired;
+};
+
+enum {
+	Fidtabsize	= 64,
+};
+
+static Npfid fidtomb;		/* marks a removed entry */
+#define Tomb (&fidtomb)
+
+static u32
+fidhash(u32 fid)
+{
+	fid ^= fid >> 16;
+	fid *= 0x85ebca6b;
+	fid ^= fid >> 13;
+	fid *= 0xc2b2ae35;
+	fid ^= fid >> 16;
+	return fid;
+}
+
+static Npfidtab *
+np_fidtab_create(u32 size)
+{
+	Npfidtab *tab;
+
+	tab = calloc(1, sizeof(*tab) + size*sizeof(Npfid *));
+	if (!tab)
+		return NULL;
+
+	tab->mask = size - 1;
+	tab->prev = NULL;
+	return tab;
+}
+
+Npfidpool *
 np_fidpool_create(void)
 {
-	Npfid **ret;
+	Npfidpool *pool;
 
-	return calloc(FID_HTABLE_SIZE, sizeof(*ret));
+	pool = malloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->tab = np_fidtab_create(Fidtabsize);
+	pool->nfids = 0;
+	pool->ntombs = 0;
+	pool->freefids = NULL;
+	pool->retired = NULL;
+	if (!pool->tab) {
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
 }
 
 Npfid*
 np_fid_find(Npconn *conn, u32 fid)
 {
-	int hash;
-	Npfid **htable, *f, **prevp;
-
-	hash = fid % FID_HTABLE_SIZE;
-	htable = conn->fidpool;
-	pthread_mutex_lock(&conn->lock);
-	prevp = &htable[hash];
-	f = *prevp;
-	while (f != NULL) {
-		if (f->fid == fid) {
-			*prevp = f->next;
-			f->next = htable[hash];
-			htable[hash] = f;
+	u32 i, n;
+	Npfid *f;
+	Npfidtab *tab;
+	Npfidpool *pool;
+
+	pool = conn->fidpool;
+again:
+	tab = __atomic_load_n(&pool->tab, __ATOMIC_ACQUIRE);
+	i = fidhash(fid) & tab->mask;
+	for(n = 0; n <= tab->mask; n++, i = (i + 1) & tab->mask) {
+		f = __atomic_load_n(&tab->fids[i], __ATOMIC_ACQUIRE);
+		if (!f)
 			break;
-		}
 
-		prevp = &f->next;
-		f = *prevp;
+		if (f == Tomb || __atomic_load_n(&f->fid, __ATOMIC_RELAXED) != fid)
+			continue;
+
+		/* it may have been destroyed and reused meanwhile */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&tab->fids[i], __ATOMIC_RELAXED) != f
+		|| __atomic_load_n(&pool->tab, __ATOMIC_RELAXED) != tab)
+			goto again;
+
+		return f;
 	}
-	pthread_mutex_unlock(&conn->lock);
-	return f;
+
+	return NULL;
+}
+
+/*
+ * Move the live fids to a new table that is at most a quarter full.
+ * Called with the pool lock held.
+ */
+static int
+np_fidpool_grow(Npfidpool *pool)
+{
+	u32 i, j, size;
+	Npfid *f;
+	Npfidtab *tab, *otab;
+
+	otab = pool->tab;
+	size = Fidtabsize;
+	while (size < (pool->nfids + 1) * 4)
+		size *= 2;
+
+	tab = np_fidtab_create(size);
+	if (!tab)
+		return 0;
+
+	for(i = 0; i <= otab->mask; i++) {
+		f = otab->fids[i];
+		if (!f || f == Tomb)
+			continue;
+
+		j = fidhash(f->fid) & tab->mask;
+		while (tab->fids[j])
+			j = (j + 1) & tab->mask;
+		tab->fids[j] = f;
+		f->slot = j;
+	}
+
+	__atomic_store_n(&pool->tab, tab, __ATOMIC_RELEASE);
+	otab->prev = pool->retired;
+	pool->retired = otab;
+	pool->ntombs = 0;
+	return 1;
 }
 
 Npfid*
 np_fid_create(Npconn *conn, u32 fid, void *aux)
 {
-	int hash;
-	Npfid **htable, *f;
+	u32 i, n, slot;
+	Npfid *f;
+	Npfidtab *tab;
+	Npfidpool *pool;
 
-	hash = fid % FID_HTABLE_SIZE;
-	htable = conn->fidpool;
-	f = np_fid_find(conn, fid);
-	if (f)
-		return NULL;
+	pool = conn->fidpool;
+	pthread_mutex_lock(&pool->lock);
+	if ((pool->nfids + pool->ntombs + 1) * 2 > pool->tab->mask + 1
+	&& !np_fidpool_grow(pool))
+		goto error;
 
-	f = malloc(sizeof(*f));
-	if (!f)
-		return NULL;
+	/* look for the fid, remember the first free slot */
+	tab = pool->tab;
+	slot = ~0;
+	i = fidhash(fid) & tab->mask;
+	for(n = 0; n <= tab->mask; n++, i = (i + 1) & tab->mask) {
+		f = tab->fids[i];
+		if (!f) {
+			if (slot == ~0)
+				slot = i;
+			break;
+		}
+
+		if (f == Tomb) {
+			if (slot == ~0)
+				slot = i;
+		} else if (f->fid == fid)
+			goto error;
+	}
+
+	f = pool->freefids;
+	if (f)
+		pool->freefids = f->next;
+	else {
+		f = malloc(sizeof(*f));
+		if (!f)
+			goto error;
+	}
 
-	f->fid = fid;
+	/* a reader holding a stale pointer may still look at these two */
+	__atomic_store_n(&f->fid, fid, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->refcount, 0, __ATOMIC_RELAXED);
 	f->conn = conn;
-	f->refcount = 0;
+	f->clunked = 0;
 	f->omode = ~0;
 	f->type = 0;
-	f->diroffset = 0;
 	f->user = NULL;
 	f->aux = aux;
+	f->next = NULL;
+	f->slot = slot;
 
-	pthread_mutex_lock(&conn->lock);
-	f->next = htable[hash];
-	htable[hash] = f;
-	pthread_mutex_unlock(&conn->lock);
+	if (tab->fids[slot] == Tomb)
+		pool->ntombs--;
+	pool->nfids++;
+	__atomic_store_n(&tab->fids[slot], f, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pool->lock);
 
 	return f;
+
+error:
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
 }
 
+/*
+ * Look up a fid and take a reference to it. Fails if the fid is
+ * not there, or if its last reference is being dropped.
+ */
+Npfid*
+np_fid_get(Npconn *conn, u32 fid)
+{
+	int ref;
+	Npfid *f;
+
+	while ((f = np_fid_find(conn, fid)) != NULL) {
+		ref = __atomic_load_n(&f->refcount, __ATOMIC_RELAXED);
+		do {
+			if (ref <= 0)
+				return NULL;
+		} while (!__atomic_compare_exchange_n(&f->refcount, &ref,
+			ref + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+		/* destroyed and reused for another fid meanwhile */
+		if (__atomic_load_n(&f->fid, __ATOMIC_RELAXED) == fid)
+			return f;
+
+		np_fid_decref(f);
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove the fid from the table. The fid remembers its slot, the
+ * table doesn't have to be searched.
+ */
 int
 np_fid_destroy(Npfid *fid)
 {
-	int hash;
-	Npconn *conn;
-	Npfid **htable, *f, **prevp;
-
-	conn = fid->conn;
-	hash = fid->fid % FID_HTABLE_SIZE;
-	htable = conn->fidpool;
-	pthread_mutex_lock(&conn->lock);
-	prevp = &htable[hash];
-	f = *prevp;
-	while (f != NULL) {
-		if (f->fid == fid->fid) {
-			*prevp = f->next;
-			if (f->conn->srv->fiddestroy)
-				(*f->conn->srv->fiddestroy)(f);
-			free(f);
-			break;
-		}
+	int ret;
+	Npfidtab *tab;
+	Npfidpool *pool;
+
+	ret = 0;
+	pool = fid->conn->fidpool;
+	pthread_mutex_lock(&pool->lock);
+	tab = pool->tab;
+	if (tab->fids[fid->slot] == fid) {
+		__atomic_store_n(&tab->fids[fid->slot], Tomb, __ATOMIC_RELEASE);
+		pool->nfids--;
+		pool->ntombs++;
+		if (fid->conn->srv->fiddestroy)
+			(*fid->conn->srv->fiddestroy)(fid);
 
-		prevp = &f->next;
-		f = *prevp;
+		fid->next = pool->freefids;
+		pool->freefids = fid;
+		ret = 1;
 	}
-	pthread_mutex_unlock(&conn->lock);
-	return f != NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
 }
 
 void
@@ -129,7 +315,7 @@ np_fid_incref(Npfid *fid)
 	if (!fid)
 		return;
 
-	fid->refcount++;
+	__atomic_add_fetch(&fid->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -138,8 +324,70 @@ np_fid_decref(Npfid *fid)
 	if (!fid)
 		return;
 
-	fid->refcount--;
-
-	if (!fid->refcount)
+	if (__atomic_sub_fetch(&fid->refcount, 1, __ATOMIC_ACQ_REL) == 0)
 		np_fid_destroy(fid);
 }
+
+int
+np_dirpos_find(Npdirpos *dp, u64 offset, u64 *cookie)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = dp->n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dp->offset[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo==dp->n || dp->offset[lo]!=offset)
+		return 0;
+
+	*cookie = dp->cookie[lo];
+	return 1;
+}
+
+/* returns 0 if the offset is already known, the caller keeps the cookie */
+int
+np_dirpos_add(Npdirpos *dp, u64 offset, u64 cookie)
+{
+	int size;
+	u64 *o, *c;
+
+	if (offset==0 || (dp->n>0 && offset<=dp->offset[dp->n - 1]))
+		return 0;
+
+	if (dp->n == dp->size) {
+		size = dp->size?dp->size*2:8;
+		o = realloc(dp->offset, size * sizeof(u64));
+		if (!o)
+			return 0;
+
+		dp->offset = o;
+		c = realloc(dp->cookie, size * sizeof(u64));
+		if (!c)
+			return 0;
+
+		dp->cookie = c;
+		dp->size = size;
+	}
+
+	dp->offset[dp->n] = offset;
+	dp->cookie[dp->n] = cookie;
+	dp->n++;
+	return 1;
+}
+
+void
+np_dirpos_free(Npdirpos *dp)
+{
+	free(dp->offset);
+	free(dp->cookie);
+	dp->offset = NULL;
+	dp->cookie = NULL;
+	dp->n = 0;
+	dp->size = 0;
+}
@@ -23,14 +23,32 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include "npfs.h"
 #include "npfsimpl.h"
 
-static void npfile_incref_nolock(Npfile *f);
+static Npfcall *npfile_readfd(Npfid *fid, u64 offset, u32 count, Npreq *req);
+
+enum {
+	Sendfilemin	= 8192,	/* smaller reads are copied into the reply */
+	Indexsize	= 64,	/* initial buckets of a directory index */
+};
+
+/*
+ * Children of a directory by name. The index doesn't hold references,
+ * the children are found through it only while they are linked in the
+ * directory. It is changed with the directory locked.
+ */
+struct Npfileidx {
+	u32		mask;
+	u32		count;
+	Npfile*		buckets[];
+};
 
 Npfile*
 npfile_alloc(Npfile *parent, char *name, u32 mode, u64 qpath,
@@ -39,7 +57,7 @@ npfile_alloc(Npfile *parent, char *name, u32 mode, u64 qpath,
 	Npfile *f;
 
 	f = malloc(sizeof(*f));
-	pthread_mutex_init(&f->lock, NULL);
+	pthread_rwlock_init(&f->lock, NULL);
 	f->refcount = 0;
 	f->parent = parent;
 	f->qid.type = mode>>24;
@@ -54,16 +72,19 @@ npfile_alloc(Npfile *parent, char *name, u32 mode, u64 qpath,
 	f->gid = NULL;
 	f->muid = NULL;
 	f->excl = 0;
+	f->removed = 0;
 	f->extension = NULL;
 	f->ops = ops;
 	f->aux = aux;
+	f->index = NULL;
+	f->inext = NULL;
 	f->next = NULL;
 	f->prev = NULL;
 	f->dirfirst = NULL;
 	f->dirlast = NULL;
 
 	if (parent) {
-		npfile_incref_nolock(parent);
+		npfile_incref(parent);
 		f->atime = parent->atime;
 		f->mtime = parent->mtime;
 		f->uid = parent->uid;
@@ -74,26 +95,24 @@ npfile_alloc(Npfile *parent, char *name, u32 mode, u64 qpath,
 	return f;
 }
 
-static void
-npfile_incref_nolock(Npfile *f)
-{
-	assert(f->refcount >= 0);
-	f->refcount++;
-}
-
+/*
+ * The references are counted without the lock, a file is found only
+ * through a directory or a fid that hold a reference to it.
+ */
 void
 npfile_incref(Npfile *f)
 {
+	int n;
+
 	if (!f)
 		return;
 
-	pthread_mutex_lock(&f->lock);
-	npfile_incref_nolock(f);
-	pthread_mutex_unlock(&f->lock);
+	n = __atomic_fetch_add(&f->refcount, 1, __ATOMIC_RELAXED);
+	assert(n >= 0);
 }
 
-static int
-npfile_decrefimpl(Npfile *f, int lock)
+int
+npfile_decref(Npfile *f)
 {
 	int ret;
 	Npfileops *fops;
@@ -102,11 +121,8 @@ npfile_decrefimpl(Npfile *f, int lock)
 	if (!f)
 		return 0;
 
-	if (lock)
-		pthread_mutex_lock(&f->lock);
-
-	assert(f->refcount > 0);
-	ret = --f->refcount;
+	ret = __atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL);
+	assert(ret >= 0);
 	if (!ret) {
 		if (f->ops) {
 			if (f->mode & Dmdir) {
@@ -120,58 +136,192 @@ npfile_decrefimpl(Npfile *f, int lock)
 			}
 		}
 
-		pthread_mutex_unlock(&f->lock);
-		pthread_mutex_destroy(&f->lock);
+		pthread_rwlock_destroy(&f->lock);
+		free(f->index);
 		free(f->name);
 		free(f->extension);
 		free(f);
-	} else
-		pthread_mutex_unlock(&f->lock);
+	}
 
 	return ret;
 }
 
+static u32
+npfile_namehash(char *name, int len)
+{
+	u32 h;
+
+	for(h = 2166136261u; len > 0; name++, len--)
+		h = (h ^ (u8) *name) * 16777619;
+
+	return h;
+}
+
+/* the name doesn't have to be terminated, Npstr names aren't */
 static int
-npfile_decref_unlock(Npfile *f)
+npfile_isname(Npfile *f, char *name, int len)
 {
-	return npfile_decrefimpl(f, 0);
+	return strncmp(f->name, name, len) == 0 && f->name[len] == '\0';
 }
 
+static Npfileidx *
+npfile_index_alloc(u32 size)
+{
+	Npfileidx *idx;
+
+	idx = calloc(1, sizeof(*idx) + size * sizeof(Npfile *));
+	if (!idx)
+		return NULL;
+
+	idx->mask = size - 1;
+	return idx;
+}
+
+/* the index grows when it has as many children as buckets */
+static void
+npfile_index_add(Npfile *dir, Npfile *f)
+{
+	u32 i, j;
+	Npfile *cf, *cf1;
+	Npfileidx *idx, *nidx;
+
+	idx = dir->index;
+	if (idx->count > idx->mask) {
+		nidx = npfile_index_alloc(2 * (idx->mask + 1));
+		if (nidx) {
+			for(i = 0; i <= idx->mask; i++) {
+				for(cf = idx->buckets[i]; cf != NULL; cf = cf1) {
+					cf1 = cf->inext;
+					j = npfile_namehash(cf->name,
+						strlen(cf->name)) & nidx->mask;
+					cf->inext = nidx->buckets[j];
+					nidx->buckets[j] = cf;
+				}
+			}
+
+			nidx->count = idx->count;
+			free(idx);
+			dir->index = idx = nidx;
+		}
+	}
+
+	i = npfile_namehash(f->name, strlen(f->name)) & idx->mask;
+	f->inext = idx->buckets[i];
+	idx->buckets[i] = f;
+	idx->count++;
+}
+
+static void
+npfile_index_remove(Npfile *dir, Npfile *f)
+{
+	u32 i;
+	Npfile **fp;
+	Npfileidx *idx;
+
+	idx = dir->index;
+	i = npfile_namehash(f->name, strlen(f->name)) & idx->mask;
+	fp = &idx->buckets[i];
+	for(; *fp != NULL; fp = &(*fp)->inext) {
+		if (*fp == f) {
+			*fp = f->inext;
+			f->inext = NULL;
+			idx->count--;
+			break;
+		}
+	}
+}
+
+/*
+ * Index the children of dir by name, so npfile_find doesn't have to
+ * go through all of them. The children created, removed and renamed
+ * through the server are kept in the index. A backend that links or
+ * unlinks children on its own has to call it again after the change.
+ * Returns 0 on error.
+ */
 int
-npfile_decref(Npfile *f)
+npfile_index(Npfile *dir)
 {
-	return npfile_decrefimpl(f, 1);
+	Npfile *f, *f1;
+	Npdirops *dops;
+	Npfileidx *idx;
+
+	pthread_rwlock_wrlock(&dir->lock);
+	dops = dir->ops;
+	if (!(dir->mode & Dmdir) || !dops->first || !dops->next) {
+		np_werror(Eperm, EPERM);
+		pthread_rwlock_unlock(&dir->lock);
+		return 0;
+	}
+
+	idx = npfile_index_alloc(Indexsize);
+	if (!idx) {
+		np_werror(Enomem, ENOMEM);
+		pthread_rwlock_unlock(&dir->lock);
+		return 0;
+	}
+
+	free(dir->index);
+	dir->index = idx;
+	for(f = (*dops->first)(dir); f != NULL; f = f1) {
+		npfile_index_add(dir, f);
+		f1 = (*dops->next)(dir, f);
+		npfile_decref(f);
+	}
+	pthread_rwlock_unlock(&dir->lock);
+
+	return 1;
 }
 
-Npfile *
-npfile_find(Npfile *dir, char *name)
+/* returns the child with a reference, or NULL */
+static Npfile *
+npfile_lookup(Npfile *dir, char *name, int len)
 {
+	u32 i;
 	Npfile *f;
 	Npdirops *dops;
 
-	if (strcmp(name, "..") == 0)
+	if (len == 2 && name[0] == '.' && name[1] == '.') {
+		npfile_incref(dir->parent);
 		return dir->parent;
+	}
+
+	pthread_rwlock_rdlock(&dir->lock);
+	if (dir->index) {
+		i = npfile_namehash(name, len) & dir->index->mask;
+		f = dir->index->buckets[i];
+		while (f != NULL && !npfile_isname(f, name, len))
+			f = f->inext;
+
+		npfile_incref(f);
+		pthread_rwlock_unlock(&dir->lock);
+		return f;
+	}
 
-	pthread_mutex_lock(&dir->lock);
 	dops = dir->ops;
 	if (!dops->first || !dops->next) {
 		np_werror(Eperm, EPERM);
-		pthread_mutex_unlock(&dir->lock);
+		pthread_rwlock_unlock(&dir->lock);
 		return NULL;
 	}
 
 	for(f = (*dops->first)(dir); f != NULL; 
 		f = (*dops->next)(dir, f)) {
 
-		if (strcmp(name, f->name) == 0)
+		if (npfile_isname(f, name, len))
 			break;
 		npfile_decref(f);
 	}
-	pthread_mutex_unlock(&dir->lock);
+	pthread_rwlock_unlock(&dir->lock);
 
 	return f;
 }
 
+Npfile *
+npfile_find(Npfile *dir, char *name)
+{
+	return npfile_lookup(dir, name, strlen(name));
+}
+
 static int
 check_perm(u32 fperm, Npuser *fuid, Npgroup *fgid, Npuser *user, u32 perm)
 {
@@ -214,7 +364,7 @@ file2wstat(Npfile *file, Npwstat *wstat)
 	wstat->dev = 0;
 	wstat->qid = file->qid;
 	wstat->mode = file->mode;
-	wstat->atime = file->atime;
+	wstat->atime = __atomic_load_n(&file->atime, __ATOMIC_RELAXED);
 	wstat->mtime = file->mtime;
 	wstat->length = file->length;
 	wstat->name = file->name;
@@ -262,10 +412,25 @@ npfile_modified(Npfile *f, Npuser *u)
 	// you better have the file locked ...
 	f->muid = u;
 	f->mtime = time(NULL);
-	f->atime = f->mtime;
+	__atomic_store_n(&f->atime, f->mtime, __ATOMIC_RELAXED);
 	f->qid.version++;
 }
 
+/*
+ * The access time is only a hint, it is set without the lock and only
+ * when it changes, so the readers of a file don't write to it all the
+ * time.
+ */
+static void
+npfile_accessed(Npfile *f)
+{
+	u32 now;
+
+	now = time(NULL);
+	if (__atomic_load_n(&f->atime, __ATOMIC_RELAXED) != now)
+		__atomic_store_n(&f->atime, now, __ATOMIC_RELAXED);
+}
+
 static Npfilefid*
 npfile_fidalloc(Npfile *file) {
 	Npfilefid *f;
@@ -273,16 +438,52 @@ npfile_fidalloc(Npfile *file) {
 	f = malloc(sizeof(*f));
 	pthread_mutex_init(&f->lock, NULL);
 	f->omode = ~0;
-	/* aux, diroffset and dirent can be non-zero only for open fids */
+	/* aux and dirpos can be non-zero only for open fids */
 	f->aux = 0;
-	f->diroffset = 0;
-	f->dirent = NULL;
+	memset(&f->dirpos, 0, sizeof(f->dirpos));
 	f->file = file;
 	npfile_incref(f->file);
 
 	return f;
 }
 
+static void
+npfile_dirpos_free(Npfilefid *f)
+{
+	int i;
+
+	for(i = 0; i < f->dirpos.n; i++)
+		if (f->dirpos.cookie[i])
+			npfile_decref((Npfile *) (uintptr_t) f->dirpos.cookie[i]);
+
+	np_dirpos_free(&f->dirpos);
+}
+
+/*
+ * Find the child a listing of dir continues with at offset, the end
+ * of an earlier read. Returns it with a reference in *next, NULL at
+ * the end. Returns 0 if the offset is unknown or its child was
+ * removed since, the backends can't go on from a removed child.
+ * Called with the fid's and the directory's locks held.
+ */
+static int
+npfile_dirnext(Npfilefid *f, Npfile *dir, u64 offset, Npfile **next)
+{
+	u64 cookie;
+	Npfile *cf;
+
+	if (!np_dirpos_find(&f->dirpos, offset, &cookie))
+		return 0;
+
+	cf = (Npfile *) (uintptr_t) cookie;
+	if (cf && (cf->removed || cf->parent != dir))
+		return 0;
+
+	npfile_incref(cf);
+	*next = cf;
+	return 1;
+}
+
 static void
 npfile_fiddestroy(Npfid *fid)
 {
@@ -294,6 +495,9 @@ npfile_fiddestroy(Npfid *fid)
 		fprintf(stderr, "destroy fid %d\n", fid->fid);
 
 	f = fid->aux;
+	if (!f)
+		return;
+
 	file = f->file;
 	if (f->omode != ~0) {
 		if (!(file->mode&Dmdir)) {
@@ -302,8 +506,7 @@ npfile_fiddestroy(Npfid *fid)
 				(*fops->closefid)(f);
 		}
 
-		if (f->dirent)
-			npfile_decref(f->dirent);
+		npfile_dirpos_free(f);
 	}
 
 	npfile_decref(file);
@@ -352,31 +555,55 @@ npfile_clone(Npfid *fid, Npfid *newfid)
 	return 1;
 }
 
+/*
+ * Look the names up one directory after the other, the fid moves
+ * only once, to the last file found.
+ */
 static int
-npfile_walk(Npfid *fid, Npstr *wname, Npqid *wqid)
+npfile_walkpath(Npfid *fid, int nwname, Npstr *wnames, Npqid *wqids)
 {
+	int i;
 	Npfilefid *f;
 	Npfile *dir, *nfile;
-	char *name;
 
 	f = fid->aux;
 	dir = f->file;
+	npfile_incref(dir);
+	for(i = 0; i < nwname; i++) {
+		if (!(dir->mode & Dmdir)) {
+			np_werror(Enotdir, ENOTDIR);
+			break;
+		}
 
-	if (!npfile_checkperm(dir, fid->user, 1))
-		return 0;
+		if (!npfile_checkperm(dir, fid->user, 1))
+			break;
+
+		nfile = npfile_lookup(dir, wnames[i].str, wnames[i].len);
+		if (!nfile) {
+			if (!np_haserror())
+				np_werror(Enotfound, ENOENT);
+			break;
+		}
 
-	name = np_strdup(wname);
-	nfile = npfile_find(dir, name);
-	free(name);
-	if (nfile) {
-		f->file = nfile;
 		npfile_decref(dir);
+		dir = nfile;
+		wqids[i] = nfile->qid;
+	}
 
-		*wqid = nfile->qid;
-	} else if (!np_haserror())
-		np_werror(Enotfound, ENOENT);
-		
-	return nfile != NULL;
+	if (i > 0) {
+		nfile = f->file;
+		f->file = dir;
+		npfile_decref(nfile);
+	} else
+		npfile_decref(dir);
+
+	return i;
+}
+
+static int
+npfile_walk(Npfid *fid, Npstr *wname, Npqid *wqid)
+{
+	return npfile_walkpath(fid, 1, wname, wqid);
 }
 
 static int
@@ -423,7 +650,7 @@ npfile_open(Npfid *fid, u8 mode)
 	f = fid->aux;
 	file = f->file;
 	m = mode2perm(mode);
-	pthread_mutex_lock(&file->lock);
+	pthread_rwlock_wrlock(&file->lock);
 	if (!npfile_checkperm(file, fid->user, m))
 		goto done;
 
@@ -435,10 +662,7 @@ npfile_open(Npfid *fid, u8 mode)
 		file->excl = 1;
 	}
 
-	if (file->mode & Dmdir) {
-		f->diroffset = 0;
-		f->dirent = NULL;
-	} else {
+	if (!(file->mode & Dmdir)) {
 		fops = file->ops;
 
 		if (mode & Otrunc) {
@@ -461,7 +685,7 @@ npfile_open(Npfid *fid, u8 mode)
 	ret = np_create_ropen(&file->qid, 0);
 
 done:
-	pthread_mutex_unlock(&file->lock);
+	pthread_rwlock_unlock(&file->lock);
 	return ret;
 
 }
@@ -489,6 +713,7 @@ npfile_create(Npfid *fid, Npstr* name, u32 perm, u8 mode, Npstr* extension)
 	if (np_haserror())
 		goto done;
 	else if (nf) {
+		npfile_decref(nf);
 		np_werror(Eexist, EEXIST);
 		goto done;
 	}
@@ -513,33 +738,33 @@ npfile_create(Npfid *fid, Npstr* name, u32 perm, u8 mode, Npstr* extension)
 	if (!check_perm(perm, fid->user, dir->gid, fid->user, m))
 		goto done;
 
-	pthread_mutex_lock(&dir->lock);
+	pthread_rwlock_wrlock(&dir->lock);
 	dops = dir->ops;
 	if (!dops->create) {
 		np_werror(Eperm, EPERM);
-		pthread_mutex_unlock(&dir->lock);
+		pthread_rwlock_unlock(&dir->lock);
 		goto done;
 	}
 		
 	file = (*dops->create)(dir, sname, perm, fid->user, dir->gid, sext);
 	if (!file) {
-		pthread_mutex_unlock(&dir->lock);
+		pthread_rwlock_unlock(&dir->lock);
 		goto done;
 	}
 
-	pthread_mutex_lock(&file->lock);
+	if (dir->index)
+		npfile_index_add(dir, file);
+
+	pthread_rwlock_wrlock(&file->lock);
 	npfile_modified(dir, fid->user);
-	pthread_mutex_unlock(&dir->lock);
+	pthread_rwlock_unlock(&dir->lock);
 	f->file = file;
 	f->omode = mode;
 
 	if (mode & Oexcl)
 		file->excl = 1;
 
-	if (file->mode & Dmdir) {
-		f->diroffset = 0;
-		f->dirent = NULL;
-	} else {
+	if (!(file->mode & Dmdir)) {
 		fops = file->ops;
 		if (fops->openfid)
 			(*fops->openfid)(f);
@@ -547,7 +772,7 @@ npfile_create(Npfid *fid, Npstr* name, u32 perm, u8 mode, Npstr* extension)
 
 	f->omode = mode;
 	ret = np_create_rcreate(&file->qid, 0);
-	pthread_mutex_unlock(&file->lock);
+	pthread_rwlock_unlock(&file->lock);
 
 done:
 	free(sname);
@@ -568,26 +793,34 @@ npfile_read(Npfid *fid, u64 offset, u32 count, Npreq *req)
 
 	ret = NULL;
 	f = fid->aux;
-	ret = np_alloc_rread(count);
 	file = f->file;
 	if (file->mode & Dmdir) {
-		pthread_mutex_lock(&file->lock);
+		ret = np_alloc_rread(count);
+		pthread_rwlock_rdlock(&file->lock);
 		dops = file->ops;
 		if (!dops->first || !dops->next) {
 			np_werror(Eperm, EPERM);
-			pthread_mutex_unlock(&file->lock);
+			pthread_rwlock_unlock(&file->lock);
 			goto done;
 		}
-			
+
+		/* the directory is shared, the fid's lock keeps its dirpos */
+		pthread_mutex_lock(&f->lock);
+
+		/* a read from the start forgets the old listing */
 		if (offset == 0) {
-			if (f->dirent)
-				npfile_decref(f->dirent);
-			f->dirent = (*dops->first)(file);
-			f->diroffset = 0;
+			npfile_dirpos_free(f);
+			cf = (*dops->first)(file);
+		} else if (!npfile_dirnext(f, file, offset, &cf)) {
+			np_fcall_free(ret);
+			ret = NULL;
+			np_werror(Ebadoffset, EIO);
+			pthread_mutex_unlock(&f->lock);
+			pthread_rwlock_unlock(&file->lock);
+			goto done;
 		}
 
 		n = 0;
-		cf = f->dirent;
 		while (n<count && cf!=NULL) {
 			file2wstat(cf, &wstat);
 			i = np_serialize_stat(&wstat, ret->data + n, count - n - 1,
@@ -602,25 +835,30 @@ npfile_read(Npfid *fid, u64 offset, u32 count, Npreq *req)
 			cf = cf1;
 		}
 
-		f->diroffset += n;
-		f->dirent = cf;
-		file->atime = time(NULL);
-		pthread_mutex_unlock(&file->lock);
+		if (!np_dirpos_add(&f->dirpos, offset + n, (uintptr_t) cf) && cf)
+			npfile_decref(cf);
+
+		pthread_mutex_unlock(&f->lock);
+		pthread_rwlock_unlock(&file->lock);
+		npfile_accessed(file);
 	} else {
 		fops = file->ops;
-		if (!fops->read) {
+		if (fops->readfd && (fid->conn->sendfile || !fops->read)) {
+			ret = npfile_readfd(fid, offset, count, req);
+			n = ret?ret->count:0;
+		} else if (fops->read) {
+			ret = np_alloc_rread(count);
+			n = (*fops->read)(f, offset, count, ret->data, req);
+			if (n < 0) {
+				np_fcall_free(ret);
+				ret = NULL;
+			}
+		} else {
 			np_werror(Eperm, EPERM);
 			goto done;
 		}
-		n = (*fops->read)(f, offset, count, ret->data, req);
-		if (n < 0) {
-			np_conn_free_rcall(req->conn, ret);
-			ret = NULL;
-		}
 
-		pthread_mutex_lock(&file->lock);
-		file->atime = time(NULL);
-		pthread_mutex_unlock(&file->lock);
+		npfile_accessed(file);
 	}
 
 	if (ret)
@@ -630,6 +868,70 @@ done:
 	return ret;
 }
 
+/*
+ * Send the data straight from the file if the transport can do it and
+ * there is enough of it, otherwise copy it into the reply.
+ */
+static Npfcall*
+npfile_readfd(Npfid *fid, u64 offset, u32 count, Npreq *req)
+{
+	int n, fd;
+	u64 fdoff;
+	Npfilefid *f;
+	Npfileops *fops;
+	Npfcall *ret;
+	struct stat st;
+
+	f = fid->aux;
+	fops = f->file->ops;
+	n = (*fops->readfd)(f, offset, count, &fd, &fdoff, req);
+	if (n < 0)
+		return NULL;
+
+	if (n > count)
+		n = count;
+
+	/* don't promise more than the file has */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (fdoff >= st.st_size)
+			n = 0;
+		else if (fdoff + n > st.st_size)
+			n = st.st_size - fdoff;
+	}
+
+	if (n >= Sendfilemin && fid->conn->sendfile) {
+		fd = dup(fd);
+		if (fd < 0) {
+			np_werror(strerror(errno), errno);
+			return NULL;
+		}
+
+		ret = np_create_rread_fd(n, fd, fdoff);
+		if (!ret)
+			np_werror(Enomem, ENOMEM);
+
+		return ret;
+	}
+
+	ret = np_alloc_rread(n);
+	if (!ret) {
+		np_werror(Enomem, ENOMEM);
+		return NULL;
+	}
+
+	if (n > 0) {
+		n = pread(fd, ret->data, n, fdoff);
+		if (n < 0) {
+			np_werror(strerror(errno), errno);
+			np_fcall_free(ret);
+			return NULL;
+		}
+	}
+
+	np_set_rread_count(ret, n);
+	return ret;
+}
+
 static Npfcall*
 npfile_write(Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
 {
@@ -656,9 +958,9 @@ npfile_write(Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
 
 	np_rerror(&ename, &ecode);
 	if (!ename || n<0) {
-		pthread_mutex_lock(&file->lock);
+		pthread_rwlock_wrlock(&file->lock);
 		npfile_modified(file, fid->user);
-		pthread_mutex_unlock(&file->lock);
+		pthread_rwlock_unlock(&file->lock);
 	}
 
 	if (n >= 0)
@@ -686,7 +988,7 @@ npfile_remove(Npfid *fid)
 	ret = NULL;
 	f = fid->aux;
 	file = f->file;
-	pthread_mutex_lock(&file->lock);
+	pthread_rwlock_rdlock(&file->lock);
 	if (file->mode&Dmdir) {
 		dops = file->ops;
 		if (!dops->first) {
@@ -697,35 +999,42 @@ npfile_remove(Npfid *fid)
 		cf = (*dops->first)(file);
 		if (cf) {
 			npfile_decref(cf);
-			pthread_mutex_unlock(&file->lock);
+			pthread_rwlock_unlock(&file->lock);
 			np_werror(Enotempty, EIO);
 			goto done;
 		}
 	}
-	pthread_mutex_unlock(&file->lock);
+	pthread_rwlock_unlock(&file->lock);
 
 	parent = file->parent;
-	pthread_mutex_lock(&parent->lock);
+	pthread_rwlock_wrlock(&parent->lock);
 	if (!npfile_checkperm(parent, fid->user, 2)) {
-		pthread_mutex_unlock(&parent->lock);
+		pthread_rwlock_unlock(&parent->lock);
 		return NULL;
 	}
 
 	dops = parent->ops;
 	if (!dops->remove) {
 		np_werror(Eperm, EPERM);
-		pthread_mutex_unlock(&parent->lock);
+		pthread_rwlock_unlock(&parent->lock);
 		goto done;
 	}
 
 	if ((*dops->remove)(parent, file)) {
+		if (parent->index)
+			npfile_index_remove(parent, file);
+
+		/* the listings that were to go on from it stop */
+		file->removed = 1;
+
 		npfile_modified(parent, fid->user);
 		npfile_decref(file);
 		np_fid_decref(fid);
-		npfile_decref_unlock(parent);
+		pthread_rwlock_unlock(&parent->lock);
+		npfile_decref(parent);
 		ret = np_create_rremove();
 	} else
-		pthread_mutex_unlock(&parent->lock);
+		pthread_rwlock_unlock(&parent->lock);
 
 done:
 	return ret;
@@ -740,9 +1049,9 @@ npfile_stat(Npfid *fid)
 
 	f = fid->aux;
 	file = f->file;
-	pthread_mutex_lock(&file->lock);
+	pthread_rwlock_rdlock(&file->lock);
 	file2wstat(file, &wstat);
-	pthread_mutex_unlock(&file->lock);
+	pthread_rwlock_unlock(&file->lock);
 
 	return np_create_rstat(&wstat, fid->conn->dotu);
 }
@@ -752,16 +1061,24 @@ npfile_wstat(Npfid *fid, Npstat *stat)
 {
 	int n;
 	Npfilefid *f;
-	Npfile *file;
+	Npfile *file, *parent;
 	Npfileops *fops;
 	Npdirops *dops;
 	Npfcall *ret;
+	int (*wstat)(Npfile *, Npstat *);
 
 	ret = NULL;
 	f = fid->aux;
 	file = f->file;
 
-	pthread_mutex_lock(&file->lock);
+	/* a rename changes the index of the parent, lock it first */
+	parent = NULL;
+	if (stat->name.len!=0 && file->parent!=file)
+		parent = file->parent;
+
+	if (parent)
+		pthread_rwlock_wrlock(&parent->lock);
+	pthread_rwlock_wrlock(&file->lock);
 	if (stat->name.len!=0 && !npfile_checkperm(file->parent, fid->user, 2))
 		goto done;
 
@@ -780,30 +1097,144 @@ npfile_wstat(Npfid *fid, Npstat *stat)
 
 	if (file->mode & Dmdir) {
 		dops = file->ops;
-		if (!dops->wstat) {
-			np_werror(Eperm, EPERM);
-			goto done;
-		}
-		n = (*dops->wstat)(file, stat);
+		wstat = dops->wstat;
 	} else {
 		fops = file->ops;
-		if (!fops->wstat) {
-			np_werror(Eperm, EPERM);
-			goto done;
-		}
-		n = (*fops->wstat)(file, stat);
+		wstat = fops->wstat;
+	}
+
+	if (!wstat) {
+		np_werror(Eperm, EPERM);
+		goto done;
 	}
 
+	if (parent && parent->index)
+		npfile_index_remove(parent, file);
+
+	n = (*wstat)(file, stat);
+	if (parent && parent->index)
+		npfile_index_add(parent, file);
+
 	if (!n)
 		goto done;
 
 	ret = np_create_rwstat();
 
 done:
-	pthread_mutex_unlock(&file->lock);
+	pthread_rwlock_unlock(&file->lock);
+	if (parent)
+		pthread_rwlock_unlock(&parent->lock);
+	return ret;
+}
+
+static Npfcall*
+npfile_getattr(Npfid *fid, u64 mask)
+{
+	Npfilefid *f;
+	Npfile *file;
+	Npattr attr;
+
+	f = fid->aux;
+	file = f->file;
+	memset(&attr, 0, sizeof(attr));
+	attr.valid = Gabasic;
+	pthread_rwlock_rdlock(&file->lock);
+	attr.qid = file->qid;
+	attr.mode = np_mode2lmode(file->mode);
+	attr.uid = file->uid->uid;
+	attr.gid = file->gid->gid;
+	attr.nlink = 1;
+	attr.size = file->length;
+	attr.blksize = fid->conn->msize - IOHDRSZ;
+	attr.blocks = (file->length + 511) / 512;
+	attr.atime_sec = __atomic_load_n(&file->atime, __ATOMIC_RELAXED);
+	attr.mtime_sec = file->mtime;
+	attr.ctime_sec = file->mtime;
+	pthread_rwlock_unlock(&file->lock);
+
+	return np_create_rgetattr(&attr);
+}
+
+/*
+ * The cookie of an entry is the number of children up to and
+ * including it. The fid's dirpos keeps the child after the last entry
+ * of each reply, so a listing goes on from there; any other cookie,
+ * or one whose child was removed, is found by counting the children
+ * from the first.
+ */
+static Npfcall*
+npfile_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req)
+{
+	int i, n;
+	u64 cookie;
+	Npfilefid *f;
+	Npfile *file, *cf, *cf1;
+	Npdirops *dops;
+	Npfcall *ret;
+
+	f = fid->aux;
+	file = f->file;
+	ret = np_alloc_rreaddir(count);
+	if (!ret) {
+		np_werror(Enomem, ENOMEM);
+		return NULL;
+	}
+
+	pthread_rwlock_rdlock(&file->lock);
+	dops = file->ops;
+	if (!dops->first || !dops->next) {
+		np_werror(Eperm, EPERM);
+		pthread_rwlock_unlock(&file->lock);
+		np_fcall_free(ret);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	if (offset == 0)
+		npfile_dirpos_free(f);
+
+	cookie = offset;
+	if (offset == 0 || !npfile_dirnext(f, file, offset, &cf)) {
+		cf = (*dops->first)(file);
+		for(cookie = 0; cf != NULL && cookie < offset; cookie++) {
+			cf1 = (*dops->next)(file, cf);
+			npfile_decref(cf);
+			cf = cf1;
+		}
+	}
+
+	n = 0;
+	while (cf != NULL) {
+		i = np_serialize_dirent(&cf->qid, cookie + 1, cf->name,
+			ret->data + n, count - n);
+		if (i == 0)
+			break;
+
+		n += i;
+		cookie++;
+		cf1 = (*dops->next)(file, cf);
+		npfile_decref(cf);
+		cf = cf1;
+	}
+
+	if (!np_dirpos_add(&f->dirpos, cookie, (uintptr_t) cf) && cf)
+		npfile_decref(cf);
+
+	pthread_mutex_unlock(&f->lock);
+	pthread_rwlock_unlock(&file->lock);
+	npfile_accessed(file);
+
+	np_set_rread_count(ret, n);
 	return ret;
 }
 
+/* the writes go to the file ops when they come, there is nothing to flush */
+static Npfcall*
+npfile_fsync(Npfid *fid, int datasync)
+{
+	return np_create_rfsync();
+}
+
 void
 npfile_init_srv(Npsrv *srv, Npfile *root)
 {
@@ -811,6 +1242,7 @@ npfile_init_srv(Npsrv *srv, Npfile *root)
 	srv->attach = npfile_attach;
 	srv->clone = npfile_clone;
 	srv->walk = npfile_walk;
+	srv->walkpath = npfile_walkpath;
 	srv->open = npfile_open;
 	srv->create = npfile_create;
 	srv->read = npfile_read;
@@ -819,6 +1251,10 @@ npfile_init_srv(Npsrv *srv, Npfile *root)
 	srv->remove = npfile_remove;
 	srv->stat = npfile_stat;
 	srv->wstat = npfile_wstat;
+	srv->dotl = 1;
+	srv->getattr = npfile_getattr;
+	srv->readdir = npfile_readdir;
+	srv->fsync = npfile_fsync;
 	srv->fiddestroy = npfile_fiddestroy;
 	srv->treeaux = root;
 	if (srv->msize > INT_MAX)
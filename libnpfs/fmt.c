@@ -243,7 +243,11 @@ printfcall(FILE *f, Npfcall *fc, int dotu) {
 		
 	case Rread:
 		ret += fprintf(f, "Rread tag %u count %u data ", tag, fc->count);
-		ret += printdata(f, fc->data, fc->count);
+		if (fc->fd >= 0)
+			ret += fprintf(f, "from fd %d offset %llu", fc->fd,
+				(unsigned long long) fc->offset);
+		else
+			ret += printdata(f, fc->data, fc->count);
 		break;
 		
 	case Twrite:
@@ -290,6 +294,84 @@ printfcall(FILE *f, Npfcall *fc, int dotu) {
 		ret += fprintf(f, "Rwstat tag %u", tag);
 		break;
 
+	case Rlerror:
+		ret += fprintf(f, "Rlerror tag %u ecode %d", tag, fc->ecode);
+		break;
+
+	case Tstatfs:
+		ret += fprintf(f, "Tstatfs tag %u fid %d", tag, fid);
+		break;
+
+	case Rstatfs:
+		ret += fprintf(f, "Rstatfs tag %u type 0x%x bsize %u blocks %llu "
+			"bfree %llu files %llu ffree %llu namelen %u", tag,
+			fc->statfs.type, fc->statfs.bsize,
+			(unsigned long long) fc->statfs.blocks,
+			(unsigned long long) fc->statfs.bfree,
+			(unsigned long long) fc->statfs.files,
+			(unsigned long long) fc->statfs.ffree,
+			fc->statfs.namelen);
+		break;
+
+	case Tlopen:
+		ret += fprintf(f, "Tlopen tag %u fid %d flags 0%o", tag, fid,
+			fc->flags);
+		break;
+
+	case Rlopen:
+		ret += fprintf(f, "Rlopen tag %u", tag);
+		ret += printqid(f, &fc->qid);
+		ret += fprintf(f, " iounit %d", fc->iounit);
+		break;
+
+	case Tlcreate:
+		ret += fprintf(f, "Tlcreate tag %u fid %d name %.*s flags 0%o "
+			"mode 0%o gid %u", tag, fid, fc->name.len, fc->name.str,
+			fc->flags, fc->perm, fc->gid);
+		break;
+
+	case Rlcreate:
+		ret += fprintf(f, "Rlcreate tag %u", tag);
+		ret += printqid(f, &fc->qid);
+		ret += fprintf(f, " iounit %d", fc->iounit);
+		break;
+
+	case Tgetattr:
+		ret += fprintf(f, "Tgetattr tag %u fid %d mask 0x%llx", tag, fid,
+			(unsigned long long) fc->mask);
+		break;
+
+	case Rgetattr:
+		ret += fprintf(f, "Rgetattr tag %u valid 0x%llx", tag,
+			(unsigned long long) fc->attr.valid);
+		ret += printqid(f, &fc->attr.qid);
+		ret += fprintf(f, " mode 0%o uid %u gid %u nlink %llu size %llu "
+			"mtime %llu", fc->attr.mode, fc->attr.uid, fc->attr.gid,
+			(unsigned long long) fc->attr.nlink,
+			(unsigned long long) fc->attr.size,
+			(unsigned long long) fc->attr.mtime_sec);
+		break;
+
+	case Treaddir:
+		ret += fprintf(f, "Treaddir tag %u fid %d offset %llu count %u",
+			tag, fid, (unsigned long long) fc->offset, fc->count);
+		break;
+
+	case Rreaddir:
+		ret += fprintf(f, "Rreaddir tag %u count %u data ", tag, 
+			fc->count);
+		ret += printdata(f, fc->data, fc->count);
+		break;
+
+	case Tfsync:
+		ret += fprintf(f, "Tfsync tag %u fid %d datasync %u", tag, fid,
+			fc->datasync);
+		break;
+
+	case Rfsync:
+		ret += fprintf(f, "Rfsync tag %u", tag);
+		break;
+
 	default:
 		ret += fprintf(f, "unknown type %d", type);
 		break;
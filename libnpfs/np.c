@@ -23,9 +23,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/stat.h>
 #include "npfs.h"
 #include "npfsimpl.h"
 
@@ -363,11 +365,10 @@ np_create_common(struct cbuf *bufp, u32 size, u8 id)
 	Npfcall *fc;
 
 	size += 4 + 1 + 2; /* size[4] id[1] tag[2] */
-	fc = malloc(sizeof(Npfcall) + size);
+	fc = np_fcall_alloc(size);
 	if (!fc)
 		return NULL;
 
-	fc->pkt = (u8 *) fc + sizeof(*fc);
 	buf_init(bufp, (char *) fc->pkt, size);
 	buf_put_int32(bufp, size, &fc->size);
 	buf_put_int8(bufp, id, &fc->id);
@@ -609,6 +610,39 @@ np_create_rread(u32 count, u8* data)
 	return fc;
 }
 
+/*
+ * Rread whose data is sent from the file, the packet only has the
+ * header. The reply owns fd and closes it when it is freed.
+ */
+Npfcall *
+np_create_rread_fd(u32 count, int fd, u64 offset)
+{
+	int size;
+	Npfcall *fc;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+
+	bufp = &buffer;
+	fc = np_create_common(bufp, 4, Rread); /* count[4] */
+	if (!fc) {
+		close(fd);
+		return NULL;
+	}
+
+	buf_put_int32(bufp, count, &fc->count);
+	fc->data = NULL;
+	fc->fd = fd;
+	fc->offset = offset;
+
+	/* the size on the wire includes the data */
+	size = 4 + 1 + 2 + 4 + count;
+	buf_init(bufp, (char *) fc->pkt, 4);
+	buf_put_int32(bufp, size, &fc->size);
+
+	return fc;
+}
+
+/* also sets the count of an Rreaddir, it looks the same */
 void
 np_set_rread_count(Npfcall *fc, u32 count)
 {
@@ -713,6 +747,153 @@ np_create_rwstat(void)
 	return np_post_check(fc, bufp);
 }
 
+Npfcall *
+np_create_rlerror(int ecode)
+{
+	int size;
+	Npfcall *fc;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+
+	bufp = &buffer;
+	size = 4; /* ecode[4] */
+	fc = np_create_common(bufp, size, Rlerror);
+	if (!fc)
+		return NULL;
+
+	fc->ename.len = 0;
+	fc->ename.str = NULL;
+	buf_put_int32(bufp, ecode, &fc->ecode);
+
+	return np_post_check(fc, bufp);
+}
+
+Npfcall *
+np_create_rstatfs(Npstatfs *statfs)
+{
+	int size;
+	Npfcall *fc;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+	Npstatfs *sf;
+
+	bufp = &buffer;
+	size = 4 + 4 + 8*6 + 4; /* type[4] bsize[4] blocks[8] bfree[8] bavail[8]
+				   files[8] ffree[8] fsid[8] namelen[4] */
+	fc = np_create_common(bufp, size, Rstatfs);
+	if (!fc)
+		return NULL;
+
+	sf = &fc->statfs;
+	buf_put_int32(bufp, statfs->type, &sf->type);
+	buf_put_int32(bufp, statfs->bsize, &sf->bsize);
+	buf_put_int64(bufp, statfs->blocks, &sf->blocks);
+	buf_put_int64(bufp, statfs->bfree, &sf->bfree);
+	buf_put_int64(bufp, statfs->bavail, &sf->bavail);
+	buf_put_int64(bufp, statfs->files, &sf->files);
+	buf_put_int64(bufp, statfs->ffree, &sf->ffree);
+	buf_put_int64(bufp, statfs->fsid, &sf->fsid);
+	buf_put_int32(bufp, statfs->namelen, &sf->namelen);
+
+	return np_post_check(fc, bufp);
+}
+
+Npfcall *
+np_create_rlopen(Npqid *qid, u32 iounit)
+{
+	Npfcall *fc;
+
+	fc = np_create_ropen(qid, iounit);
+	if (fc)
+		fc->id = fc->pkt[4] = Rlopen;
+
+	return fc;
+}
+
+Npfcall *
+np_create_rlcreate(Npqid *qid, u32 iounit)
+{
+	Npfcall *fc;
+
+	fc = np_create_ropen(qid, iounit);
+	if (fc)
+		fc->id = fc->pkt[4] = Rlcreate;
+
+	return fc;
+}
+
+Npfcall *
+np_create_rgetattr(Npattr *attr)
+{
+	int size;
+	Npfcall *fc;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+	Npattr *a;
+
+	bufp = &buffer;
+	size = 8 + 13 + 4*3 + 8*15; /* valid[8] qid[13] mode[4] uid[4] gid[4]
+				       nlink[8] ... data_version[8] */
+	fc = np_create_common(bufp, size, Rgetattr);
+	if (!fc)
+		return NULL;
+
+	a = &fc->attr;
+	buf_put_int64(bufp, attr->valid, &a->valid);
+	buf_put_qid(bufp, &attr->qid, &a->qid);
+	buf_put_int32(bufp, attr->mode, &a->mode);
+	buf_put_int32(bufp, attr->uid, &a->uid);
+	buf_put_int32(bufp, attr->gid, &a->gid);
+	buf_put_int64(bufp, attr->nlink, &a->nlink);
+	buf_put_int64(bufp, attr->rdev, &a->rdev);
+	buf_put_int64(bufp, attr->size, &a->size);
+	buf_put_int64(bufp, attr->blksize, &a->blksize);
+	buf_put_int64(bufp, attr->blocks, &a->blocks);
+	buf_put_int64(bufp, attr->atime_sec, &a->atime_sec);
+	buf_put_int64(bufp, attr->atime_nsec, &a->atime_nsec);
+	buf_put_int64(bufp, attr->mtime_sec, &a->mtime_sec);
+	buf_put_int64(bufp, attr->mtime_nsec, &a->mtime_nsec);
+	buf_put_int64(bufp, attr->ctime_sec, &a->ctime_sec);
+	buf_put_int64(bufp, attr->ctime_nsec, &a->ctime_nsec);
+	buf_put_int64(bufp, attr->btime_sec, &a->btime_sec);
+	buf_put_int64(bufp, attr->btime_nsec, &a->btime_nsec);
+	buf_put_int64(bufp, attr->gen, &a->gen);
+	buf_put_int64(bufp, attr->data_version, &a->data_version);
+
+	return np_post_check(fc, bufp);
+}
+
+/*
+ * Rreaddir with room for count bytes of entries, fill them in with
+ * np_serialize_dirent and set the count with np_set_rread_count.
+ */
+Npfcall *
+np_alloc_rreaddir(u32 count)
+{
+	Npfcall *fc;
+
+	fc = np_alloc_rread(count);
+	if (fc)
+		fc->id = fc->pkt[4] = Rreaddir;
+
+	return fc;
+}
+
+Npfcall *
+np_create_rfsync(void)
+{
+	int size;
+	Npfcall *fc;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+
+	bufp = &buffer;
+	size = 0;
+	fc = np_create_common(bufp, size, Rfsync);
+
+	return np_post_check(fc, bufp);
+}
+
 int
 np_deserialize(Npfcall *tcall, u8 *data, int dotu)
 {
@@ -730,7 +911,7 @@ np_deserialize(Npfcall *tcall, u8 *data, int dotu)
 	buf_init(bufp, data + 4, tcall->size - 4);
 	tcall->id = buf_get_int8(bufp);
 	tcall->tag = buf_get_int16(bufp);
-	tcall->fid = tcall->afid = tcall->newfid = NOFID;
+	tcall->fid = NOFID;
 
 	switch (tcall->id) {
 	default:
@@ -782,6 +963,10 @@ np_deserialize(Npfcall *tcall, u8 *data, int dotu)
 		tcall->mode = buf_get_int8(bufp);
 		if (dotu)
 			buf_get_str(bufp, &tcall->extension);
+		else {
+			tcall->extension.len = 0;
+			tcall->extension.str = NULL;
+		}
 		break;
 
 	case Tread:
@@ -808,6 +993,42 @@ np_deserialize(Npfcall *tcall, u8 *data, int dotu)
 		buf_get_int16(bufp);
 		buf_get_stat(bufp, &tcall->stat, dotu);
 		break;
+
+	case Tstatfs:
+		tcall->fid = buf_get_int32(bufp);
+		break;
+
+	case Tlopen:
+		tcall->fid = buf_get_int32(bufp);
+		tcall->flags = buf_get_int32(bufp);
+		break;
+
+	case Tlcreate:
+		tcall->fid = buf_get_int32(bufp);
+		buf_get_str(bufp, &tcall->name);
+		tcall->flags = buf_get_int32(bufp);
+		tcall->perm = buf_get_int32(bufp);
+		tcall->gid = buf_get_int32(bufp);
+		break;
+
+	case Tgetattr:
+		tcall->fid = buf_get_int32(bufp);
+		tcall->mask = buf_get_int64(bufp);
+		break;
+
+	case Treaddir:
+		tcall->fid = buf_get_int32(bufp);
+		tcall->offset = buf_get_int64(bufp);
+		tcall->count = buf_get_int32(bufp);
+		break;
+
+	case Tfsync:
+		tcall->fid = buf_get_int32(bufp);
+		/* older clients don't send it */
+		tcall->datasync = 0;
+		if (bufp->p < bufp->ep)
+			tcall->datasync = buf_get_int32(bufp);
+		break;
 	}
 
 	if (buf_check_overflow(bufp))
@@ -819,6 +1040,145 @@ error:
 	return 0;
 }
 
+/*
+ * Like np_deserialize, for the replies. The server never takes them,
+ * it is for tools that look at recorded messages.
+ */
+int
+np_deserialize_rcall(Npfcall *rcall, u8 *data, int dotu)
+{
+	int i;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+
+	bufp = &buffer;
+	buf_init(bufp, data, 4);
+	rcall->size = buf_get_int32(bufp);
+
+	buf_init(bufp, data + 4, rcall->size - 4);
+	rcall->id = buf_get_int8(bufp);
+	rcall->tag = buf_get_int16(bufp);
+	rcall->fid = NOFID;
+	rcall->fd = -1;
+
+	switch (rcall->id) {
+	default:
+		goto error;
+
+	case Rversion:
+		rcall->msize = buf_get_int32(bufp);
+		buf_get_str(bufp, &rcall->version);
+		break;
+
+	case Rauth:
+	case Rattach:
+		buf_get_qid(bufp, &rcall->qid);
+		break;
+
+	case Rerror:
+		buf_get_str(bufp, &rcall->ename);
+		if (dotu)
+			rcall->ecode = buf_get_int32(bufp);
+		break;
+
+	case Rwalk:
+		rcall->nwqid = buf_get_int16(bufp);
+		if (rcall->nwqid > MAXWELEM)
+			goto error;
+
+		for(i = 0; i < rcall->nwqid; i++)
+			buf_get_qid(bufp, &rcall->wqids[i]);
+		break;
+
+	case Ropen:
+	case Rcreate:
+		buf_get_qid(bufp, &rcall->qid);
+		rcall->iounit = buf_get_int32(bufp);
+		break;
+
+	case Rread:
+		rcall->count = buf_get_int32(bufp);
+		rcall->data = buf_alloc(bufp, rcall->count);
+		break;
+
+	case Rwrite:
+		rcall->count = buf_get_int32(bufp);
+		break;
+
+	case Rstat:
+		buf_get_int16(bufp);
+		buf_get_stat(bufp, &rcall->stat, dotu);
+		break;
+
+	case Rflush:
+	case Rclunk:
+	case Rremove:
+	case Rwstat:
+	case Rfsync:
+		break;
+
+	case Rlerror:
+		rcall->ename.len = 0;
+		rcall->ename.str = NULL;
+		rcall->ecode = buf_get_int32(bufp);
+		break;
+
+	case Rstatfs:
+		rcall->statfs.type = buf_get_int32(bufp);
+		rcall->statfs.bsize = buf_get_int32(bufp);
+		rcall->statfs.blocks = buf_get_int64(bufp);
+		rcall->statfs.bfree = buf_get_int64(bufp);
+		rcall->statfs.bavail = buf_get_int64(bufp);
+		rcall->statfs.files = buf_get_int64(bufp);
+		rcall->statfs.ffree = buf_get_int64(bufp);
+		rcall->statfs.fsid = buf_get_int64(bufp);
+		rcall->statfs.namelen = buf_get_int32(bufp);
+		break;
+
+	case Rlopen:
+	case Rlcreate:
+		buf_get_qid(bufp, &rcall->qid);
+		rcall->iounit = buf_get_int32(bufp);
+		break;
+
+	case Rgetattr:
+		rcall->attr.valid = buf_get_int64(bufp);
+		buf_get_qid(bufp, &rcall->attr.qid);
+		rcall->attr.mode = buf_get_int32(bufp);
+		rcall->attr.uid = buf_get_int32(bufp);
+		rcall->attr.gid = buf_get_int32(bufp);
+		rcall->attr.nlink = buf_get_int64(bufp);
+		rcall->attr.rdev = buf_get_int64(bufp);
+		rcall->attr.size = buf_get_int64(bufp);
+		rcall->attr.blksize = buf_get_int64(bufp);
+		rcall->attr.blocks = buf_get_int64(bufp);
+		rcall->attr.atime_sec = buf_get_int64(bufp);
+		rcall->attr.atime_nsec = buf_get_int64(bufp);
+		rcall->attr.mtime_sec = buf_get_int64(bufp);
+		rcall->attr.mtime_nsec = buf_get_int64(bufp);
+		rcall->attr.ctime_sec = buf_get_int64(bufp);
+		rcall->attr.ctime_nsec = buf_get_int64(bufp);
+		rcall->attr.btime_sec = buf_get_int64(bufp);
+		rcall->attr.btime_nsec = buf_get_int64(bufp);
+		rcall->attr.gen = buf_get_int64(bufp);
+		rcall->attr.data_version = buf_get_int64(bufp);
+		break;
+
+	case Rreaddir:
+		rcall->count = buf_get_int32(bufp);
+		rcall->data = buf_alloc(bufp, rcall->count);
+		break;
+	}
+
+	if (buf_check_overflow(bufp))
+		goto error;
+
+	return rcall->size;
+
+error:
+	return 0;
+}
+
 int 
 np_serialize_stat(Npwstat *wstat, u8* buf, int buflen, int dotu)
 {
@@ -842,3 +1202,66 @@ np_serialize_stat(Npwstat *wstat, u8* buf, int buflen, int dotu)
 
 	return bufp->p - bufp->sp;
 }
+
+/*
+ * Put a 9P2000.L directory entry in buf. The offset is the cookie
+ * that Treaddir passes to continue after the entry. Returns the size
+ * of the entry, or 0 if it doesn't fit.
+ */
+int
+np_serialize_dirent(Npqid *qid, u64 offset, char *name, u8 *buf, int buflen)
+{
+	int size;
+	u8 type;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+	Npqid q;
+	Npstr s;
+
+	size = 13 + 8 + 1 + 2 + strlen(name); /* qid[13] offset[8] type[1] name[s] */
+	if (size > buflen)
+		return 0;
+
+	/* the type of the entry as readdir(3) has it */
+	type = np_mode2lmode((u32) qid->type << 24) >> 12;
+
+	bufp = &buffer;
+	buf_init(bufp, buf, buflen);
+	buf_put_qid(bufp, qid, &q);
+	buf_put_int64(bufp, offset, NULL);
+	buf_put_int8(bufp, type, NULL);
+	buf_put_str(bufp, name, &s);
+
+	if (buf_check_overflow(bufp))
+		return 0;
+
+	return size;
+}
+
+/* the Linux mode of a file with the 9P mode */
+u32
+np_mode2lmode(u32 mode)
+{
+	u32 lmode;
+
+	lmode = mode & 0777;
+	if (mode & Dmdir)
+		lmode |= S_IFDIR;
+	else if (mode & Dmsymlink)
+		lmode |= S_IFLNK;
+	else if (mode & Dmsocket)
+		lmode |= S_IFSOCK;
+	else if (mode & Dmnamedpipe)
+		lmode |= S_IFIFO;
+	else if (mode & Dmdevice)
+		lmode |= S_IFCHR;
+	else
+		lmode |= S_IFREG;
+
+	if (mode & Dmsetuid)
+		lmode |= S_ISUID;
+	if (mode & Dmsetgid)
+		lmode |= S_ISGID;
+
+	return lmode;
+}
@@ -23,8 +23,30 @@
 
 int dumpdata(u8 *data, int datalen);
 
+/* request states */
+enum {
+	Reqpending,
+	Reqworking,
+	Reqflushed,
+};
+
 Npreq *reqalloc(void);
 void reqfree(Npreq *req);
-void np_conn_free_rcall(Npconn *, Npfcall *rc);
-void np_srv_remove_request(Npsrv *, Npreq *);
+int np_buf_getiov(Npbuf *, struct iovec *, int);
+int np_srv_home(Npsrv *);
+int np_req_claim(Npreq *, int);
+int np_req_waiting(Npreq *);
+Npreq *np_conn_remove_req(Npconn *, Npreq *);
+Npreq *np_conn_find_req(Npconn *, u16);
+int np_conn_queue_fcall(Npconn *, Npfcall *);
+void np_conn_print_fcall(Npconn *, Npfcall *);
+Npfcall *np_conn_rerror(Npconn *, char *, int);
+void np_srv_add_reqs(Npsrv *, int, Npreq **, int);
+Npreq *np_req_cancel_wait(Npreq *);
+void np_req_requeue(Npreq *);
+u64 np_nsec(void);
+void np_stats_in(Npfcall *);
+void np_stats_reply(Npreq *, Npfcall *);
+extern int np_tracing;
+void np_trace(Npconn *, Npfcall *, u32 fid, u64 latency);
 int np_mount(char *mntpt, int mntflags, char *opts);
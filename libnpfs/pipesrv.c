@@ -88,7 +88,8 @@ np_pipesrv_mount(Npsrv *srv, char *mntpt, char *user, int mntflags, char *opts)
 	ps = srv->srvaux;
 	snprintf(options, sizeof(options), 
 		"msize=%d,name=%s,%s,proto=fd,rfdno=%d,wfdno=%d,%s",
-		srv->msize, user, srv->dotu?"":"noextend",
+		srv->msize, user, 
+		srv->dotl?"version=9p2000.L":srv->dotu?"version=9p2000.u":"noextend",
 		ps->pipout[0], ps->pipin[1], opts);
  
 	n = np_mount(mntpt, mntflags, options);
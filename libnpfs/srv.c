@@ -20,14 +20,77 @@
  * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
+#include <assert.h>
+#ifdef HAVE_UCONTEXT_H
+#include <ucontext.h>
+#include <sys/mman.h>
+#endif
 #include "npfs.h"
 #include "npfsimpl.h"
 
+typedef struct Npreqcell Npreqcell;
+
+/*
+ * Bounded multi-producer multi-consumer queue of requests (D. Vyukov).
+ * The connections push to their home worker's queue, the owner and
+ * the idle workers pop from it. Each cell's sequence number tells
+ * whether it is free for the producer at that position or full for
+ * the consumer.
+ */
+struct Npreqcell {
+	u64		seq;
+	Npreq*		req;
+};
+
+struct Npreqq {
+	u64		head;		/* next position to push */
+	char		pad1[56];
+	u64		tail;		/* next position to pop */
+	char		pad2[56];
+	u64		mask;
+	Npreqcell*	cells;
+};
+
+enum {
+	Reqqsize	= 1024,
+	Maxreqs		= 1024,	/* default limit of requests per connection */
+	Costackmin	= 16384,
+	Cofreemax	= 64,	/* coroutines a worker keeps for reuse */
+};
+
+#ifdef HAVE_UCONTEXT_H
+/*
+ * Handler of a request that runs on its own stack. A coroutine stays
+ * on the worker that started it, so the handler never sees its thread
+ * change under it, and it can't be resumed before it has switched out.
+ */
+struct Npcoro {
+	ucontext_t	ctx;		/* the handler */
+	ucontext_t	wctx;		/* the worker that switched to it */
+	Npreq*		req;
+	Npfcall*	rc;
+	int		done;
+	char*		errname;	/* handler's error while switched out */
+	u32		errcode;
+	char*		stack;		/* mapping with a guard page below */
+	size_t		stacksize;
+	Npcoro*		next;		/* worker's list of free coroutines */
+};
+
+static Npfcall *np_coro_switch(Npreq *req, void *a);
+#endif
+
 struct Reqpool {
 	pthread_mutex_t	lock;
 	int		reqnum;
@@ -51,6 +114,7 @@ char *Eopen = "file alread exclusively opened";
 char *Eexist = "file or directory already exists";
 char *Enotempty = "directory not empty";
 char *Eunknownuser = "unknown user";
+char *Etaginuse = "tag in use";
 
 static pthread_mutex_t wthread_lock = PTHREAD_MUTEX_INITIALIZER;
 static int wthread_init = 0;
@@ -60,6 +124,10 @@ static void np_wthread_create(Npsrv *srv);
 static void np_srv_destroy(Npsrv *srv);
 static void np_wthread_create(Npsrv *srv);
 static void *np_wthread_proc(void *a);
+static Npreqq *np_reqq_create(int size);
+static int np_reqq_push(Npreqq *q, Npreq *req);
+static Npreq *np_reqq_pop(Npreqq *q);
+static Npfcall *np_run_request(Npwthread *wt, Npreq *req);
 
 static Npfcall* np_default_version(Npconn *, u32, Npstr *);
 static Npfcall* np_default_attach(Npfid *, Npfid *, Npstr *, Npstr *);
@@ -74,6 +142,12 @@ static Npfcall* np_default_clunk(Npfid *);
 static Npfcall* np_default_remove(Npfid *);
 static Npfcall* np_default_stat(Npfid *);
 static Npfcall* np_default_wstat(Npfid *, Npstat *);
+static Npfcall* np_default_statfs(Npfid *);
+static Npfcall* np_default_lopen(Npfid *, u8, u32);
+static Npfcall* np_default_lcreate(Npfid *, Npstr *, u32, u8, u32, u32);
+static Npfcall* np_default_getattr(Npfid *, u64);
+static Npfcall* np_default_readdir(Npfid *, u64, u32, Npreq *);
+static Npfcall* np_default_fsync(Npfid *, int);
 
 Npsrv*
 np_srv_create(int nwthread)
@@ -81,11 +155,15 @@ np_srv_create(int nwthread)
 	int i;
 	Npsrv *srv;
 
+	/* the requests have nowhere to go without a worker */
+	if (nwthread < 1)
+		nwthread = 1;
+
 	srv = malloc(sizeof(*srv));
 	pthread_mutex_init(&srv->lock, NULL);
-	pthread_cond_init(&srv->reqcond, NULL);
 	srv->msize = 8192;
 	srv->dotu = 1;
+	srv->dotl = 0;
 	srv->srvaux = NULL;
 	srv->treeaux = NULL;
 	srv->shuttingdown = 0;
@@ -103,6 +181,7 @@ np_srv_create(int nwthread)
 	srv->flush = np_default_flush;
 	srv->clone = np_default_clone;
 	srv->walk = np_default_walk;
+	srv->walkpath = NULL;
 	srv->open = np_default_open;
 	srv->create = np_default_create;
 	srv->read = np_default_read;
@@ -111,13 +190,27 @@ np_srv_create(int nwthread)
 	srv->remove = np_default_remove;
 	srv->stat = np_default_stat;
 	srv->wstat = np_default_wstat;
+	srv->statfs = np_default_statfs;
+	srv->lopen = np_default_lopen;
+	srv->lcreate = np_default_lcreate;
+	srv->getattr = np_default_getattr;
+	srv->readdir = np_default_readdir;
+	srv->fsync = np_default_fsync;
 
 	srv->conns = NULL;
-	srv->reqs_first = NULL;
-	srv->reqs_last = NULL;
-	srv->workreqs = NULL;
 	srv->wthreads = NULL;
+	srv->nwthreads = 0;
+	srv->wtab = calloc(nwthread, sizeof(Npwthread *));
+	srv->nexthome = 0;
+	srv->nsleeping = 0;
 	srv->debuglevel = 0;
+	srv->costack = 0;
+	srv->ordering = Npordernone;
+	srv->weight[Npclassmeta] = 8;
+	srv->weight[Npclasssmall] = 4;
+	srv->weight[Npclassbulk] = 1;
+	srv->maxreqs = Maxreqs;
+	srv->ctime = np_nsec();
 
 	pthread_mutex_lock(&wthread_lock);
 	if (!wthread_init) {
@@ -139,6 +232,71 @@ np_srv_start(Npsrv *srv)
 		(*srv->start)(srv);
 }
 
+/*
+ * Run the handlers on coroutines with stacksize bytes of stack, or
+ * on the workers' stacks if 0. Call before the server starts.
+ */
+int
+np_srv_set_coroutines(Npsrv *srv, int stacksize)
+{
+#ifdef HAVE_UCONTEXT_H
+	if (stacksize < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (stacksize && stacksize < Costackmin)
+		stacksize = Costackmin;
+
+	srv->costack = stacksize;
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Wait until fd is ready for events (Npwaitread, Npwaitwrite). On a
+ * coroutine the request is parked with np_req_wait_fd and the worker
+ * goes on with other requests, otherwise the thread blocks in poll.
+ * Fails with EINTR if the request was flushed meanwhile.
+ */
+int
+np_wait_fd(int fd, int events)
+{
+	int n;
+	struct pollfd pfd;
+#ifdef HAVE_UCONTEXT_H
+	Npwthread *wt;
+	Npcoro *co;
+
+	wt = pthread_getspecific(wthread_key);
+	co = wt ? wt->coro : NULL;
+	if (co && np_req_wait_fd(co->req, fd, events, np_coro_switch, co) == 0) {
+		swapcontext(&co->ctx, &co->wctx);
+		if (co->req->cancelled) {
+			errno = EINTR;
+			return -1;
+		}
+
+		return 0;
+	}
+#endif
+
+	pfd.fd = fd;
+	pfd.events = 0;
+	if (events & Npwaitread)
+		pfd.events |= POLLIN;
+	if (events & Npwaitwrite)
+		pfd.events |= POLLOUT;
+
+	while ((n = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+		;
+
+	return n < 0 ? -1 : 0;
+}
+
 void
 np_srv_shutdown(Npsrv *srv, int shutconns)
 {
@@ -209,50 +367,286 @@ np_srv_destroy(Npsrv *srv)
 	Npwthread *wt;
 
 	for(wt = srv->wthreads; wt != NULL; wt = wt->next) {
+		pthread_mutex_lock(&wt->lock);
 		wt->shutdown = 1;
+		__atomic_store_n(&wt->sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&wt->cond);
+		pthread_mutex_unlock(&wt->lock);
 	}
-	pthread_cond_broadcast(&srv->reqcond);
 	(*srv->destroy)(srv);
 }
 
+/*
+ * Pick the home worker for a new connection.
+ */
+int
+np_srv_home(Npsrv *srv)
+{
+	int n;
+
+	n = __atomic_fetch_add(&srv->nexthome, 1, __ATOMIC_RELAXED);
+	return srv->nwthreads?n % srv->nwthreads:0;
+}
+
+/*
+ * Move a pending request to the working or the flushed state.
+ * Only one of the worker that took it from the queue and the
+ * flush or reset that cancels it succeeds.
+ */
+int
+np_req_claim(Npreq *req, int state)
+{
+	int pending;
+
+	pending = Reqpending;
+	return __atomic_compare_exchange_n(&req->state, &pending, state, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static int
+np_wthread_wake(Npwthread *wt)
+{
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&wt->lock);
+	if (wt->sleeping) {
+		__atomic_store_n(&wt->sleeping, 0, __ATOMIC_SEQ_CST);
+		__atomic_fetch_sub(&wt->srv->nsleeping, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&wt->cond);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&wt->lock);
+
+	return ret;
+}
+
+/*
+ * Metadata requests are small and often hold up an interactive
+ * client, they don't wait behind bulk reads and writes.
+ */
+static int
+np_req_class(Npreq *req)
+{
+	Npfcall *tc;
+
+	tc = req->tcall;
+	if (tc->id != Tread && tc->id != Twrite)
+		return Npclassmeta;
+
+	return tc->count <= Npsmallio ? Npclasssmall : Npclassbulk;
+}
+
+/*
+ * Queue requests for the workers, preferring the home worker's queue
+ * for their class. If all queues are full, wait for the workers to
+ * catch up. Then wake up the home worker, and as many idle workers as
+ * there are requests beyond the first one, so they can steal them.
+ */
+void
+np_srv_add_reqs(Npsrv *srv, int home, Npreq **reqs, int nreqs)
+{
+	int i, n, w, c;
+	u64 now;
+
+	assert(srv->nwthreads > 0);
+
+	now = np_nsec();
+	for(i = 0; i < nreqs; i++) {
+		w = home;
+		c = np_req_class(reqs[i]);
+		reqs[i]->qtime = now;
+		for(n = 0; !np_reqq_push(srv->wtab[w]->reqq[c], reqs[i]); n++) {
+			w = (w + 1) % srv->nwthreads;
+			if (n >= srv->nwthreads) {
+				sched_yield();
+				n = 0;
+			}
+		}
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	n = 0;
+	if (__atomic_load_n(&srv->wtab[home]->sleeping, __ATOMIC_SEQ_CST))
+		np_wthread_wake(srv->wtab[home]);
+
+	for(i = 1; i < srv->nwthreads && n < nreqs - 1; i++) {
+		if (!__atomic_load_n(&srv->nsleeping, __ATOMIC_SEQ_CST))
+			break;
+
+		w = (home + i) % srv->nwthreads;
+		if (__atomic_load_n(&srv->wtab[w]->sleeping, __ATOMIC_SEQ_CST))
+			n += np_wthread_wake(srv->wtab[w]);
+	}
+}
+
+/*
+ * Sum up the workers' queue statistics, for each request class.
+ */
+void
+np_srv_get_reqstats(Npsrv *srv, Npreqstat *stats)
+{
+	int i, c;
+	u64 max;
+	Npwthread *wt;
+	Npreqq *q;
+
+	memset(stats, 0, Npclasses * sizeof(*stats));
+	for(i = 0; i < srv->nwthreads; i++) {
+		wt = srv->wtab[i];
+		for(c = 0; c < Npclasses; c++) {
+			q = wt->reqq[c];
+			stats[c].depth += __atomic_load_n(&q->head, __ATOMIC_RELAXED) -
+				__atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+			stats[c].nreqs += __atomic_load_n(&wt->stats[c].nreqs,
+				__ATOMIC_RELAXED);
+			stats[c].waitsum += __atomic_load_n(&wt->stats[c].waitsum,
+				__ATOMIC_RELAXED);
+			max = __atomic_load_n(&wt->stats[c].waitmax, __ATOMIC_RELAXED);
+			if (max > stats[c].waitmax)
+				stats[c].waitmax = max;
+		}
+	}
+}
+
+/*
+ * Queue again a request that waited for a backend fd. A request on a
+ * coroutine goes back to the worker that owns the coroutine.
+ */
 void
-np_srv_remove_request(Npsrv *srv, Npreq *req)
+np_req_requeue(Npreq *req)
+{
+	Npwthread *wt;
+
+	wt = req->cowthread;
+	if (!wt) {
+		np_srv_add_reqs(req->conn->srv, req->conn->home, &req, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&wt->lock);
+	req->conext = NULL;
+	if (wt->coreadylast)
+		wt->coreadylast->conext = req;
+	else
+		__atomic_store_n(&wt->coready, req, __ATOMIC_RELEASE);
+	wt->coreadylast = req;
+
+	if (wt->sleeping) {
+		__atomic_store_n(&wt->sleeping, 0, __ATOMIC_SEQ_CST);
+		__atomic_fetch_sub(&wt->srv->nsleeping, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&wt->cond);
+	}
+	pthread_mutex_unlock(&wt->lock);
+}
+
+static Npreqq *
+np_reqq_create(int size)
+{
+	int i;
+	Npreqq *q;
+
+	q = malloc(sizeof(*q));
+	q->cells = malloc(size * sizeof(Npreqcell));
+	for(i = 0; i < size; i++)
+		q->cells[i].seq = i;
+
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = 0;
+
+	return q;
+}
+
+static int
+np_reqq_push(Npreqq *q, Npreq *req)
 {
-	if (req->prev)
-		req->prev->next = req->next;
+	u64 pos, seq;
+	Npreqcell *c;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	while (1) {
+		c = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t) (seq - pos) < 0)
+			return 0;	/* full */
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
 
-	if (req->next)
-		req->next->prev = req->prev;
+	c->req = req;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
 
-	if (req == srv->reqs_first)
-		srv->reqs_first = req->next;
+static Npreq *
+np_reqq_pop(Npreqq *q)
+{
+	u64 pos, seq;
+	Npreq *req;
+	Npreqcell *c;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	while (1) {
+		c = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t) (seq - (pos + 1)) < 0)
+			return NULL;	/* empty */
+		else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
 
-	if (req == srv->reqs_last)
-		srv->reqs_last = req->prev;
+	req = c->req;
+	__atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return req;
 }
 
 
 static void
 np_wthread_create(Npsrv *srv)
 {
-	int err;
+	int i, err;
 	Npwthread *wt;
 
 	wt = malloc(sizeof(*wt));
 	wt->srv = srv;
+	wt->id = srv->nwthreads;
 	wt->shutdown = 0;
-	err = pthread_create(&wt->thread, NULL, np_wthread_proc, wt);
-	if (err) {
-		fprintf(stderr, "can't create thread: %d\n", err);
-		return;
-	}
 	wt->errname = NULL;
 	wt->errcode = 0;
+	for(i = 0; i < Npclasses; i++)
+		wt->reqq[i] = np_reqq_create(Reqqsize);
+	wt->turn = 0;
+	memset(wt->stats, 0, sizeof(wt->stats));
+	wt->idle = 0;
+	pthread_mutex_init(&wt->lock, NULL);
+	pthread_cond_init(&wt->cond, NULL);
+	wt->sleeping = 0;
+	wt->coro = NULL;
+	wt->cofree = NULL;
+	wt->ncofree = 0;
+	wt->coready = NULL;
+	wt->coreadylast = NULL;
 
 	pthread_mutex_lock(&srv->lock);
 	wt->next = srv->wthreads;
 	srv->wthreads = wt;
+	srv->wtab[wt->id] = wt;
+	/* the workers already running steal from wtab without the lock */
+	__atomic_store_n(&srv->nwthreads, srv->nwthreads + 1, __ATOMIC_RELEASE);
 	pthread_mutex_unlock(&srv->lock);
+
+	err = pthread_create(&wt->thread, NULL, np_wthread_proc, wt);
+	if (err)
+		fprintf(stderr, "can't create thread: %d\n", err);
 }
 
 static Npfcall *
@@ -327,7 +721,7 @@ np_attach(Npreq *req, Npfcall *tc)
 		np_fid_incref(fid);
 
 	req->fid = fid;
-	afid = np_fid_find(conn, tc->afid);
+	afid = np_fid_get(conn, tc->afid);
 	if (!afid) {
 		if (tc->afid!=NOFID) {
 			np_werror(Eunknownfid, EIO);
@@ -338,8 +732,7 @@ np_attach(Npreq *req, Npfcall *tc)
 			np_werror(Ebadusefid, EIO);
 			goto done;
 		}
-	} else 
-		np_fid_incref(afid);
+	}
 
 	if (conn->srv->auth) {
 		rc = (*conn->srv->auth->attach)(afid, &tc->uname, &tc->aname);
@@ -348,6 +741,8 @@ np_attach(Npreq *req, Npfcall *tc)
 	}
 
 	rc = (*conn->srv->attach)(fid, afid, &tc->uname, &tc->aname);
+	if (rc && rc->id == Rattach)
+		fid->type = rc->qid.type;
 
 done:
 	np_fid_decref(fid);
@@ -362,38 +757,47 @@ np_flush(Npreq *req, Npfcall *tc)
 	Npreq *creq;
 	Npconn *conn;
 	Npfcall *ret;
+	Npreq *next, *wreq;
 
 	ret = NULL;
+	next = NULL;
+	wreq = NULL;
 	conn = req->conn;
 	oldtag = tc->oldtag;
-	pthread_mutex_lock(&conn->srv->lock);
-	// check pending requests
-	for(creq = conn->srv->reqs_first; creq != NULL; creq = creq->next) {
-		if (creq->conn==conn && creq->tag==oldtag) {
-			np_srv_remove_request(conn->srv, creq);
-			ret = np_create_rflush();
-			creq = NULL;
-			goto done;
-		}
-	}
+	pthread_mutex_lock(&conn->lock);
+	creq = np_conn_find_req(conn, oldtag);
+	if (creq == req)
+		creq = NULL;
 
-	// check working requests
-	creq = conn->srv->workreqs;
-	while (creq != NULL) {
-		if (creq->conn==conn && creq->tag==oldtag) {
-			req->flushreq = creq->flushreq;
-			creq->flushreq = req;
-			goto done;
-		}
-		creq = creq->next;
+	if (!creq) {
+		// if not found, return Rflush
+		ret = np_create_rflush();
+	} else if (np_req_waiting(creq)) {
+		// waiting for its turn, no worker has it
+		np_conn_remove_req(conn, creq);
+		np_fcall_free(creq->tcall);
+		reqfree(creq);
+		ret = np_create_rflush();
+		creq = NULL;
+	} else if (np_req_claim(creq, Reqflushed)) {
+		// still pending, the worker that gets it will drop it
+		next = np_conn_remove_req(conn, creq);
+		ret = np_create_rflush();
+		creq = NULL;
+	} else {
+		// working, respond when it is done
+		req->flushreq = creq->flushreq;
+		creq->flushreq = req;
+		wreq = np_req_cancel_wait(creq);
 	}
+	pthread_mutex_unlock(&conn->lock);
 
-	// if not found, return Rflush
-	if (!creq)
-		ret = np_create_rflush();
+	if (next)
+		np_srv_add_reqs(conn->srv, conn->home, &next, 1);
 
-done:
-	pthread_mutex_unlock(&conn->srv->lock);
+	// it was waiting for a backend fd, let the backend finish it
+	if (wreq)
+		np_req_requeue(wreq);
 
 	// if working request found, try to flush it
 	if (creq && req->conn->srv->flush)
@@ -414,12 +818,11 @@ np_walk(Npreq *req, Npfcall *tc)
 	rc = NULL;
 	conn = req->conn;
 	newfid = NULL;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto done;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
 	if (!fid->type&Qtdir) {
@@ -438,11 +841,15 @@ np_walk(Npreq *req, Npfcall *tc)
 	}
 
 	if (tc->fid != tc->newfid) {
-		newfid = np_fid_find(conn, tc->newfid);
-		if (newfid) {
+		if (np_fid_find(conn, tc->newfid)) {
 			np_werror(Einuse, EIO);
 			goto done;
 		}
+
+		/*
+		 * The new fid has no references until the walk is done,
+		 * np_fid_get does not give it to other requests before.
+		 */
 		newfid = np_fid_create(conn, tc->newfid, NULL);
 		if (!newfid) {
 			np_werror(Enomem, ENOMEM);
@@ -457,29 +864,43 @@ np_walk(Npreq *req, Npfcall *tc)
 	} else
 		newfid = fid;
 
-	np_fid_incref(newfid);
-	for(i = 0; i < tc->nwname;) {
-		if (!(*conn->srv->walk)(newfid, &tc->wnames[i], &wqids[i]))
-			break;
-
-		newfid->type = wqids[i].type;
-		i++;
-
-		if (i<(tc->nwname) && !newfid->type&Qtdir)
-			break;
+	if (conn->srv->walkpath && tc->nwname > 0) {
+		i = (*conn->srv->walkpath)(newfid, tc->nwname, tc->wnames,
+			wqids);
+		if (i > 0)
+			newfid->type = wqids[i - 1].type;
+	} else {
+		for(i = 0; i < tc->nwname;) {
+			if (!(*conn->srv->walk)(newfid, &tc->wnames[i],
+				&wqids[i]))
+				break;
+
+			newfid->type = wqids[i].type;
+			i++;
+
+			if (i<(tc->nwname) && !newfid->type&Qtdir)
+				break;
+		}
 	}
 
 	if (i==0 && tc->nwname!=0)
 		goto done;
 
 	np_werror(NULL, 0);
-	if (tc->fid != tc->newfid)
-		np_fid_incref(newfid);
 	rc = np_create_rwalk(i, wqids);
+	if (rc && newfid != fid) {
+		/* a walk that fails part of the way doesn't create newfid */
+		if (i < tc->nwname) {
+			np_fid_destroy(newfid);
+			newfid = NULL;
+		} else
+			__atomic_store_n(&newfid->refcount, 1, __ATOMIC_RELEASE);
+	}
 
 done:
+	if (!rc && newfid && newfid != fid)
+		np_fid_destroy(newfid);
 	np_fid_decref(fid);
-	np_fid_decref(newfid);
 	return rc;
 }
 
@@ -492,12 +913,11 @@ np_open(Npreq *req, Npfcall *tc)
 
 	rc = NULL;
 	conn = req->conn;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto done;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
 	if (fid->omode != (u16)~0) {
@@ -526,12 +946,11 @@ np_create(Npreq *req, Npfcall *tc)
 
 	rc = NULL;
 	conn = req->conn;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto done;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
 	if (fid->omode != (u16)~0) {
@@ -576,12 +995,11 @@ np_read(Npreq *req, Npfcall *tc)
 
 	rc = NULL;
 	conn = req->conn;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto error;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
 	if (tc->count+IOHDRSZ > conn->msize) {
@@ -590,12 +1008,14 @@ np_read(Npreq *req, Npfcall *tc)
 	}
 
 	if (fid->type&Qtauth) {
-		if (conn->srv->auth)
+		if (conn->srv->auth) {
 			rc = conn->srv->auth->read(fid, tc->offset, tc->count);
-		else
+			np_fid_decref(fid);
+			return rc;
+		} else {
 			np_werror(Ebadusefid, EIO);
-
-		goto error;
+			goto error;
+		}
 	}
 
 	if (fid->omode==(u16)~0 || (fid->omode&3)==Owrite) {
@@ -603,22 +1023,12 @@ np_read(Npreq *req, Npfcall *tc)
 		goto error;
 	}
 
-	if (fid->type&Qtdir && tc->offset != fid->diroffset) {
-		np_werror(Ebadoffset, EIO);
-		goto error;
-	}
-		
-	rc = (*conn->srv->read)(fid, tc->offset, tc->count, req);
-
-/*
-	if (rc && rc->id==Rread && fid->type&Qtdir) {
-		fid->diroffset = tc->offset + rc->count;
-	}
-*/
-	if (rc || np_haserror())
-		np_fid_decref(fid);
-
-	return rc;
+	/*
+	 * The backend checks directory offsets. It may respond later,
+	 * np_respond drops the fid.
+	 */
+	req->fidref = 1;
+	return (*conn->srv->read)(fid, tc->offset, tc->count, req);
 
 error:
 	np_fid_decref(fid);
@@ -634,12 +1044,11 @@ np_write(Npreq *req, Npfcall *tc)
 
 	rc = NULL;
 	conn = req->conn;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto error;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
 	if (fid->type&Qtauth) {
@@ -664,11 +1073,8 @@ np_write(Npreq *req, Npfcall *tc)
 		goto error;
 	}
 
-	rc = (*conn->srv->write)(fid, tc->offset, tc->count, tc->data, req);
-	if (rc || np_haserror())
-		np_fid_decref(fid);
-
-	return rc;
+	req->fidref = 1;
+	return (*conn->srv->write)(fid, tc->offset, tc->count, tc->data, req);
 
 error:
 	np_fid_decref(fid);
@@ -684,14 +1090,19 @@ np_clunk(Npreq *req, Npfcall *tc)
 
 	rc = NULL;
 	conn = req->conn;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto done;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
+	/* only one of concurrent clunks may drop the fid */
+	if (__atomic_exchange_n(&fid->clunked, 1, __ATOMIC_ACQ_REL)) {
+		np_werror(Eunknownfid, EIO);
+		goto done;
+	}
+
 	if (fid->type&Qtauth) {
 		if (conn->srv->auth)
 			rc = conn->srv->auth->clunk(fid);
@@ -705,7 +1116,7 @@ np_clunk(Npreq *req, Npfcall *tc)
 		rc = (*conn->srv->remove)(fid);
 		if (rc->id == Rerror)
 			goto done;
-		free(rc);
+		np_fcall_free(rc);
 		rc = np_create_rclunk();
 	} else
 		rc = (*conn->srv->clunk)(fid);
@@ -724,14 +1135,18 @@ np_remove(Npreq *req, Npfcall *tc)
 
 	rc = NULL;
 	conn = req->conn;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto done;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
+	if (__atomic_exchange_n(&fid->clunked, 1, __ATOMIC_ACQ_REL)) {
+		np_werror(Eunknownfid, EIO);
+		goto done;
+	}
+
 	rc = (*conn->srv->remove)(fid);
 done:
 	np_fid_decref(fid);
@@ -747,12 +1162,11 @@ np_stat(Npreq *req, Npfcall *tc)
 
 	rc = NULL;
 	conn = req->conn;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto done;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
 	rc = (*conn->srv->stat)(fid);
@@ -773,12 +1187,11 @@ np_wstat(Npreq *req, Npfcall *tc)
 	rc = NULL;
 	conn = req->conn;
 	stat = &tc->stat;
-	fid = np_fid_find(conn, tc->fid);
+	fid = np_fid_get(conn, tc->fid);
 	if (!fid) {
 		np_werror(Eunknownfid, EIO);
 		goto done;
-	} else 
-		np_fid_incref(fid);
+	}
 
 	req->fid = fid;
 	if (stat->type != (u16)~0 || stat->dev != (u32)~0
@@ -800,96 +1213,579 @@ done:
 	return rc;
 }
 
-typedef Npfcall* (*np_fcall)(Npreq *, Npfcall *);
-static np_fcall np_fcalls[] = {
-	np_version,
-	np_auth,
-	np_attach,
-	NULL,
-	np_flush,
-	np_walk,
-	np_open,
-	np_create,
-	np_read,
-	np_write,
-	np_clunk,
-	np_remove,
-	np_stat,
-	np_wstat,
-};
-
-static Npfcall*
-np_process_request(Npreq *req)
+static Npfcall *
+np_statfs(Npreq *req, Npfcall *tc)
 {
 	Npconn *conn;
-	Npfcall *tc, *rc;
-	np_fcall f;
-	char *ename;
-	int ecode;
+	Npfid *fid;
+	Npfcall *rc;
 
-	conn = req->conn;
 	rc = NULL;
-	tc = req->tcall;
-
-	f = NULL;
-	if (tc->id<Tfirst && tc->id>Rlast)
-		np_werror("unknown message type", ENOSYS);
-	else {
-	  //	  printf("MAINLOOP rcvd msg of type <%d>\n",tc->id);
-	  f = np_fcalls[(tc->id-Tfirst)/2];
+	conn = req->conn;
+	fid = np_fid_get(conn, tc->fid);
+	if (!fid) {
+		np_werror(Eunknownfid, EIO);
+		goto done;
 	}
 
-	np_werror(NULL, 0);
-	if (f)
-		rc = (*f)(req, tc);
+	req->fid = fid;
+	rc = (*conn->srv->statfs)(fid);
+
+done:
+	np_fid_decref(fid);
+	return rc;
+}
+
+/* the 9P open mode of 9P2000.L open flags */
+static u8
+np_lflags2mode(u32 flags)
+{
+	u8 mode;
+
+	mode = flags & 3;
+	if (flags & Lotrunc)
+		mode |= Otrunc;
+	if (flags & Loappend)
+		mode |= Oappend;
+
+	return mode;
+}
+
+static Npfcall *
+np_lopen(Npreq *req, Npfcall *tc)
+{
+	u8 mode;
+	Npconn *conn;
+	Npfid *fid;
+	Npfcall *rc;
+
+	rc = NULL;
+	conn = req->conn;
+	fid = np_fid_get(conn, tc->fid);
+	if (!fid) {
+		np_werror(Eunknownfid, EIO);
+		goto done;
+	}
+
+	req->fid = fid;
+	if (fid->omode != (u16)~0) {
+		np_werror(Ebadusefid, EIO);
+		goto done;
+	}
+
+	mode = np_lflags2mode(tc->flags);
+	if (fid->type&Qtdir && mode != Oread) {
+		np_werror(Eperm, EISDIR);
+		goto done;
+	}
+
+	rc = (*conn->srv->lopen)(fid, mode, tc->flags);
+	if (rc && rc->id == Rlopen)
+		fid->omode = mode;
+done:
+	np_fid_decref(fid);
+	return rc;
+}
+
+static Npfcall *
+np_lcreate(Npreq *req, Npfcall *tc)
+{
+	u8 mode;
+	Npconn *conn;
+	Npfid *fid;
+	Npfcall *rc;
+
+	rc = NULL;
+	conn = req->conn;
+	fid = np_fid_get(conn, tc->fid);
+	if (!fid) {
+		np_werror(Eunknownfid, EIO);
+		goto done;
+	}
+
+	req->fid = fid;
+	if (fid->omode != (u16)~0) {
+		np_werror(Ebadusefid, EIO);
+		goto done;
+	}
+
+	if (!(fid->type&Qtdir)) {
+		np_werror(Enotdir, ENOTDIR);
+		goto done;
+	}
+
+	/* only regular files, the permissions are all of the mode */
+	mode = np_lflags2mode(tc->flags);
+	rc = (*conn->srv->lcreate)(fid, &tc->name, tc->perm & 0777, mode,
+		tc->flags, tc->gid);
+	if (rc && rc->id == Rlcreate) {
+		fid->omode = mode;
+		fid->type = rc->qid.type;
+	}
+
+done:
+	np_fid_decref(fid);
+	return rc;
+}
+
+static Npfcall *
+np_getattr(Npreq *req, Npfcall *tc)
+{
+	Npconn *conn;
+	Npfid *fid;
+	Npfcall *rc;
+
+	rc = NULL;
+	conn = req->conn;
+	fid = np_fid_get(conn, tc->fid);
+	if (!fid) {
+		np_werror(Eunknownfid, EIO);
+		goto done;
+	}
+
+	req->fid = fid;
+	rc = (*conn->srv->getattr)(fid, tc->mask);
+
+done:
+	np_fid_decref(fid);
+	return rc;
+}
+
+/*
+ * The offset is a cookie the backend handed out with an earlier
+ * entry, any of them may be passed.
+ */
+static Npfcall *
+np_readdir(Npreq *req, Npfcall *tc)
+{
+	Npconn *conn;
+	Npfid *fid;
+
+	conn = req->conn;
+	fid = np_fid_get(conn, tc->fid);
+	if (!fid) {
+		np_werror(Eunknownfid, EIO);
+		goto error;
+	}
+
+	req->fid = fid;
+	if (tc->count+IOHDRSZ > conn->msize) {
+		np_werror(Etoolarge, EIO);
+		goto error;
+	}
+
+	if (fid->omode==(u16)~0 || !(fid->type&Qtdir)) {
+		np_werror(Ebadusefid, EIO);
+		goto error;
+	}
+
+	req->fidref = 1;
+	return (*conn->srv->readdir)(fid, tc->offset, tc->count, req);
+
+error:
+	np_fid_decref(fid);
+	return NULL;
+}
+
+static Npfcall *
+np_lfsync(Npreq *req, Npfcall *tc)
+{
+	Npconn *conn;
+	Npfid *fid;
+	Npfcall *rc;
+
+	rc = NULL;
+	conn = req->conn;
+	fid = np_fid_get(conn, tc->fid);
+	if (!fid) {
+		np_werror(Eunknownfid, EIO);
+		goto done;
+	}
+
+	req->fid = fid;
+	rc = (*conn->srv->fsync)(fid, tc->datasync);
+
+done:
+	np_fid_decref(fid);
+	return rc;
+}
+
+typedef Npfcall* (*np_fcall)(Npreq *, Npfcall *);
+static np_fcall np_fcalls[] = {
+	np_version,
+	np_auth,
+	np_attach,
+	NULL,
+	np_flush,
+	np_walk,
+	np_open,
+	np_create,
+	np_read,
+	np_write,
+	np_clunk,
+	np_remove,
+	np_stat,
+	np_wstat,
+};
+
+/* 9P2000.L messages, by id / 2, only for the connections that speak it */
+static np_fcall np_lfcalls[] = {
+	[Tstatfs/2] = np_statfs,
+	[Tlopen/2] = np_lopen,
+	[Tlcreate/2] = np_lcreate,
+	[Tgetattr/2] = np_getattr,
+	[Treaddir/2] = np_readdir,
+	[Tfsync/2] = np_lfsync,
+};
+
+/*
+ * Call the function a request waited for and respond like
+ * np_process_request does.
+ */
+static void
+np_resume_request(Npreq *req)
+{
+	int ecode;
+	char *ename;
+	void *aux;
+	Npfcall *rc, *(*fn)(Npreq *, void *);
+
+	fn = req->resume;
+	aux = req->resumeaux;
+	req->resume = NULL;
+	req->resumeaux = NULL;
+
+	np_werror(NULL, 0);
+	rc = (*fn)(req, aux);
+	np_rerror(&ename, &ecode);
+	if (ename != NULL) {
+		np_fcall_free(rc);
+		rc = np_conn_rerror(req->conn, ename, ecode);
+	}
+
+	if (rc)
+		np_respond(req, rc);
+}
+
+static Npfcall*
+np_process_request(Npreq *req)
+{
+	Npconn *conn;
+	Npfcall *tc, *rc;
+	np_fcall f;
+	char *ename;
+	int ecode;
+
+	conn = req->conn;
+	rc = NULL;
+	tc = req->tcall;
+
+	f = NULL;
+	if (tc->id>=Tfirst && tc->id<Rlast)
+		f = np_fcalls[(tc->id-Tfirst)/2];
+	else if (conn->dotl && tc->id/2 < sizeof(np_lfcalls)/sizeof(np_lfcalls[0]))
+		f = np_lfcalls[tc->id/2];
+
+	np_werror(NULL, 0);
+	if (f)
+		rc = (*f)(req, tc);
 	else
 		np_werror("unsupported message", ENOSYS);
 
 	np_rerror(&ename, &ecode);
 	if (ename != NULL) {
 		if (rc)
-			free(rc);
-		rc = np_create_rerror(ename, ecode, conn->dotu);
+			np_fcall_free(rc);
+		rc = np_conn_rerror(conn, ename, ecode);
 	}
 
 	return rc;
 }
 
+#ifdef HAVE_UCONTEXT_H
+static Npcoro *
+np_coro_alloc(Npwthread *wt)
+{
+	size_t pgsz;
+	Npcoro *co;
+
+	co = wt->cofree;
+	if (co) {
+		wt->cofree = co->next;
+		wt->ncofree--;
+		return co;
+	}
+
+	co = malloc(sizeof(*co));
+	if (!co)
+		return NULL;
+
+	pgsz = sysconf(_SC_PAGESIZE);
+	co->stacksize = (wt->srv->costack + pgsz - 1) & ~(pgsz - 1);
+	co->stack = mmap(NULL, co->stacksize + pgsz, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (co->stack == MAP_FAILED) {
+		free(co);
+		return NULL;
+	}
+
+	mprotect(co->stack, pgsz, PROT_NONE);
+	return co;
+}
+
+static void
+np_coro_free(Npwthread *wt, Npcoro *co)
+{
+	if (wt->ncofree < Cofreemax) {
+		co->next = wt->cofree;
+		wt->cofree = co;
+		wt->ncofree++;
+		return;
+	}
+
+	munmap(co->stack, co->stacksize + sysconf(_SC_PAGESIZE));
+	free(co);
+}
+
+static void
+np_coro_main(void)
+{
+	Npwthread *wt;
+	Npcoro *co;
+
+	wt = pthread_getspecific(wthread_key);
+	co = wt->coro;
+	co->rc = np_process_request(co->req);
+	co->done = 1;
+	setcontext(&co->wctx);
+}
+
+/*
+ * Switch to the request's coroutine until it finishes or waits for
+ * an fd. Returns the response if it finished.
+ */
+static Npfcall *
+np_coro_switch(Npreq *req, void *a)
+{
+	Npcoro *co;
+	Npwthread *wt;
+	Npfcall *rc;
+
+	co = a;
+	wt = req->cowthread;
+	wt->errname = co->errname;
+	wt->errcode = co->errcode;
+	wt->coro = co;
+	swapcontext(&co->wctx, &co->ctx);
+	wt->coro = NULL;
+	co->errname = wt->errname;
+	co->errcode = wt->errcode;
+	np_werror(NULL, 0);
+
+	if (!co->done)
+		return NULL;
+
+	rc = co->rc;
+	np_coro_free(wt, co);
+	return rc;
+}
+
+static Npfcall *
+np_coro_start(Npwthread *wt, Npreq *req, int *ok)
+{
+	Npcoro *co;
+
+	co = np_coro_alloc(wt);
+	if (!co) {
+		*ok = 0;
+		return NULL;
+	}
+
+	getcontext(&co->ctx);
+	co->ctx.uc_stack.ss_sp = co->stack + sysconf(_SC_PAGESIZE);
+	co->ctx.uc_stack.ss_size = co->stacksize;
+	co->ctx.uc_link = NULL;
+	makecontext(&co->ctx, np_coro_main, 0);
+	co->req = req;
+	co->rc = NULL;
+	co->done = 0;
+	co->errname = NULL;
+	co->errcode = 0;
+
+	*ok = 1;
+	req->cowthread = wt;
+	return np_coro_switch(req, co);
+}
+#endif
+
+static Npfcall *
+np_run_request(Npwthread *wt, Npreq *req)
+{
+#ifdef HAVE_UCONTEXT_H
+	int ok;
+	Npfcall *rc;
+
+	if (wt->srv->costack) {
+		rc = np_coro_start(wt, req, &ok);
+		if (ok)
+			return rc;
+	}
+#endif
+
+	return np_process_request(req);
+}
+
+static Npreq *
+np_wthread_pop(Npwthread *wt, Npreqq *q, int c)
+{
+	u64 now, wait;
+	Npreq *req;
+	Npreqstat *st;
+
+	req = np_reqq_pop(q);
+	if (!req)
+		return NULL;
+
+	/* only this worker writes its statistics */
+	st = &wt->stats[c];
+	now = np_nsec();
+	wait = now - req->qtime;
+	if (!req->dtime)
+		req->dtime = now;
+	__atomic_store_n(&st->nreqs, st->nreqs + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->waitsum, st->waitsum + wait, __ATOMIC_RELAXED);
+	if (wait > st->waitmax)
+		__atomic_store_n(&st->waitmax, wait, __ATOMIC_RELAXED);
+
+	return req;
+}
+
+/*
+ * Get a coroutine that is ready to go on, or a request. The classes
+ * take turns in proportion to their weights, the one whose turn it is
+ * is looked at first, then the others from metadata to bulk. For each
+ * class, the worker's own queue comes first, then it steals from the
+ * other workers.
+ */
+static Npreq *
+np_wthread_getreq(Npwthread *wt)
+{
+	int i, n, c, k, turn, total;
+	Npreq *req;
+	Npsrv *srv;
+
+	srv = wt->srv;
+	req = NULL;
+	if (__atomic_load_n(&wt->coready, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&wt->lock);
+		req = wt->coready;
+		if (req) {
+			__atomic_store_n(&wt->coready, req->conext,
+				__ATOMIC_RELAXED);
+			if (!wt->coready)
+				wt->coreadylast = NULL;
+		}
+		pthread_mutex_unlock(&wt->lock);
+	}
+
+	if (req)
+		return req;
+
+	total = 0;
+	for(c = 0; c < Npclasses; c++)
+		total += srv->weight[c];
+
+	turn = Npclassmeta;
+	if (total > 0) {
+		k = wt->turn++ % total;
+		for(turn = 0; turn < Npclasses - 1; turn++) {
+			k -= srv->weight[turn];
+			if (k < 0)
+				break;
+		}
+	}
+
+	for(k = -1; !req && k < Npclasses; k++) {
+		c = k < 0 ? turn : k;
+		if (k == turn)
+			continue;
+
+		req = np_wthread_pop(wt, wt->reqq[c], c);
+		n = __atomic_load_n(&srv->nwthreads, __ATOMIC_ACQUIRE);
+		for(i = 1; !req && i < n; i++)
+			req = np_wthread_pop(wt,
+				srv->wtab[(wt->id + i) % n]->reqq[c], c);
+	}
+
+	return req;
+}
+
 static void *
 np_wthread_proc(void *a)
 {
+	u64 t;
 	Npwthread *wt;
-	Npsrv *srv;
 	Npreq *req;
 	Npfcall *rc;
 
 	wt = a;
-	srv = wt->srv;
-	req = NULL;
-
 	pthread_setspecific(wthread_key, a);
-	pthread_mutex_lock(&srv->lock);
 	while (!wt->shutdown) {
-		req = srv->reqs_first;
+		req = np_wthread_getreq(wt);
 		if (!req) {
-			pthread_cond_wait(&srv->reqcond, &srv->lock);
+			/*
+			 * Announce that we are going to sleep before
+			 * looking at the queues for the last time, so
+			 * np_srv_add_reqs either sees the flag or we see
+			 * its request.
+			 */
+			pthread_mutex_lock(&wt->lock);
+			__atomic_store_n(&wt->sleeping, 1, __ATOMIC_SEQ_CST);
+			__atomic_fetch_add(&wt->srv->nsleeping, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&wt->lock);
+
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			req = np_wthread_getreq(wt);
+
+			pthread_mutex_lock(&wt->lock);
+			if (req && wt->sleeping) {
+				__atomic_store_n(&wt->sleeping, 0,
+					__ATOMIC_SEQ_CST);
+				__atomic_fetch_sub(&wt->srv->nsleeping, 1,
+					__ATOMIC_SEQ_CST);
+			}
+
+			if (!req && wt->sleeping && !wt->shutdown) {
+				t = np_nsec();
+				while (!req && wt->sleeping && !wt->shutdown)
+					pthread_cond_wait(&wt->cond, &wt->lock);
+				__atomic_store_n(&wt->idle,
+					wt->idle + np_nsec() - t, __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock(&wt->lock);
+
+			if (!req)
+				continue;
+		}
+
+		if (req->resume) {
+			// back from np_req_wait_fd
+			req->wthread = wt;
+			np_resume_request(req);
 			continue;
 		}
 
-		np_srv_remove_request(srv, req);
-		if (srv->workreqs)
-			srv->workreqs->prev = req;
-		req->next = srv->workreqs;
-		srv->workreqs = req;
-		req->prev = NULL;
-		req->wthread = a;
-		pthread_mutex_unlock(&srv->lock);
+		if (!np_req_claim(req, Reqworking)) {
+			// flushed while waiting in the queue
+			np_fcall_free(req->tcall);
+			reqfree(req);
+			continue;
+		}
 
-		rc = np_process_request(req);
+		req->wthread = wt;
+		rc = np_run_request(wt, req);
 		if (rc)
 			np_respond(req, rc);
-
-		pthread_mutex_lock(&srv->lock);
 	}
 
 	return NULL;
@@ -898,55 +1794,85 @@ np_wthread_proc(void *a)
 void
 np_respond(Npreq *req, Npfcall *rc)
 {
-	Npsrv *srv;
-	Npreq *freq, *freq1;
+	int kick, debug;
+	Npreq *freq, *freq1, *next;
 	Npconn *conn;
 
 	req->rcall = rc;
-	srv = req->conn->srv;
-
-	pthread_mutex_lock(&srv->lock);
-	if (req->prev)
-		req->prev->next = req->next;
-	else
-		srv->workreqs = req->next;
+	conn = req->conn;
 
-	if (req->next)
-		req->next->prev = req->prev;
+	/* before the client can see the reply and clunk the fid */
+	if (req->fidref)
+		np_fid_decref(req->fid);
 
-	/* remove the flush requests from the working queue */
-	for(freq = req->flushreq; freq != NULL; freq = freq->flushreq) {
-		if (freq->prev)
-			freq->prev->next = freq->next;
-		else
-			srv->workreqs = freq->next;
+	np_stats_reply(req, req->rcall);
 
-		if (freq->next)
-			freq->next->prev = freq->prev;
+	if (req->rcall) {
+		np_set_tag(req->rcall, req->tag);
+		if (np_tracing)
+			np_trace(conn, req->rcall, req->tcall->fid,
+				np_nsec() - req->rtime);
 	}
-	pthread_mutex_unlock(&srv->lock);
 
+	/*
+	 * Remove the request and the flushes waiting for it, and queue
+	 * the replies before the lock is released. A flush that finds
+	 * the tag free sends its Rflush right away, the reply has to
+	 * be ahead of it.
+	 */
+	kick = 0;
+	debug = conn->srv->debuglevel;
+	pthread_mutex_lock(&conn->lock);
+	next = np_conn_remove_req(conn, req);
 	if (req->rcall) {
-		if (req->rcall->id==Rread && req->fid->type&Qtdir)
-			req->fid->diroffset = req->tcall->offset + req->rcall->count;
+		// once queued, the reply is freed when it is sent
+		if (debug)
+			np_fcall_incref(req->rcall);
+		kick = np_conn_queue_fcall(conn, req->rcall);
+	}
 
-		np_set_tag(req->rcall, req->tag);
-		np_conn_send_fcall(req->conn, req->rcall);
+	for(freq = req->flushreq; freq != NULL; freq = freq->flushreq) {
+		np_conn_remove_req(conn, freq);
+		rc = np_create_rflush();
+		np_set_tag(rc, freq->tag);
+		if (np_tracing)
+			np_trace(conn, rc, NOFID, np_nsec() - freq->rtime);
+		freq->rcall = rc;
+		if (debug)
+			np_fcall_incref(rc);
+		kick |= np_conn_queue_fcall(conn, rc);
 	}
+	pthread_mutex_unlock(&conn->lock);
+
+	if (kick)
+		np_trans_set_txbuf(conn->trans, &conn->wbuf);
+
+	// print the replies without holding up the connection
+	if (debug) {
+		if (req->rcall) {
+			np_conn_print_fcall(conn, req->rcall);
+			np_fcall_free(req->rcall);
+		}
+
+		for(freq = req->flushreq; freq != NULL; freq = freq->flushreq) {
+			np_conn_print_fcall(conn, freq->rcall);
+			np_fcall_free(freq->rcall);
+		}
+	}
+
+	/* the next request in order may run, its reply goes after this one */
+	if (next)
+		np_srv_add_reqs(conn->srv, conn->home, &next, 1);
 
 	freq = req->flushreq;
 	while (freq != NULL) {
-		rc = np_create_rflush();
-		np_set_tag(rc, freq->tag);
-		conn = freq->conn;
-		np_conn_send_fcall(freq->conn, rc);
 		freq1 = freq->flushreq;
-		np_conn_free_rcall(freq->conn, freq->tcall);
+		np_fcall_free(freq->tcall);
 		reqfree(freq);
 		freq = freq1;
 	}
 
-	np_conn_free_rcall(req->conn, req->tcall);
+	np_fcall_free(req->tcall);
 	reqfree(req);
 }
 
@@ -955,14 +1881,26 @@ np_respond_error(Npreq *req, char *ename, int ecode)
 {
 	Npfcall *rc;
 
-	rc = np_create_rerror(ename, ecode, req->conn->dotu);
+	rc = np_conn_rerror(req->conn, ename, ecode);
 	np_respond(req, rc);
 }
 
+/*
+ * Keep the message of the request after it is done, for example to
+ * queue the data of a Twrite without copying it. The data stays in
+ * place until the caller frees the message with np_fcall_free.
+ */
+Npfcall *
+np_req_keep_tcall(Npreq *req)
+{
+	np_fcall_incref(req->tcall);
+	return req->tcall;
+}
+
 static Npfcall*
 np_default_version(Npconn *conn, u32 msize, Npstr *version) 
 {
-	int dotu;
+	int dotu, dotl;
 	char *ver;
 	Npfcall *rc;
 
@@ -970,7 +1908,11 @@ np_default_version(Npconn *conn, u32 msize, Npstr *version)
 		msize = conn->srv->msize;
 
 	dotu = 0;
-	if (np_strcmp(version, "9P2000.u")==0 && conn->srv->dotu) {
+	dotl = 0;
+	if (np_strcmp(version, "9P2000.L")==0 && conn->srv->dotl) {
+		ver = "9P2000.L";
+		dotl = 1;
+	} else if (np_strcmp(version, "9P2000.u")==0 && conn->srv->dotu) {
 		ver = "9P2000.u";
 		dotu = 1;
 	} else if (np_strncmp(version, "9P2000", 6) == 0)
@@ -981,7 +1923,7 @@ np_default_version(Npconn *conn, u32 msize, Npstr *version)
 	if (msize < IOHDRSZ)
 		np_werror("msize too small", EIO);
 	else if (ver) {
-		np_conn_reset(conn, msize, dotu);
+		np_conn_reset(conn, msize, dotu, dotl);
 		rc = np_create_rversion(msize, ver);
 	} else
 		np_werror("unsupported 9P version", EIO);
@@ -1071,6 +2013,119 @@ np_default_wstat(Npfid *fid, Npstat *stat)
 	return NULL;
 }
 
+/* synthetic trees have no blocks to count */
+static Npfcall*
+np_default_statfs(Npfid *fid)
+{
+	Npstatfs statfs;
+
+	memset(&statfs, 0, sizeof(statfs));
+	statfs.type = 0x01021997;	/* V9FS_MAGIC */
+	statfs.bsize = fid->conn->msize - IOHDRSZ;
+	statfs.namelen = 255;
+
+	return np_create_rstatfs(&statfs);
+}
+
+static Npfcall*
+np_default_lopen(Npfid *fid, u8 mode, u32 flags)
+{
+	Npfcall *rc, *rc1;
+
+	rc = (*fid->conn->srv->open)(fid, mode);
+	if (!rc || rc->id != Ropen)
+		return rc;
+
+	rc1 = np_create_rlopen(&rc->qid, rc->iounit);
+	np_fcall_free(rc);
+	return rc1;
+}
+
+static Npfcall*
+np_default_lcreate(Npfid *fid, Npstr *name, u32 perm, u8 mode, u32 flags,
+	u32 gid)
+{
+	Npstr ext;
+	Npfcall *rc, *rc1;
+
+	ext.len = 0;
+	ext.str = NULL;
+	rc = (*fid->conn->srv->create)(fid, name, perm, mode, &ext);
+	if (!rc || rc->id != Rcreate)
+		return rc;
+
+	rc1 = np_create_rlcreate(&rc->qid, rc->iounit);
+	np_fcall_free(rc);
+	return rc1;
+}
+
+/* the attributes that a stat has, it has no numeric ids in 9P2000 */
+static Npfcall*
+np_default_getattr(Npfid *fid, u64 mask)
+{
+	Npattr attr;
+	Npstat *st;
+	Npfcall *rc, *rc1;
+
+	rc = (*fid->conn->srv->stat)(fid);
+	if (!rc || rc->id != Rstat)
+		return rc;
+
+	st = &rc->stat;
+	memset(&attr, 0, sizeof(attr));
+	attr.valid = Gamode | Ganlink | Gaatime | Gamtime | Gactime | Gaino
+		| Gasize | Gablocks;
+	attr.qid = st->qid;
+	attr.mode = np_mode2lmode(st->mode);
+	attr.nlink = 1;
+	attr.size = st->length;
+	attr.blksize = fid->conn->msize - IOHDRSZ;
+	attr.blocks = (st->length + 511) / 512;
+	attr.atime_sec = st->atime;
+	attr.mtime_sec = st->mtime;
+	attr.ctime_sec = st->mtime;
+
+	rc1 = np_create_rgetattr(&attr);
+	np_fcall_free(rc);
+	return rc1;
+}
+
+static Npfcall*
+np_default_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req)
+{
+	np_werror(Enotimpl, ENOSYS);
+	return NULL;
+}
+
+/* a wstat that changes nothing asks 9P2000 servers to sync the file */
+static Npfcall*
+np_default_fsync(Npfid *fid, int datasync)
+{
+	Npstat stat;
+	Npfcall *rc;
+
+	memset(&stat, 0, sizeof(stat));
+	stat.type = ~0;
+	stat.dev = ~0;
+	stat.qid.type = ~0;
+	stat.qid.version = ~0;
+	stat.qid.path = ~0;
+	stat.mode = ~0;
+	stat.atime = ~0;
+	stat.mtime = ~0;
+	stat.length = ~0;
+	stat.n_uid = ~0;
+	stat.n_gid = ~0;
+	stat.n_muid = ~0;
+
+	rc = (*fid->conn->srv->wstat)(fid, &stat);
+	if (!rc || rc->id != Rwstat)
+		return rc;
+
+	np_fcall_free(rc);
+	return np_create_rfsync();
+}
+
 Npreq *reqalloc() {
 	Npreq *req;
 
@@ -1091,7 +2146,19 @@ Npreq *reqalloc() {
 	req->tcall = NULL;
 	req->rcall = NULL;
 	req->cancelled = 0;
+	req->state = Reqpending;
 	req->flushreq = NULL;
+	req->fid = NULL;
+	req->fidref = 0;
+	req->wait = NULL;
+	req->resume = NULL;
+	req->resumeaux = NULL;
+	req->cowthread = NULL;
+	req->conext = NULL;
+	req->order = NULL;
+	req->onext = NULL;
+	req->rtime = 0;
+	req->dtime = 0;
 	req->next = NULL;
 	req->prev = NULL;
 	req->wthread = NULL;
@@ -0,0 +1,449 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+typedef struct Npstatblk Npstatblk;
+
+/*
+ * Message counters and latency histograms. Each thread that receives
+ * or replies to messages has its own block of counters, and is the
+ * only one that writes to it, so counting takes no locks and no
+ * atomic read-modify-write. Readers add up all the blocks. The block
+ * of a thread that exits is reused by the next new one, its counts go
+ * on adding up.
+ *
+ * The histograms count latencies in units of 128 ns. Each power of
+ * two is split in Nphistsub buckets, the error is at most 1/Nphistsub.
+ */
+struct Npstatblk {
+	Npopstats	op[Npstatops];
+	int		inuse;
+	Npstatblk*	next;
+};
+
+enum {
+	Histshift	= 7,	/* ns of the histogram unit */
+};
+
+static pthread_key_t statblk_key;
+static pthread_once_t statblk_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t statblk_lock = PTHREAD_MUTEX_INITIALIZER;
+static Npstatblk *statblks;
+
+static char *opnames[Npstatops] = {
+	[Tversion/2] = "version",
+	[Tauth/2] = "auth",
+	[Tattach/2] = "attach",
+	[Tflush/2] = "flush",
+	[Twalk/2] = "walk",
+	[Topen/2] = "open",
+	[Tcreate/2] = "create",
+	[Tread/2] = "read",
+	[Twrite/2] = "write",
+	[Tclunk/2] = "clunk",
+	[Tremove/2] = "remove",
+	[Tstat/2] = "stat",
+	[Twstat/2] = "wstat",
+	[Tstatfs/2] = "statfs",
+	[Tlopen/2] = "lopen",
+	[Tlcreate/2] = "lcreate",
+	[Tgetattr/2] = "getattr",
+	[Treaddir/2] = "readdir",
+	[Tfsync/2] = "fsync",
+};
+
+static char *classnames[Npclasses] = {
+	[Npclassmeta] = "meta",
+	[Npclasssmall] = "small",
+	[Npclassbulk] = "bulk",
+};
+
+u64
+np_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+np_statblk_release(void *a)
+{
+	Npstatblk *b;
+
+	b = a;
+	pthread_mutex_lock(&statblk_lock);
+	b->inuse = 0;
+	pthread_mutex_unlock(&statblk_lock);
+}
+
+static void
+np_statblk_init(void)
+{
+	pthread_key_create(&statblk_key, np_statblk_release);
+}
+
+static Npstatblk *
+np_statblk(void)
+{
+	Npstatblk *b;
+
+	pthread_once(&statblk_once, np_statblk_init);
+	b = pthread_getspecific(statblk_key);
+	if (b)
+		return b;
+
+	pthread_mutex_lock(&statblk_lock);
+	for(b = statblks; b != NULL; b = b->next)
+		if (!b->inuse)
+			break;
+
+	if (!b) {
+		b = calloc(1, sizeof(*b));
+		if (b) {
+			b->next = statblks;
+			statblks = b;
+		}
+	}
+
+	if (b)
+		b->inuse = 1;
+	pthread_mutex_unlock(&statblk_lock);
+
+	if (b)
+		pthread_setspecific(statblk_key, b);
+
+	return b;
+}
+
+static inline void
+np_stat_add(u64 *p, u64 n)
+{
+	__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static int
+np_hist_bucket(u64 ns)
+{
+	int e, b;
+	u64 v;
+
+	v = ns >> Histshift;
+	if (v < Nphistsub)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	b = (e - 1) * Nphistsub + ((v >> (e - 2)) & (Nphistsub - 1));
+	return b < Nphistbuckets ? b : Nphistbuckets - 1;
+}
+
+/* the smallest latency counted in bucket b, ns */
+static u64
+np_hist_lower(int b)
+{
+	int e;
+
+	if (b < Nphistsub)
+		return (u64) b << Histshift;
+
+	e = b / Nphistsub + 1;
+	return ((u64) (Nphistsub + b % Nphistsub) << (e - 2)) << Histshift;
+}
+
+/*
+ * Latency below which a fraction q of the histogram's counts are.
+ * Returns the top of the bucket the q quantile falls into.
+ */
+u64
+np_hist_quantile(u64 *hist, double q)
+{
+	int b;
+	u64 n, sum, want;
+
+	n = 0;
+	for(b = 0; b < Nphistbuckets; b++)
+		n += hist[b];
+
+	if (!n)
+		return 0;
+
+	want = q * n;
+	if (want >= n)
+		want = n - 1;
+
+	sum = 0;
+	for(b = 0; b < Nphistbuckets - 1; b++) {
+		sum += hist[b];
+		if (sum > want)
+			break;
+	}
+
+	return np_hist_lower(b + 1) - 1;
+}
+
+/*
+ * Count an incoming message.
+ */
+void
+np_stats_in(Npfcall *tc)
+{
+	Npstatblk *b;
+
+	b = np_statblk();
+	if (b)
+		np_stat_add(&b->op[(tc->id / 2) % Npstatops].bytesin, tc->size);
+}
+
+/*
+ * Count the reply to a request, and how long the request took from
+ * when it was received and when it got to a worker.
+ */
+void
+np_stats_reply(Npreq *req, Npfcall *rc)
+{
+	u64 now;
+	Npstatblk *b;
+	Npopstats *op;
+
+	b = np_statblk();
+	if (!b)
+		return;
+
+	now = np_nsec();
+	op = &b->op[(req->tcall->id / 2) % Npstatops];
+	np_stat_add(&op->nmsgs, 1);
+	if (rc) {
+		np_stat_add(&op->bytesout, rc->size);
+		if (rc->id == Rerror || rc->id == Rlerror)
+			np_stat_add(&op->nerrors, 1);
+	}
+
+	if (req->dtime)
+		np_stat_add(&op->svc[np_hist_bucket(now - req->dtime)], 1);
+	if (req->rtime)
+		np_stat_add(&op->total[np_hist_bucket(now - req->rtime)], 1);
+}
+
+/*
+ * Take a snapshot of the counters: the message counts of the whole
+ * process, the queues and the workers of srv.
+ */
+void
+np_srv_get_stats(Npsrv *srv, Npstats *st)
+{
+	int i, j;
+	u64 idle;
+	Npstatblk *b;
+	Npopstats *op, *bop;
+
+	memset(st, 0, sizeof(*st));
+	pthread_mutex_lock(&statblk_lock);
+	for(b = statblks; b != NULL; b = b->next) {
+		for(i = 0; i < Npstatops; i++) {
+			op = &st->op[i];
+			bop = &b->op[i];
+			op->nmsgs += __atomic_load_n(&bop->nmsgs, __ATOMIC_RELAXED);
+			op->nerrors += __atomic_load_n(&bop->nerrors, __ATOMIC_RELAXED);
+			op->bytesin += __atomic_load_n(&bop->bytesin, __ATOMIC_RELAXED);
+			op->bytesout += __atomic_load_n(&bop->bytesout, __ATOMIC_RELAXED);
+			for(j = 0; j < Nphistbuckets; j++) {
+				op->svc[j] += __atomic_load_n(&bop->svc[j],
+					__ATOMIC_RELAXED);
+				op->total[j] += __atomic_load_n(&bop->total[j],
+					__ATOMIC_RELAXED);
+			}
+		}
+	}
+	pthread_mutex_unlock(&statblk_lock);
+
+	np_srv_get_reqstats(srv, st->classes);
+	st->uptime = np_nsec() - srv->ctime;
+	st->nwthreads = srv->nwthreads;
+	idle = 0;
+	for(i = 0; i < srv->nwthreads; i++)
+		idle += __atomic_load_n(&srv->wtab[i]->idle, __ATOMIC_RELAXED);
+
+	st->busy = st->uptime * st->nwthreads;
+	st->busy = st->busy > idle ? st->busy - idle : 0;
+}
+
+static int
+np_stats_printf(char **buf, int *len, int *size, char *fmt, ...)
+{
+	int n;
+	char *p;
+	va_list ap;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return -1;
+
+		if (*len + n < *size)
+			break;
+
+		p = realloc(*buf, *size * 2);
+		if (!p)
+			return -1;
+
+		*buf = p;
+		*size *= 2;
+	}
+
+	*len += n;
+	return 0;
+}
+
+/*
+ * The snapshot as text, one line per worker pool, request class and
+ * message type that was seen. Times are in ns. The caller frees the
+ * string.
+ */
+char *
+np_srv_stats_text(Npsrv *srv)
+{
+	int i, len, size, err;
+	char *buf, opname[16];
+	Npstats *st;
+	Npopstats *op;
+	Npreqstat *cl;
+
+	st = malloc(sizeof(*st));
+	size = 4096;
+	buf = malloc(size);
+	if (!st || !buf)
+		goto error;
+
+	np_srv_get_stats(srv, st);
+	len = 0;
+	buf[0] = '\0';
+	err = np_stats_printf(&buf, &len, &size,
+		"uptime %llu workers %d busy %llu\n",
+		(unsigned long long) st->uptime, st->nwthreads,
+		(unsigned long long) st->busy);
+
+	for(i = 0; !err && i < Npclasses; i++) {
+		cl = &st->classes[i];
+		err = np_stats_printf(&buf, &len, &size,
+			"class %s depth %llu reqs %llu waitavg %llu waitmax %llu\n",
+			classnames[i], (unsigned long long) cl->depth,
+			(unsigned long long) cl->nreqs,
+			(unsigned long long) (cl->nreqs ? cl->waitsum / cl->nreqs : 0),
+			(unsigned long long) cl->waitmax);
+	}
+
+	for(i = 0; !err && i < Npstatops; i++) {
+		op = &st->op[i];
+		if (!op->nmsgs && !op->bytesin)
+			continue;
+
+		if (opnames[i])
+			snprintf(opname, sizeof(opname), "%s", opnames[i]);
+		else
+			snprintf(opname, sizeof(opname), "T%d", i * 2);
+
+		err = np_stats_printf(&buf, &len, &size,
+			"op %s msgs %llu errors %llu in %llu out %llu "
+			"svc %llu %llu %llu %llu total %llu %llu %llu %llu\n",
+			opname, (unsigned long long) op->nmsgs,
+			(unsigned long long) op->nerrors,
+			(unsigned long long) op->bytesin,
+			(unsigned long long) op->bytesout,
+			(unsigned long long) np_hist_quantile(op->svc, 0.5),
+			(unsigned long long) np_hist_quantile(op->svc, 0.9),
+			(unsigned long long) np_hist_quantile(op->svc, 0.99),
+			(unsigned long long) np_hist_quantile(op->svc, 1),
+			(unsigned long long) np_hist_quantile(op->total, 0.5),
+			(unsigned long long) np_hist_quantile(op->total, 0.9),
+			(unsigned long long) np_hist_quantile(op->total, 0.99),
+			(unsigned long long) np_hist_quantile(op->total, 1));
+	}
+
+	if (err)
+		goto error;
+
+	free(st);
+	return buf;
+
+error:
+	free(st);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Npfile operations for a file that shows np_srv_stats_text of the
+ * server in the file's aux. Each open sees a snapshot.
+ */
+static int
+np_statsfile_openfid(Npfilefid *fid)
+{
+	fid->aux = np_srv_stats_text(fid->file->aux);
+	if (!fid->aux) {
+		np_werror(Enomem, ENOMEM);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+np_statsfile_closefid(Npfilefid *fid)
+{
+	free(fid->aux);
+	fid->aux = NULL;
+}
+
+static int
+np_statsfile_read(Npfilefid *fid, u64 offset, u32 count, u8 *data,
+	Npreq *req)
+{
+	u64 len;
+
+	len = strlen(fid->aux);
+	if (offset >= len)
+		return 0;
+
+	if (offset + count > len)
+		count = len - offset;
+
+	memcpy(data, (char *) fid->aux + offset, count);
+	return count;
+}
+
+Npfileops npfile_statsops = {
+	.read = np_statsfile_read,
+	.openfid = np_statsfile_openfid,
+	.closefid = np_statsfile_closefid,
+};
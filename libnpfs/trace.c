@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+typedef struct Nptracering Nptracering;
+
+/*
+ * Binary request tracing. Each thread that receives or replies to
+ * messages copies them in fixed size records to a ring of its own.
+ * The thread is the only one that writes to the ring and the drainer
+ * the only one that reads from it, so tracing a message costs a copy
+ * and takes no locks. The drainer writes the rings to the trace file
+ * every Tracems ms. When a ring is full the records are lost and
+ * counted, the drainer writes down how many.
+ */
+enum {
+	Tracesize	= 4096,	/* records in a ring, a power of two */
+	Tracems		= 10,
+};
+
+struct Nptracering {
+	u32		head;		/* written by the thread */
+	u32		tail;		/* written by the drainer */
+	u32		lost;		/* written by the thread */
+	u32		lostseen;	/* written by the drainer */
+	int		inuse;
+	Nptracering*	next;
+	Nptrace		recs[Tracesize];
+};
+
+int np_tracing;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static Nptracering *rings;
+
+static int tracefd = -1;
+static int tracestop;
+static pthread_t tracethread;
+
+static void
+np_trace_ring_release(void *a)
+{
+	Nptracering *r;
+
+	r = a;
+	pthread_mutex_lock(&ring_lock);
+	r->inuse = 0;
+	pthread_mutex_unlock(&ring_lock);
+}
+
+static void
+np_trace_ring_init(void)
+{
+	pthread_key_create(&ring_key, np_trace_ring_release);
+}
+
+static Nptracering *
+np_trace_ring(void)
+{
+	Nptracering *r;
+
+	pthread_once(&ring_once, np_trace_ring_init);
+	r = pthread_getspecific(ring_key);
+	if (r)
+		return r;
+
+	pthread_mutex_lock(&ring_lock);
+	for(r = rings; r != NULL; r = r->next)
+		if (!r->inuse)
+			break;
+
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (r) {
+			r->next = rings;
+			__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+		}
+	}
+
+	if (r)
+		r->inuse = 1;
+	pthread_mutex_unlock(&ring_lock);
+
+	if (r)
+		pthread_setspecific(ring_key, r);
+
+	return r;
+}
+
+/*
+ * Records a message received or sent on conn. fid is the fid of the
+ * request, latency is 0 for requests.
+ */
+void
+np_trace(Npconn *conn, Npfcall *fc, u32 fid, u64 latency)
+{
+	u32 head, n;
+	Nptrace *t;
+	Nptracering *r;
+
+	r = np_trace_ring();
+	if (!r)
+		return;
+
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= Tracesize) {
+		__atomic_store_n(&r->lost, r->lost + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	t = &r->recs[head & (Tracesize - 1)];
+	t->time = np_nsec();
+	t->conn = (unsigned long) conn;
+	t->latency = latency;
+	t->fid = fid;
+	t->size = fc->size;
+	t->tag = fc->tag;
+	t->type = fc->id;
+	t->dotu = conn->dotu;
+
+	/* the data of replies from files is not in the packet */
+	n = fc->size;
+	if (fc->fd >= 0)
+		n -= fc->count;
+	if (n > Nptracecap)
+		n = Nptracecap;
+
+	t->caplen = n;
+	memcpy(t->pkt, fc->pkt, n);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int
+np_trace_write(int fd, void *buf, int len)
+{
+	int n;
+	char *p;
+
+	p = buf;
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void
+np_trace_drain(int discard)
+{
+	u32 head, tail, lost, n;
+	Nptrace lt;
+	Nptracering *r;
+
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		lost = __atomic_load_n(&r->lost, __ATOMIC_RELAXED);
+		if (lost != r->lostseen && !discard) {
+			memset(&lt, 0, sizeof(lt));
+			lt.time = np_nsec();
+			lt.size = lost - r->lostseen;
+			np_trace_write(tracefd, &lt, sizeof(lt));
+		}
+		r->lostseen = lost;
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		tail = r->tail;
+		while (tail != head) {
+			n = head - tail;
+			if (n > Tracesize - (tail & (Tracesize - 1)))
+				n = Tracesize - (tail & (Tracesize - 1));
+
+			if (!discard)
+				np_trace_write(tracefd,
+					&r->recs[tail & (Tracesize - 1)],
+					n * sizeof(Nptrace));
+			tail += n;
+		}
+
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+static void *
+np_trace_proc(void *a)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = Tracems * 1000000;
+	while (!__atomic_load_n(&tracestop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&ts, NULL);
+		np_trace_drain(0);
+	}
+
+	np_trace_drain(0);
+	return NULL;
+}
+
+/*
+ * Starts writing the messages of all servers to the file at path.
+ * Returns 0, or an errno.
+ */
+int
+np_trace_open(char *path)
+{
+	int fd, ecode;
+
+	if (tracefd >= 0)
+		return EBUSY;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return errno;
+
+	if (np_trace_write(fd, NPTRACEMAGIC, 8) < 0) {
+		ecode = errno;
+		close(fd);
+		return ecode;
+	}
+
+	/* left over from an earlier trace */
+	np_trace_drain(1);
+
+	tracefd = fd;
+	tracestop = 0;
+	ecode = pthread_create(&tracethread, NULL, np_trace_proc, NULL);
+	if (ecode) {
+		close(fd);
+		tracefd = -1;
+		return ecode;
+	}
+
+	__atomic_store_n(&np_tracing, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void
+np_trace_close(void)
+{
+	if (tracefd < 0)
+		return;
+
+	__atomic_store_n(&np_tracing, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&tracestop, 1, __ATOMIC_RELEASE);
+	pthread_join(tracethread, NULL);
+	close(tracefd);
+	tracefd = -1;
+}
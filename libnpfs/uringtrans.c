@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+typedef struct Uringtrans Uringtrans;
+typedef struct Npuring Npuring;
+
+/*
+ * The reads are submitted straight into the connection's receive
+ * buffer and the writes straight from the reply packets, so the kernel
+ * owns these buffers until the completion arrives. The transport is
+ * freed only when nothing is in flight any more.
+ */
+struct Uringtrans {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	Nptrans*	trans;
+	int		fd;
+	int		slot;		/* registered file index, or -1 */
+
+	int		reading;	/* a read is in flight */
+	int		writing;	/* a write is in flight */
+	int		ncancel;	/* cancel requests in flight */
+	int		rkick;		/* rx buffer offered since last read */
+	int		wkick;		/* tx buffer offered since last write */
+	int		busy;		/* completion thread is in a callback */
+	struct iovec	wiov[MAXWIOV];	/* the write in flight */
+	int		closing;
+	int		detached;	/* destroyed from within a callback */
+};
+
+/*
+ * All transports share one ring and one completion thread. The
+ * completion thread batches the submissions made from within the
+ * callbacks with its next wait, so a busy connection costs a single
+ * io_uring_enter per round instead of a poll wakeup and a read/write
+ * pair per message.
+ */
+struct Npuring {
+	pthread_mutex_t	lock;
+	int		init;
+	int		fd;
+	pthread_t	thread;
+	int		npending;	/* submitted by the completion thread */
+
+	unsigned*	sqhead;
+	unsigned*	sqtail;
+	unsigned*	sqmask;
+	unsigned*	sqentries;
+	unsigned*	sqarray;
+	struct io_uring_sqe*	sqes;
+
+	unsigned*	cqhead;
+	unsigned*	cqtail;
+	unsigned*	cqmask;
+	struct io_uring_cqe*	cqes;
+
+	int		nfiles;		/* 0 if the files are not registered */
+	u8*		fileused;
+};
+
+enum {
+	Ringsize	= 256,
+	Cqsize		= 4096,
+	Nfiles		= 1024,
+
+	Opread		= 1,
+	Opwrite		= 2,
+	Opcancel	= 3,
+	Opwritev	= 4,
+	Opmask		= 3,
+};
+
+static Npuring npuring = { PTHREAD_MUTEX_INITIALIZER, 0, -1 };
+
+static void np_uringtrans_destroy(Nptrans *trans);
+static void np_uringtrans_settbuf(Nptrans *trans);
+static void np_uringtrans_setrbuf(Nptrans *trans);
+static void np_uringtrans_error(Nptrans *trans);
+static void np_uringtrans_start(Uringtrans *ut);
+static int uring_init(void);
+static int uring_file_add(int fd);
+static void uring_file_del(int slot);
+static void uring_submit(Uringtrans *ut, int op, u8 *buf, u32 len, u64 target);
+static int uring_reap(int wait);
+static void *uring_proc(void *a);
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned tosubmit, unsigned mincomplete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags,
+		NULL, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+Nptrans *
+np_uringtrans_create(int fd)
+{
+	int flags;
+	Nptrans *npt;
+	Uringtrans *ut;
+
+	pthread_mutex_lock(&npuring.lock);
+	if (!npuring.init)
+		uring_init();
+	pthread_mutex_unlock(&npuring.lock);
+
+	if (npuring.fd < 0)
+		return np_fdtrans_create(fd, fd);
+
+	ut = malloc(sizeof(*ut));
+	if (!ut)
+		return NULL;
+
+	npt = np_trans_create();
+	pthread_mutex_init(&ut->lock, NULL);
+	pthread_cond_init(&ut->cond, NULL);
+	ut->trans = npt;
+	ut->fd = fd;
+	ut->slot = uring_file_add(fd);
+	ut->reading = 0;
+	ut->writing = 0;
+	ut->ncancel = 0;
+	ut->rkick = 0;
+	ut->wkick = 0;
+	ut->busy = 0;
+	ut->closing = 0;
+	ut->detached = 0;
+	npt->connected = 1;
+	npt->aux = ut;
+	npt->destroy = np_uringtrans_destroy;
+	npt->settxbuf = np_uringtrans_settbuf;
+	npt->setrxbuf = np_uringtrans_setrbuf;
+	npt->error = np_uringtrans_error;
+
+	/* the ring waits for the data, a non-blocking fd would bounce */
+	flags = fcntl(fd, F_GETFL);
+	if (flags >= 0 && flags & O_NONBLOCK)
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+	return npt;
+}
+
+static void
+uring_free(Uringtrans *ut)
+{
+	if (ut->slot >= 0)
+		uring_file_del(ut->slot);
+
+	close(ut->fd);
+	pthread_mutex_destroy(&ut->lock);
+	pthread_cond_destroy(&ut->cond);
+	free(ut);
+}
+
+/*
+ * Cancel the outstanding requests and wait for their completions.
+ * When called from a callback on the completion thread, reap the
+ * completions in place; the callback's frame frees the transport
+ * once it returns.
+ */
+static void
+np_uringtrans_destroy(Nptrans *trans)
+{
+	int self;
+	Uringtrans *ut;
+
+	ut = trans->aux;
+	self = pthread_equal(npuring.thread, pthread_self());
+	pthread_mutex_lock(&ut->lock);
+	ut->closing = 1;
+	ut->trans = NULL;
+	if (ut->reading) {
+		uring_submit(ut, Opcancel, NULL, 0, (u64) ut | Opread);
+		ut->ncancel++;
+	}
+
+	if (ut->writing) {
+		uring_submit(ut, Opcancel, NULL, 0, (u64) ut | Opwrite);
+		ut->ncancel++;
+	}
+
+	while (ut->reading || ut->writing || ut->ncancel || (!self && ut->busy)) {
+		if (self) {
+			pthread_mutex_unlock(&ut->lock);
+			uring_reap(1);
+			pthread_mutex_lock(&ut->lock);
+		} else
+			pthread_cond_wait(&ut->cond, &ut->lock);
+	}
+
+	if (self && ut->busy) {
+		ut->detached = 1;
+		pthread_mutex_unlock(&ut->lock);
+		return;
+	}
+	pthread_mutex_unlock(&ut->lock);
+
+	uring_free(ut);
+}
+
+static void
+np_uringtrans_settbuf(Nptrans *trans)
+{
+	Uringtrans *ut;
+
+	ut = trans->aux;
+	pthread_mutex_lock(&ut->lock);
+	ut->wkick = 1;
+	np_uringtrans_start(ut);
+	pthread_mutex_unlock(&ut->lock);
+}
+
+static void
+np_uringtrans_setrbuf(Nptrans *trans)
+{
+	Uringtrans *ut;
+
+	ut = trans->aux;
+	pthread_mutex_lock(&ut->lock);
+	ut->rkick = 1;
+	np_uringtrans_start(ut);
+	pthread_mutex_unlock(&ut->lock);
+}
+
+static void
+np_uringtrans_error(Nptrans *trans)
+{
+	if (trans->txbuf && trans->txbuf->error)
+		trans->txbuf->error(trans->txbuf->aux, EPIPE);
+	else if (trans->rxbuf && trans->rxbuf->error)
+		trans->rxbuf->error(trans->rxbuf->aux, EPIPE);
+}
+
+/*
+ * Submit a read and/or a write if the buffers were offered and nothing
+ * is in flight in that direction. While the completion thread is in a
+ * callback the buffers may change under us, so leave it to the
+ * completion thread to start them after the callback returns.
+ * Called with the transport lock held.
+ */
+static void
+np_uringtrans_start(Uringtrans *ut)
+{
+	u32 size;
+	Npbuf *buf;
+
+	if (ut->closing || ut->busy)
+		return;
+
+	if (!ut->reading && ut->rkick) {
+		ut->rkick = 0;
+		buf = ut->trans->rxbuf;
+		if (buf && buf->buf && buf->pos < buf->size) {
+			ut->reading = 1;
+			uring_submit(ut, Opread, buf->buf + buf->pos,
+				buf->size - buf->pos, 0);
+		}
+	}
+
+	if (!ut->writing && ut->wkick) {
+		ut->wkick = 0;
+		buf = __atomic_load_n(&ut->trans->txbuf, __ATOMIC_ACQUIRE);
+		size = buf ? __atomic_load_n(&buf->size, __ATOMIC_ACQUIRE) : 0;
+		if (size && buf->pos < size) {
+			ut->writing = 1;
+			if (buf->iov)
+				uring_submit(ut, Opwritev, (u8 *) ut->wiov,
+					np_buf_getiov(buf, ut->wiov, MAXWIOV), 0);
+			else
+				uring_submit(ut, Opwrite, buf->buf + buf->pos,
+					buf->size - buf->pos, 0);
+		}
+	}
+}
+
+static void
+np_uringtrans_complete(Uringtrans *ut, int op, int res)
+{
+	Npbuf *buf;
+	Nptrans *trans;
+
+	pthread_mutex_lock(&ut->lock);
+	if (op == Opcancel)
+		ut->ncancel--;
+	else if (op == Opread)
+		ut->reading = 0;
+	else
+		ut->writing = 0;
+
+	if (ut->closing || op == Opcancel) {
+		pthread_cond_broadcast(&ut->cond);
+		pthread_mutex_unlock(&ut->lock);
+		return;
+	}
+
+	ut->busy = 1;
+	trans = ut->trans;
+	pthread_mutex_unlock(&ut->lock);
+
+	if (op == Opread)
+		buf = trans->rxbuf;
+	else
+		buf = __atomic_load_n(&trans->txbuf, __ATOMIC_ACQUIRE);
+	if (res > 0) {
+		buf->pos += res;
+		(*buf->changed)(buf->aux);
+	} else if (res != -EAGAIN && res != -EINTR) {
+		trans->connected = 0;
+		(*buf->error)(buf->aux, res?-res:EPIPE);
+	}
+
+	pthread_mutex_lock(&ut->lock);
+	ut->busy = 0;
+	if (ut->detached) {
+		pthread_mutex_unlock(&ut->lock);
+		uring_free(ut);
+		return;
+	}
+
+	/* a partial write leaves the rest of the buffer to send */
+	if (op == Opread)
+		ut->rkick = 1;
+	else
+		ut->wkick = 1;
+
+	np_uringtrans_start(ut);
+	if (ut->closing)
+		pthread_cond_broadcast(&ut->cond);
+	pthread_mutex_unlock(&ut->lock);
+}
+
+static int
+uring_init(void)
+{
+	int i, fd;
+	u8 *sq, *cq;
+	int *files;
+	size_t sqlen, cqlen;
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+
+	npuring.init = 1;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = Cqsize;
+	fd = io_uring_setup(Ringsize, &p);
+	if (fd < 0)
+		return 0;
+
+	/* IORING_OP_READ and IORING_OP_WRITE appeared after the ring itself */
+	probe = calloc(1, sizeof(*probe) + 256*sizeof(struct io_uring_probe_op));
+	if (!probe || io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0
+	|| probe->last_op < IORING_OP_WRITE
+	|| !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+	|| !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+	|| !(probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED)) {
+		free(probe);
+		close(fd);
+		return 0;
+	}
+	free(probe);
+
+	sqlen = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqlen > sqlen)
+			sqlen = cqlen;
+		cqlen = sqlen;
+	}
+
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto error;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto error;
+	}
+
+	npuring.sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+		IORING_OFF_SQES);
+	if (npuring.sqes == MAP_FAILED)
+		goto error;
+
+	npuring.sqhead = (unsigned *) (sq + p.sq_off.head);
+	npuring.sqtail = (unsigned *) (sq + p.sq_off.tail);
+	npuring.sqmask = (unsigned *) (sq + p.sq_off.ring_mask);
+	npuring.sqentries = (unsigned *) (sq + p.sq_off.ring_entries);
+	npuring.sqarray = (unsigned *) (sq + p.sq_off.array);
+	npuring.cqhead = (unsigned *) (cq + p.cq_off.head);
+	npuring.cqtail = (unsigned *) (cq + p.cq_off.tail);
+	npuring.cqmask = (unsigned *) (cq + p.cq_off.ring_mask);
+	npuring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/*
+	 * Register a sparse file table, so the kernel doesn't have to
+	 * look up and reference the file on every request. If it is
+	 * not supported, use the plain descriptors.
+	 */
+	npuring.nfiles = 0;
+	files = malloc(Nfiles * sizeof(int));
+	npuring.fileused = calloc(Nfiles, 1);
+	if (files && npuring.fileused) {
+		for(i = 0; i < Nfiles; i++)
+			files[i] = -1;
+
+		if (io_uring_register(fd, IORING_REGISTER_FILES, files, Nfiles) == 0)
+			npuring.nfiles = Nfiles;
+	}
+	free(files);
+
+	npuring.fd = fd;
+	npuring.npending = 0;
+	if (pthread_create(&npuring.thread, NULL, uring_proc, NULL)) {
+		npuring.fd = -1;
+		goto error;
+	}
+
+	return 1;
+
+error:
+	fprintf(stderr, "cannot set up io_uring: %d\n", errno);
+	close(fd);
+	return 0;
+}
+
+static int
+uring_file_add(int fd)
+{
+	int i, slot;
+	struct io_uring_files_update up;
+
+	slot = -1;
+	pthread_mutex_lock(&npuring.lock);
+	for(i = 0; i < npuring.nfiles; i++)
+		if (!npuring.fileused[i]) {
+			npuring.fileused[i] = 1;
+			slot = i;
+			break;
+		}
+	pthread_mutex_unlock(&npuring.lock);
+
+	if (slot < 0)
+		return -1;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (unsigned long) &fd;
+	if (io_uring_register(npuring.fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) {
+		uring_file_del(slot);
+		return -1;
+	}
+
+	return slot;
+}
+
+static void
+uring_file_del(int slot)
+{
+	int fd;
+	struct io_uring_files_update up;
+
+	fd = -1;
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (unsigned long) &fd;
+	io_uring_register(npuring.fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+
+	pthread_mutex_lock(&npuring.lock);
+	npuring.fileused[slot] = 0;
+	pthread_mutex_unlock(&npuring.lock);
+}
+
+/*
+ * Queue a request on the ring. The completion thread submits the
+ * requests it queues together with its next wait, everybody else
+ * enters the ring right away.
+ */
+static void
+uring_submit(Uringtrans *ut, int op, u8 *buf, u32 len, u64 target)
+{
+	int self;
+	unsigned tail, idx;
+	struct io_uring_sqe *sqe;
+
+	self = pthread_equal(npuring.thread, pthread_self());
+	pthread_mutex_lock(&npuring.lock);
+	tail = *npuring.sqtail;
+	while (tail - __atomic_load_n(npuring.sqhead, __ATOMIC_ACQUIRE) >= *npuring.sqentries) {
+		/* the ring is full, push the queued requests to the kernel */
+		io_uring_enter(npuring.fd, *npuring.sqentries, 0, 0);
+		if (self)
+			npuring.npending = 0;
+	}
+
+	idx = tail & *npuring.sqmask;
+	sqe = &npuring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	if (op == Opcancel) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = target;
+	} else {
+		if (op == Opread)
+			sqe->opcode = IORING_OP_READ;
+		else if (op == Opwrite)
+			sqe->opcode = IORING_OP_WRITE;
+		else
+			sqe->opcode = IORING_OP_WRITEV;
+		if (ut->slot >= 0) {
+			sqe->fd = ut->slot;
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else
+			sqe->fd = ut->fd;
+		sqe->addr = (unsigned long) buf;
+		sqe->len = len;
+		sqe->off = (u64) -1;
+	}
+	sqe->user_data = (u64) ut | (op==Opwritev?Opwrite:op);
+
+	npuring.sqarray[idx] = idx;
+	__atomic_store_n(npuring.sqtail, tail + 1, __ATOMIC_RELEASE);
+	if (self)
+		npuring.npending++;
+	pthread_mutex_unlock(&npuring.lock);
+
+	if (!self)
+		io_uring_enter(npuring.fd, 1, 0, 0);
+}
+
+/*
+ * Handle one completion. If there is none and wait is set, submit the
+ * queued requests and wait for one. Only the completion thread calls
+ * this; the callbacks may call it again through np_uringtrans_destroy,
+ * so the entry is consumed before it is handled.
+ */
+static int
+uring_reap(int wait)
+{
+	int n;
+	unsigned head;
+	struct io_uring_cqe cqe;
+
+	head = *npuring.cqhead;
+	while (head == __atomic_load_n(npuring.cqtail, __ATOMIC_ACQUIRE)) {
+		if (!wait)
+			return 0;
+
+		pthread_mutex_lock(&npuring.lock);
+		n = npuring.npending;
+		npuring.npending = 0;
+		pthread_mutex_unlock(&npuring.lock);
+
+		if (io_uring_enter(npuring.fd, n, 1, IORING_ENTER_GETEVENTS) < 0
+		&& errno != EINTR && errno != EBUSY) {
+			fprintf(stderr, "io_uring_enter: %d\n", errno);
+			return -1;
+		}
+	}
+
+	cqe = npuring.cqes[head & *npuring.cqmask];
+	__atomic_store_n(npuring.cqhead, head + 1, __ATOMIC_RELEASE);
+	np_uringtrans_complete((Uringtrans *) (cqe.user_data & ~(u64) Opmask),
+		cqe.user_data & Opmask, cqe.res);
+
+	return 1;
+}
+
+static void *
+uring_proc(void *a)
+{
+	npuring.thread = pthread_self();
+	while (uring_reap(1) >= 0)
+		;
+
+	return NULL;
+}
+
+#else
+
+Nptrans *
+np_uringtrans_create(int fd)
+{
+	return np_fdtrans_create(fd, fd);
+}
+
+#endif
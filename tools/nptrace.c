@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2005 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "npfs.h"
+
+/*
+ * Prints a trace written by np_trace_open the way a server with
+ * debuglevel set prints the messages, each line prefixed with the
+ * time, the connection and, for replies, the latency. The parts of
+ * big messages that were not kept in the trace print as zeros. The
+ * records of different threads are not in time order, sort -n them.
+ */
+
+extern int printfcall(FILE *f, Npfcall *fc, int dotu);
+
+enum {
+	Maxsize	= 16*1024*1024,
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: nptrace [tracefile]\n");
+	exit(1);
+}
+
+static void
+printrec(Nptrace *t, u8 *buf)
+{
+	int n;
+	Npfcall fc;
+
+	printf("%llu.%09llu %llx ", (unsigned long long) t->time / 1000000000,
+		(unsigned long long) t->time % 1000000000,
+		(unsigned long long) t->conn);
+
+	if (t->type == 0) {
+		printf("lost %u records\n", t->size);
+		return;
+	}
+
+	if (t->size < 7 || t->size > Maxsize || t->caplen > Nptracecap) {
+		printf("bad record type %u tag %u size %u\n", t->type, t->tag,
+			t->size);
+		return;
+	}
+
+	memset(buf, 0, t->size);
+	memcpy(buf, t->pkt, t->caplen < t->size ? t->caplen : t->size);
+
+	memset(&fc, 0, sizeof(fc));
+	if (t->type % 2 == 0)
+		n = np_deserialize(&fc, buf, t->dotu);
+	else
+		n = np_deserialize_rcall(&fc, buf, t->dotu);
+
+	printf("%s ", t->type % 2 == 0 ? "<<<" : ">>>");
+	if (n)
+		printfcall(stdout, &fc, t->dotu);
+	else
+		printf("type %u tag %u fid %d size %u", t->type, t->tag,
+			t->fid, t->size);
+
+	if (t->type % 2)
+		printf(" (%llu us)", (unsigned long long) t->latency / 1000);
+
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	char magic[8];
+	u8 *buf;
+	FILE *f;
+	Nptrace t;
+
+	if (argc > 2)
+		usage();
+
+	f = stdin;
+	if (argc == 2) {
+		f = fopen(argv[1], "r");
+		if (!f) {
+			fprintf(stderr, "cannot open %s: %d\n", argv[1], errno);
+			return 1;
+		}
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1
+	|| memcmp(magic, NPTRACEMAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "not a trace file\n");
+		return 1;
+	}
+
+	buf = malloc(Maxsize);
+	if (!buf) {
+		fprintf(stderr, "no memory\n");
+		return 1;
+	}
+
+	while (fread(&t, sizeof(t), 1, f) == 1)
+		printrec(&t, buf);
+
+	free(buf);
+	return 0;
+}